@@ -16,6 +16,7 @@
 // along with SwitchWave.  If not, see <http://www.gnu.org/licenses/>.
 
 #include <cstdio>
+#include <cstdlib>
 #include <algorithm>
 
 #include <ini.h>
@@ -59,6 +60,12 @@ int Context::read_from_file() {
                 self->override_screenshot_button = v != "no";
             else if (n == "history-size")
                 self->history_size = std::atoi(v.data());
+            else if (n == "disk-cache-size")
+                self->disk_cache_size = std::strtoul(v.data(), nullptr, 0);
+            else if (n == "disk-cache-path")
+                self->disk_cache_path = v;
+            else if (n == "playlist-prefetch-size")
+                self->playlist_prefetch_size = std::strtoul(v.data(), nullptr, 0);
         } else if (s.find("network") != std::string_view::npos) {
             auto name = s.substr(s.find(':')+1);
 
@@ -67,7 +74,8 @@ int Context::read_from_file() {
             });
 
             auto &info = (it != self->network_infos.end()) ? *it :
-                self->network_infos.emplace_back(std::make_unique<NetworkFsInfo>(NetworkFsInfo{ .fs_name = name.data() }));
+                self->network_infos.emplace_back(std::make_unique<NetworkFsInfo>());
+            info->fs_name = name.data();
 
             if (n == "protocol")
                 info->protocol = (v == "smb" ? fs::NetworkFilesystem::Protocol::Smb :
@@ -88,6 +96,12 @@ int Context::read_from_file() {
                 info->username = v;
             else if (n == "password")
                 info->password = v;
+            else if (n == "nfs-readahead")
+                info->nfs_readahead = std::strtoul(v.data(), nullptr, 0);
+            else if (n == "nfs-pagecache")
+                info->nfs_pagecache = std::strtoul(v.data(), nullptr, 0);
+            else if (n == "nfs-version")
+                info->nfs_version = std::strtoul(v.data(), nullptr, 0);
         } else {
             std::printf("Unknown ini key [%s]%s = %s\n", s.data(), n.data(), v.data());
         }
@@ -124,31 +138,67 @@ int Context::write_to_file() {
     TRY_WRITE(std::fprintf(fp, "%s = %s\n",  "quit-to-home-menu",          this->quit_to_home_menu          ? "yes" : "no"));
     TRY_WRITE(std::fprintf(fp, "%s = %s\n",  "override-screenshot-button", this->override_screenshot_button ? "yes" : "no"));
     TRY_WRITE(std::fprintf(fp, "%s = %ld\n", "history-size",               this->history_size));
+    TRY_WRITE(std::fprintf(fp, "%s = %ld\n", "disk-cache-size",            this->disk_cache_size));
+    TRY_WRITE(std::fprintf(fp, "%s = %s\n",  "disk-cache-path",            this->disk_cache_path.c_str()));
+    TRY_WRITE(std::fprintf(fp, "%s = %ld\n", "playlist-prefetch-size",     this->playlist_prefetch_size));
 
     for (auto &info: this->network_infos) {
+        auto net_fs = this->get_network_fs(*info);
         TRY_WRITE(std::fprintf(fp, "[network:%s]\n",    info->fs_name   .c_str()));
         TRY_WRITE(std::fprintf(fp, "protocol = %s\n",   fs::NetworkFilesystem::protocol_name(info->protocol).data()));
-        TRY_WRITE(std::fprintf(fp, "connect = %s\n",    (info->fs && info->fs->connected()) ? "yes" : "no"));
+        TRY_WRITE(std::fprintf(fp, "connect = %s\n",    (net_fs && net_fs->connected()) ? "yes" : "no"));
         TRY_WRITE(std::fprintf(fp, "share = %s\n",      info->share     .c_str()));
         TRY_WRITE(std::fprintf(fp, "mountpoint = %s\n", info->mountpoint.c_str()));
         TRY_WRITE(std::fprintf(fp, "host = %s\n",       info->host      .c_str()));
         TRY_WRITE(std::fprintf(fp, "port = %s\n",       info->port      .c_str()));
         TRY_WRITE(std::fprintf(fp, "username = %s\n",   info->username  .c_str()));
         TRY_WRITE(std::fprintf(fp, "password = %s\n",   info->password  .c_str()));
+
+        if (info->protocol == fs::NetworkFilesystem::Protocol::Nfs) {
+            TRY_WRITE(std::fprintf(fp, "nfs-readahead = %u\n", info->nfs_readahead));
+            TRY_WRITE(std::fprintf(fp, "nfs-pagecache = %u\n", info->nfs_pagecache));
+            TRY_WRITE(std::fprintf(fp, "nfs-version = %u\n",   info->nfs_version));
+        }
     }
 
     return 0;
 }
 
-int Context::register_network_fs(NetworkFsInfo &info) {
+int Context::dump_io_stats() {
+    auto path = fs::Path(Context::AppDirectory) / Context::IoStatsFilename;
+
+    auto *fp = std::fopen(path.c_str(), "w");
+    if (!fp) {
+        std::printf("Failed to open %s\n", path.c_str());
+        this->set_error(errno);
+        return 1;
+    }
+    SW_SCOPEGUARD([&fp] { std::fclose(fp); });
+
+    for (auto &fs: this->get_filesystems()) {
+        if (auto rc = fs->stats.dump(fp, fs->name); rc < 0) {
+            this->set_error(errno);
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+int Context::register_network_fs(NetworkFsInfo &info, const NetworkFsParams &params) {
     std::shared_ptr<fs::NetworkFilesystem> fs;
 
     info.mountpoint = info.fs_name + ":";
 
-    switch (info.protocol) {
-        case fs::NetworkFilesystem::Protocol::Nfs:
-            fs = std::make_shared<fs::NfsFs>(*this, info.fs_name, info.mountpoint);
+    switch (params.protocol) {
+        case fs::NetworkFilesystem::Protocol::Nfs: {
+            auto nfs = std::make_shared<fs::NfsFs>(*this, info.fs_name, info.mountpoint);
+            nfs->set_cache_options(params.nfs_readahead, params.nfs_pagecache);
+            if (auto rc = nfs->set_version(params.nfs_version); rc)
+                return rc;
+            fs = std::move(nfs);
             break;
+        }
         case fs::NetworkFilesystem::Protocol::Smb:
             fs = std::make_shared<fs::SmbFs>(*this, info.fs_name, info.mountpoint);
             break;
@@ -163,18 +213,20 @@ int Context::register_network_fs(NetworkFsInfo &info) {
             return -1;
     }
 
-    fs->protocol = info.protocol;
+    fs->protocol = params.protocol;
 
     if (auto rc = fs->initialize(); rc)
         return rc;
 
-    if (auto rc = fs->connect(info.host, std::atoi(info.port.c_str()),
-            info.share, info.username, info.password); rc)
+    if (auto rc = fs->connect(params.host, std::atoi(params.port.c_str()),
+            params.share, params.username, params.password); rc)
         return rc;
 
     if (auto rc = fs->register_fs(); rc)
         return rc;
 
+    auto lk = std::scoped_lock(this->filesystems_mutex);
+
     info.fs = fs;
 
     this->filesystems.emplace_back(std::move(fs));
@@ -185,16 +237,19 @@ int Context::register_network_fs(NetworkFsInfo &info) {
 int Context::unregister_network_fs(NetworkFsInfo &info) {
     int rc = 0;
 
-    if (!info.fs)
+    auto fs = this->get_network_fs(info);
+    if (!fs)
         return rc;
 
-    if (info.fs->connected())
-        rc |= info.fs->disconnect();
+    if (fs->connected())
+        rc |= fs->disconnect();
+
+    auto lk = std::scoped_lock(this->filesystems_mutex);
 
-    if (this->cur_fs == info.fs)
+    if (this->cur_fs == fs)
         this->cur_fs = this->filesystems.front();
 
-    std::erase(this->filesystems, info.fs);
+    std::erase(this->filesystems, fs);
     info.fs.reset();
 
     return rc;
@@ -18,21 +18,55 @@
 #pragma once
 
 #include <algorithm>
+#include <atomic>
 #include <memory>
+#include <mutex>
 #include <string>
 #include <string_view>
+#include <utility>
+#include <vector>
 
 #include "utils.hpp"
+#include "library.hpp"
+#include "media_cache.hpp"
+#include "thumbnail.hpp"
+#include "trickplay.hpp"
 #include "fs/fs_common.hpp"
+#include "fs/fs_prefetch.hpp"
+#include "fs/fs_cache.hpp"
 #include "fs/fs_ums.hpp"
 
 namespace sw {
 
+// Cancelled background jobs which may be stuck in a network call, kept until their thread returns
+// Jobs have an atomic done flag set when their thread function exits, and join their thread on destruction
+class ParkedJobs {
+    public:
+        template <typename Job>
+        void park(std::unique_ptr<Job> job) {
+            auto *done = &job->done;
+            this->jobs.emplace_back(std::shared_ptr<void>(std::move(job)), done);
+        }
+
+        void reap() {
+            std::erase_if(this->jobs, [](const auto &job) { return job.second->load(); });
+        }
+
+    private:
+        std::vector<std::pair<std::shared_ptr<void>, const std::atomic_bool *>> jobs;
+};
+
 class Context {
     public:
         constexpr static std::string_view AppDirectory     = "sdmc:/switch/SwitchWave";
         constexpr static std::string_view SettingsFilename = "SwitchWave.conf";
-        constexpr static std::string_view HistoryFilename  = "history.txt";
+        constexpr static std::string_view HistoryFilename  = "history.bin";
+        constexpr static std::string_view LegacyHistoryFilename = "history.txt";
+        constexpr static std::string_view IoStatsFilename  = "io_stats.txt";
+        constexpr static std::string_view LibraryFilename  = "library.idx";
+        constexpr static std::string_view MediaInfoFilename = "media_info.bin";
+        constexpr static std::string_view ThumbnailsDirectory = "thumbnails";
+        constexpr static std::string_view TrickplayDirectory  = "trickplay";
 
     public:
         enum ErrorType {
@@ -43,15 +77,20 @@ class Context {
             AppletMode,
         };
 
-        struct NetworkFsInfo {
-            bool want_connect = false;
+        struct NetworkFsParams {
             fs::NetworkFilesystem::Protocol protocol;
             utils::StaticString32 host;
             utils::StaticString32 port;
             utils::StaticString32 share;
             utils::StaticString32 username, password;
+            std::uint32_t nfs_readahead = 0, nfs_pagecache = 0, nfs_version = 0; // 0 for the default
+        };
+
+        struct NetworkFsInfo: NetworkFsParams {
+            bool want_connect = false;
             utils::StaticString32 fs_name, mountpoint;
-            std::shared_ptr<fs::NetworkFilesystem> fs;
+            std::shared_ptr<fs::NetworkFilesystem> fs; // Protected by the filesystems mutex
+            std::atomic_bool connecting = false; // Set while a connection attempt is running in the background
         };
 
     // Settings
@@ -59,6 +98,9 @@ class Context {
         int read_from_file();
         int write_to_file();
 
+        // Writes the I/O counters of every filesystem to the app directory
+        int dump_io_stats();
+
         bool use_fast_presentation      = false;
         bool disable_screensaver        = true;
         bool override_screenshot_button = false;
@@ -67,6 +109,10 @@ class Context {
         std::size_t history_size = 50;
         std::string cur_path;
 
+        std::size_t disk_cache_size = 1024; // MiB, 0 to disable
+        std::size_t playlist_prefetch_size = 4; // MiB, 0 to disable
+        std::string disk_cache_path = std::string(Context::AppDirectory) + "/cache";
+
     // Context
     public:
         bool want_quit = false, cli_mode = false;
@@ -76,18 +122,37 @@ class Context {
         ErrorType last_error_type = ErrorType::Io;
 
         std::string cur_file;
+        std::string cur_file_played;                         // Playlist entry playing when the player was exited
+        double cur_file_position = 0, cur_file_duration = 0; // Playback state of that entry
 
     // Filesystem management
     public:
-        int register_network_fs  (NetworkFsInfo &info);
+        // Connections made in the background take a copy of the parameters, which the settings editor could modify
+        // The name of the share must not be changed until this returns
+        int register_network_fs  (NetworkFsInfo &info, const NetworkFsParams &params);
         int unregister_network_fs(NetworkFsInfo &info);
 
+        inline int register_network_fs(NetworkFsInfo &info) {
+            return this->register_network_fs(info, info);
+        }
+
+        inline std::shared_ptr<fs::NetworkFilesystem> get_network_fs(const NetworkFsInfo &info) const {
+            auto lk = std::scoped_lock(this->filesystems_mutex);
+            return info.fs;
+        }
+
         inline void set_error(int error, Context::ErrorType type = Context::ErrorType::Io) {
             this->last_error      = error;
             this->last_error_type = type;
         }
 
+        inline std::vector<std::shared_ptr<fs::Filesystem>> get_filesystems() const {
+            auto lk = std::scoped_lock(this->filesystems_mutex);
+            return this->filesystems;
+        }
+
         inline const fs::Filesystem *get_filesystem(std::string_view mountpoint) const {
+            auto lk = std::scoped_lock(this->filesystems_mutex);
             auto it = std::find_if(this->filesystems.begin(), this->filesystems.end(), [&mountpoint](const auto &fs) {
                 return fs->mount_name == mountpoint;
             });
@@ -100,12 +165,26 @@ class Context {
             return this->get_filesystem(path.mountpoint());
         }
 
+        // Shares are mounted from background threads, the mutex must be held when modifying the list,
+        // or iterating it outside of the UI thread. Other threads should iterate over a copy instead
+        mutable std::mutex filesystems_mutex;
         std::vector<std::shared_ptr<fs::Filesystem>> filesystems;
         std::shared_ptr<fs::Filesystem> cur_fs;
         std::vector<std::unique_ptr<NetworkFsInfo>> network_infos;
 
         fs::UmsController ums;
 
+        fs::BlockCache block_cache;
+
+        MediaInfoCache media_cache;
+        Library library;
+        ThumbnailGenerator thumbnails;
+        TrickplayGenerator trickplay;
+        fs::FilePrefetcher prefetcher;
+
+        // Directory scans of the explorer, which is rebuilt every time the menu is entered
+        ParkedJobs parked_scans;
+
     private:
         static inline auto config_path = fs::Path(Context::AppDirectory) / Context::SettingsFilename;
 };
@@ -0,0 +1,467 @@
+// Copyright (c) 2024 averne <averne381@gmail.com>
+//
+// This file is part of SwitchWave.
+//
+// SwitchWave is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// SwitchWave is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with SwitchWave.  If not, see <http://www.gnu.org/licenses/>.
+
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <algorithm>
+#include <array>
+#include <bit>
+#include <chrono>
+#include <string>
+#include <tuple>
+
+#include "utils.hpp"
+#include "fs/fs_cache.hpp"
+
+namespace sw::fs {
+
+void LinkEstimator::record(std::size_t bytes, std::chrono::steady_clock::duration duration) {
+    double x = bytes, y = std::chrono::duration_cast<std::chrono::microseconds>(duration).count();
+    if (!bytes || y <= 0)
+        return;
+
+    auto lk = std::scoped_lock(this->mutex);
+
+    // Plain averages until enough samples were seen, so the first ones don't dominate
+    auto w = std::max(1.0 / ++this->num_samples, LinkEstimator::Weight);
+    this->mean_x  += w * (x     - this->mean_x);
+    this->mean_y  += w * (y     - this->mean_y);
+    this->mean_xx += w * (x * x - this->mean_xx);
+    this->mean_xy += w * (x * y - this->mean_xy);
+}
+
+std::size_t LinkEstimator::bdp() {
+    auto lk = std::scoped_lock(this->mutex);
+
+    if (this->num_samples < LinkEstimator::MinSamples)
+        return 0;
+
+    // The fit is meaningless if reads were all about the same size
+    auto var = this->mean_xx - this->mean_x * this->mean_x, cov = this->mean_xy - this->mean_x * this->mean_y;
+    if (var < this->mean_x * this->mean_x / 16 || cov <= 0)
+        return 0;
+
+    auto us_per_byte = cov / var;
+    auto rtt_us      = this->mean_y - us_per_byte * this->mean_x;
+    return std::max(rtt_us, 0.0) / us_per_byte;
+}
+
+std::size_t LinkEstimator::recommended_rcvbuf() {
+    auto bdp = this->bdp();
+    if (!bdp)
+        return LinkEstimator::DefaultRcvbuf;
+
+    return std::clamp(std::bit_ceil(2 * bdp), LinkEstimator::MinRcvbuf, LinkEstimator::MaxRcvbuf);
+}
+
+void BlockCache::Stream::open(BlockCache &cache, IoStats &stats, std::string_view mountpoint, std::string_view path,
+        std::uint64_t size, std::int64_t mtime, ReadFn read_fn) {
+    this->close();
+
+    auto key = std::string(mountpoint) + std::string(path) + '\0' +
+        std::to_string(size) + ':' + std::to_string(mtime);
+
+    this->cache = &cache;
+    this->state = std::make_shared<StreamState>(StreamState{
+        .file_id   = utils::stable_hash(key),
+        .size      = size,
+        .read_fn   = std::move(read_fn),
+        .priority  = IoScheduler::current_priority(),
+        .estimator = &cache.estimator(mountpoint),
+        .stats     = &stats,
+    });
+}
+
+void BlockCache::Stream::close() {
+    if (!this->state)
+        return;
+
+    {
+        auto lk = std::unique_lock(this->cache->mutex);
+        this->state->closed = true;
+
+        std::erase_if(this->cache->prefetch_queue, [this](const auto &req) {
+            return req.state.lock() == this->state;
+        });
+
+        // The read callback usually captures the protocol handle, wait for the prefetcher to let go of it
+        this->cache->block_condvar.wait(lk, [this] { return this->state->inflight == 0; });
+    }
+
+    this->state.reset();
+    this->cache = nullptr;
+}
+
+ssize_t BlockCache::Stream::read(void *buf, std::size_t len) {
+    auto &state = *this->state;
+
+    if (state.pos >= state.size)
+        return 0;
+
+    len = std::min<std::uint64_t>(len, state.size - state.pos);
+
+    bool is_sequential = state.pos == state.last_end;
+    if (!is_sequential)
+        this->cache->cancel_prefetch(this->state);
+
+    std::size_t done = 0;
+    while (done < len) {
+        auto index = state.pos / BlockSize, offset = state.pos % BlockSize;
+
+        auto block = this->cache->get_block(state, index);
+        if (block->error) {
+            if (done)
+                break;
+            return -block->error;
+        }
+
+        if (block->length <= offset)
+            break;
+
+        auto size = std::min(block->length - offset, len - done);
+        std::memcpy(static_cast<std::uint8_t *>(buf) + done, block->data.get() + offset, size);
+
+        done      += size;
+        state.pos += size;
+    }
+
+    state.last_end = state.pos;
+
+    // Background jobs (eg. prefetching of the next playlist entry) work within a budget,
+    // read-ahead past what they asked for would overrun it
+    if (is_sequential && state.priority != IoScheduler::Priority::Background)
+        this->cache->schedule_prefetch(this->state, state.pos / BlockSize);
+
+    return done;
+}
+
+off_t BlockCache::Stream::seek(off_t pos, int dir) {
+    auto &state = *this->state;
+
+    off_t base;
+    switch (dir) {
+        default:
+        case SEEK_SET:
+            base = 0;
+            break;
+        case SEEK_CUR:
+            base = state.pos;
+            break;
+        case SEEK_END:
+            base = state.size;
+            break;
+    }
+
+    if (base + pos < 0)
+        return -EINVAL;
+
+    if (std::uint64_t(base + pos) != state.pos)
+        IoStats::add(state.stats->seeks);
+
+    // Nothing hits the network here, blocks around the old position stay in the LRU
+    state.pos = base + pos;
+    return state.pos;
+}
+
+BlockCache::~BlockCache() {
+    if (this->prefetch_thread.joinable()) {
+        this->prefetch_thread.request_stop();
+        this->prefetch_thread.join();
+    }
+}
+
+LinkEstimator &BlockCache::estimator(std::string_view mountpoint) {
+    auto lk = std::scoped_lock(this->mutex);
+
+    auto &estimator = this->estimators[std::string(mountpoint)];
+    if (!estimator)
+        estimator = std::make_unique<LinkEstimator>();
+
+    return *estimator;
+}
+
+std::shared_ptr<BlockCache::Block> BlockCache::get_block(StreamState &state, std::uint64_t index) {
+    auto id = BlockId{ state.file_id, index };
+
+    auto lk = std::unique_lock(this->mutex);
+
+    while (true) {
+        if (auto it = this->blocks.find(id); it != this->blocks.end()) {
+            auto block = it->second.block;
+            this->touch(it->second, state.priority);
+
+            // Block is being fetched by the prefetcher or another handle
+            this->block_condvar.wait(lk, [&block] { return block->ready; });
+
+            // The other reader failed and dropped the block, try again ourselves
+            if (block->error)
+                continue;
+
+            IoStats::add(state.stats->cache_hits);
+            return block;
+        }
+
+        IoStats::add(state.stats->cache_misses);
+
+        auto block = this->insert_pending(id, state.priority);
+        ++state.inflight;
+
+        lk.unlock();
+        this->fill_blocks(state, index, { &block, 1 });
+        lk.lock();
+
+        --state.inflight;
+        this->complete_block(id, block);
+        return block;
+    }
+}
+
+void BlockCache::fill_blocks(StreamState &state, std::uint64_t first, std::span<const std::shared_ptr<Block>> blocks) {
+    auto offset = first * BlockSize;
+    auto length = std::min<std::uint64_t>(blocks.size() * BlockSize, state.size - offset);
+
+    // Contiguous blocks are fetched with a single read, so that backends can pipeline requests
+    // Batches are then copied out to a buffer per block, so that a single cached block doesn't keep the whole
+    // batch allocated, single blocks are read in place
+    auto first_data = std::make_shared_for_overwrite<std::uint8_t[]>(BlockSize);
+    auto batch_data = std::unique_ptr<std::uint8_t[]>();
+    if (blocks.size() > 1)
+        batch_data = std::make_unique_for_overwrite<std::uint8_t[]>(blocks.size() * BlockSize);
+
+    auto *data = batch_data ? batch_data.get() : first_data.get();
+
+    // Leading blocks found on disk are not fetched again
+    std::size_t done = 0, num_from_disk = 0;
+    while (num_from_disk < blocks.size() && done < length) {
+        auto rc = this->disk_cache.read(state.file_id, first + num_from_disk, data + done, BlockSize);
+        if (rc < 0)
+            break;
+
+        IoStats::add(state.stats->disk_cache_hits);
+
+        done += rc, ++num_from_disk;
+        if (std::size_t(rc) < BlockSize)
+            break;
+    }
+
+    int error = 0;
+    while (done < length) {
+        IoScheduler::take_accounting();
+        auto start = std::chrono::steady_clock::now();
+
+        auto rc = state.read_fn(offset + done, data + done, length - done);
+        if (rc < 0) {
+            error = -rc;
+            break;
+        }
+
+        if (rc == 0)
+            break;
+
+        // Time spent queued behind other requests says nothing about the link,
+        // and preempted reads were cut short before the pipeline was full
+        if (auto accounting = IoScheduler::take_accounting(); !accounting.preempted)
+            state.estimator->record(rc, std::chrono::steady_clock::now() - start - accounting.wait_time);
+
+        IoStats::add(state.stats->bytes_fetched, rc);
+
+        done += rc;
+    }
+
+    for (std::size_t i = 0; i < blocks.size(); ++i) {
+        auto &block = *blocks[i];
+        auto start = i * BlockSize, end = std::min<std::uint64_t>(start + BlockSize, length);
+
+        block.length = done > start ? std::min(done, end) - start : 0;
+
+        if (i == 0) {
+            block.data = first_data;
+            if (batch_data)
+                std::copy_n(data, block.length, block.data.get());
+        } else if (block.length) {
+            block.data = std::make_shared_for_overwrite<std::uint8_t[]>(block.length);
+            std::copy_n(data + start, block.length, block.data.get());
+        }
+
+        // Blocks that were entirely received before the failure are still valid
+        if (error && start + block.length < end)
+            block.error = error;
+        else if (i >= num_from_disk && block.length && start + block.length == end)
+            this->disk_cache.write(state.file_id, first + i, block.data, block.length);
+    }
+}
+
+std::shared_ptr<BlockCache::Block> BlockCache::insert_pending(const BlockId &id, IoScheduler::Priority priority) {
+    auto block = std::make_shared<Block>();
+
+    // Keep blocks of background jobs (library crawl, thumbnails, trickplay) apart,
+    // so that scanning a file doesn't evict the data around the playback position
+    bool background = priority == IoScheduler::Priority::Background;
+    auto &list = background ? this->background_lru : this->lru;
+
+    list.push_front(id);
+    this->blocks.emplace(id, Entry{ block, list.begin(), background });
+
+    this->evict();
+
+    return block;
+}
+
+void BlockCache::complete_block(const BlockId &id, const std::shared_ptr<Block> &block) {
+    block->ready = true;
+
+    if (block->error) {
+        if (auto it = this->blocks.find(id); it != this->blocks.end() && it->second.block == block) {
+            (it->second.background ? this->background_lru : this->lru).erase(it->second.lru_it);
+            this->blocks.erase(it);
+        }
+    }
+
+    this->block_condvar.notify_all();
+}
+
+void BlockCache::touch(Entry &entry, IoScheduler::Priority priority) {
+    // Blocks read by a foreground consumer are promoted to the main list
+    auto &list = (priority == IoScheduler::Priority::Background) ? this->background_lru : this->lru;
+    if (!entry.background && &list == &this->background_lru)
+        return;
+
+    list.splice(list.begin(), entry.background ? this->background_lru : this->lru, entry.lru_it);
+    entry.background = &list == &this->background_lru;
+}
+
+void BlockCache::evict() {
+    for (auto *list: { &this->background_lru, &this->lru }) {
+        auto it = list->end();
+        while (this->blocks.size() > BlockCache::MaxBlocks && it != list->begin()) {
+            --it;
+
+            auto entry = this->blocks.find(*it);
+
+            // Skip blocks still being filled or currently copied from
+            auto &block = entry->second.block;
+            if (!block->ready || block.use_count() > 1)
+                continue;
+
+            this->blocks.erase(entry);
+            it = list->erase(it);
+        }
+    }
+}
+
+std::size_t BlockCache::batch_blocks(StreamState &state) {
+    auto bdp = state.estimator->bdp();
+    if (!bdp)
+        return BlockCache::DefaultBatchBlocks;
+
+    // Reads twice the size of the bandwidth-delay product spend most of their time transferring data
+    return std::clamp<std::size_t>(utils::align_up(2 * bdp, BlockSize) / BlockSize, 1, BlockCache::MaxBatchBlocks);
+}
+
+void BlockCache::schedule_prefetch(const std::shared_ptr<StreamState> &state, std::uint64_t first) {
+    auto lk = std::scoped_lock(this->mutex);
+
+    if (!this->prefetch_thread.joinable())
+        this->prefetch_thread = std::jthread(&BlockCache::prefetch_thread_fn, this);
+
+    // Keep at least two batches in flight
+    auto readahead  = std::max(BlockCache::ReadaheadBlocks, 2 * BlockCache::batch_blocks(*state));
+    auto num_blocks = utils::align_up(state->size, std::uint64_t(BlockSize)) / BlockSize;
+    auto last       = std::min(first + readahead, num_blocks);
+
+    // Read-ahead never goes before the reads of the same consumer class
+    auto priority = std::max(state->priority, IoScheduler::Priority::PlaybackPrefetch);
+    auto now      = IoScheduler::Clock::now();
+
+    for (auto i = first; i < last; ++i) {
+        if (this->blocks.contains({ state->file_id, i }))
+            continue;
+
+        auto is_queued = std::any_of(this->prefetch_queue.begin(), this->prefetch_queue.end(), [&](const auto &req) {
+            return req.index == i && req.state.lock() == state;
+        });
+
+        if (!is_queued)
+            this->prefetch_queue.push_back({ state, i, priority, now + (i - first + 1) * PrefetchDeadlineStep });
+    }
+
+    this->prefetch_condvar.notify_one();
+}
+
+void BlockCache::cancel_prefetch(const std::shared_ptr<StreamState> &state) {
+    auto lk = std::scoped_lock(this->mutex);
+
+    std::erase_if(this->prefetch_queue, [&state](const auto &req) {
+        return req.state.lock() == state;
+    });
+}
+
+void BlockCache::prefetch_thread_fn(std::stop_token token) {
+    auto lk = std::unique_lock(this->mutex);
+
+    while (true) {
+        if (!this->prefetch_condvar.wait(lk, token, [this] { return !this->prefetch_queue.empty(); }))
+            break;
+
+        // Serve the most urgent request first, so that background probes yield to playback
+        auto it = std::min_element(this->prefetch_queue.begin(), this->prefetch_queue.end(), [](const auto &a, const auto &b) {
+            return std::tie(a.priority, a.deadline) < std::tie(b.priority, b.deadline);
+        });
+
+        auto req = std::move(*it);
+        it = this->prefetch_queue.erase(it);
+
+        auto state = req.state.lock();
+        if (!state || state->closed)
+            continue;
+
+        auto index = req.index;
+        if (this->blocks.contains({ state->file_id, index }))
+            continue;
+
+        // Batch the following queued blocks of the same stream, as long as they are contiguous and not cached
+        std::array<std::shared_ptr<Block>, BlockCache::MaxBatchBlocks> batch;
+        batch[0] = this->insert_pending({ state->file_id, index }, req.priority);
+
+        std::size_t count = 1, max_count = BlockCache::batch_blocks(*state);
+        while (count < max_count && it != this->prefetch_queue.end()) {
+            if (it->index != index + count || it->state.lock() != state ||
+                    this->blocks.contains({ state->file_id, it->index }))
+                break;
+
+            it = this->prefetch_queue.erase(it);
+            batch[count] = this->insert_pending({ state->file_id, index + count }, req.priority);
+            ++count;
+        }
+
+        ++state->inflight;
+
+        lk.unlock();
+        {
+            auto priority = IoScheduler::ScopedPriority(req.priority, req.deadline);
+            this->fill_blocks(*state, index, { batch.data(), count });
+        }
+        lk.lock();
+
+        --state->inflight;
+        for (std::size_t i = 0; i < count; ++i)
+            this->complete_block({ state->file_id, index + i }, batch[i]);
+    }
+}
+
+} // namespace sw::fs
@@ -0,0 +1,210 @@
+// Copyright (c) 2024 averne <averne381@gmail.com>
+//
+// This file is part of SwitchWave.
+//
+// SwitchWave is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// SwitchWave is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with SwitchWave.  If not, see <http://www.gnu.org/licenses/>.
+
+#pragma once
+
+#include <cstdint>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <span>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <unordered_map>
+#include <sys/types.h>
+
+#include "fs/fs_disk_cache.hpp"
+#include "fs/fs_scheduler.hpp"
+#include "fs/fs_stats.hpp"
+
+namespace sw::fs {
+
+// Running estimate of the round-trip time and throughput of a share
+// Read durations are modeled as rtt + bytes / bandwidth, and fitted by exponentially weighted least squares
+class LinkEstimator {
+    public:
+        constexpr static std::size_t DefaultRcvbuf = 0x40000;  // 256KiB
+        constexpr static std::size_t MinRcvbuf     = 0x10000;  // 64KiB
+        constexpr static std::size_t MaxRcvbuf     = 0x100000; // 1MiB
+
+        void record(std::size_t bytes, std::chrono::steady_clock::duration duration);
+
+        // Bandwidth-delay product in bytes, 0 before the first sample
+        std::size_t bdp();
+
+        // Socket receive buffer fitting the link, for newly established connections
+        // Falls back to DefaultRcvbuf until enough samples were taken, eg. for the first connection to a share
+        std::size_t recommended_rcvbuf();
+
+    private:
+        constexpr static double Weight     = 1.0 / 16;
+        constexpr static int    MinSamples = 8;
+
+        std::mutex mutex;
+        int num_samples = 0;
+        // Weighted means of the read size (bytes), duration (microseconds), and their products
+        double mean_x = 0, mean_y = 0, mean_xx = 0, mean_xy = 0;
+};
+
+// Block cache shared by the network filesystems
+// Files are split in fixed-size blocks, which are kept in a global LRU and
+// identified by (mountpoint, path, size, mtime), so that different handles
+// on the same file (eg. the metadata prober, then the player) share data
+// Fetched blocks are also spilled to an optional disk cache, which is checked before the network
+class BlockCache {
+    public:
+        constexpr static std::size_t BlockSize       = 0x40000; // 256KiB
+        constexpr static std::size_t MaxBlocks       = 64;      // 16MiB
+        constexpr static std::size_t ReadaheadBlocks = 8;
+
+        // Contiguous blocks fetched by a single read, sized after the bandwidth-delay product of the share
+        constexpr static std::size_t DefaultBatchBlocks = 4;    // 1MiB
+        constexpr static std::size_t MaxBatchBlocks     = 16;   // 4MiB
+
+        // Deadline hint given to each further block of read-ahead, roughly the time to play it back at high bitrates
+        constexpr static auto PrefetchDeadlineStep = std::chrono::milliseconds(50);
+
+        // Positional read on the underlying file
+        // Returns the number of bytes read (0 on EOF), or a negative error code
+        using ReadFn = std::function<ssize_t(std::uint64_t offset, void *buf, std::size_t len)>;
+
+    private:
+        struct StreamState;
+
+    public:
+        class Stream {
+            public:
+                Stream() = default;
+                ~Stream() {
+                    this->close();
+                }
+
+                Stream(const Stream &) = delete;
+                Stream &operator =(const Stream &) = delete;
+
+                void open(BlockCache &cache, IoStats &stats, std::string_view mountpoint, std::string_view path,
+                    std::uint64_t size, std::int64_t mtime, ReadFn read_fn);
+                void close();
+
+                // Return a negative error code on failure
+                ssize_t read(void *buf, std::size_t len);
+                off_t   seek(off_t pos, int dir);
+
+                bool is_open() const {
+                    return !!this->state;
+                }
+
+            private:
+                BlockCache *cache = nullptr;
+                std::shared_ptr<StreamState> state;
+        };
+
+    public:
+        BlockCache() = default;
+        ~BlockCache();
+
+        LinkEstimator &estimator(std::string_view mountpoint);
+
+        int open_disk_cache(std::string_view directory, std::uint64_t max_size) {
+            return this->disk_cache.open(directory, max_size);
+        }
+
+    private:
+        struct Block {
+            std::shared_ptr<std::uint8_t[]> data;
+            std::size_t length = 0;
+            int error  = 0;
+            bool ready = false;
+        };
+
+        struct BlockId {
+            std::uint64_t file_id, index;
+
+            bool operator ==(const BlockId &) const = default;
+        };
+
+        struct BlockIdHash {
+            std::size_t operator ()(const BlockId &id) const {
+                return id.file_id ^ (id.index * 0x9e3779b97f4a7c15ull);
+            }
+        };
+
+        struct Entry {
+            std::shared_ptr<Block> block;
+            std::list<BlockId>::iterator lru_it;
+            bool background = false; // Whether lru_it points into background_lru
+        };
+
+        struct PrefetchRequest {
+            std::weak_ptr<StreamState> state;
+            std::uint64_t index;
+            IoScheduler::Priority priority;
+            IoScheduler::Clock::time_point deadline;
+        };
+
+        struct StreamState {
+            std::uint64_t file_id, size;
+            ReadFn read_fn;
+            IoScheduler::Priority priority;
+            LinkEstimator *estimator;
+            IoStats *stats;
+
+            std::uint64_t pos = 0, last_end = 0;
+
+            // Protected by the cache mutex
+            int  inflight = 0;
+            bool closed   = false;
+        };
+
+    private:
+        std::shared_ptr<Block> get_block(StreamState &state, std::uint64_t index);
+        void fill_blocks(StreamState &state, std::uint64_t first, std::span<const std::shared_ptr<Block>> blocks);
+
+        std::shared_ptr<Block> insert_pending(const BlockId &id, IoScheduler::Priority priority);
+        void complete_block(const BlockId &id, const std::shared_ptr<Block> &block);
+        void touch(Entry &entry, IoScheduler::Priority priority);
+        void evict();
+
+        static std::size_t batch_blocks(StreamState &state);
+
+        void schedule_prefetch(const std::shared_ptr<StreamState> &state, std::uint64_t first);
+        void cancel_prefetch(const std::shared_ptr<StreamState> &state);
+        void prefetch_thread_fn(std::stop_token token);
+
+    private:
+        std::mutex mutex;
+        std::condition_variable block_condvar;
+
+        std::unordered_map<BlockId, Entry, BlockIdHash> blocks;
+        std::list<BlockId> lru;
+        std::list<BlockId> background_lru; // Blocks only read by background jobs, evicted first
+
+        std::unordered_map<std::string, std::unique_ptr<LinkEstimator>> estimators;
+
+        DiskCache disk_cache;
+
+        std::condition_variable_any prefetch_condvar;
+        std::deque<PrefetchRequest> prefetch_queue;
+        std::jthread prefetch_thread;
+};
+
+} // namespace sw::fs
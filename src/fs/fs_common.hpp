@@ -17,13 +17,31 @@
 
 #pragma once
 
+#include <cerrno>
+#include <cstdio>
 #include <cstring>
 #include <cstdlib>
+#include <cstdint>
+#include <algorithm>
+#include <chrono>
 #include <filesystem>
+#include <memory>
+#include <mutex>
 #include <optional>
 #include <string>
+#include <string_view>
+#include <tuple>
+#include <type_traits>
+#include <unordered_map>
 #include <vector>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/syslimits.h>
 #include <sys/iosupport.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+#include "fs/fs_stats.hpp"
 
 namespace sw::fs {
 
@@ -129,7 +147,8 @@ struct Node {
     Type type;
     std::string name;
 
-    std::size_t size = 0;
+    std::size_t  size  = 0;
+    std::int64_t mtime = 0;
 };
 
 class Filesystem {
@@ -148,6 +167,8 @@ class Filesystem {
         virtual ~Filesystem() = default;
 
         int register_fs() const {
+            auto lk = std::scoped_lock(Filesystem::devoptab_mutex);
+
             auto id = FindDevice(this->mount_name.data());
 
             if (id < 0)
@@ -160,6 +181,7 @@ class Filesystem {
         }
 
         int unregister_fs() const {
+            auto lk = std::scoped_lock(Filesystem::devoptab_mutex);
             return RemoveDevice(this->mount_name.data());
         }
 
@@ -167,10 +189,322 @@ class Filesystem {
         Type type;
         std::string_view name, mount_name;
 
+        IoStats stats;
+
+    private:
+        // Shares are mounted from concurrent threads, and the devoptab table isn't synchronized
+        static inline std::mutex devoptab_mutex;
+
+    protected:
+        // Wraps a devoptab callback to record its latency in the stats of the filesystem
+        // Missing files are an expected outcome of lookups, and not counted as errors
+        template <typename Fs, IoStats::Op Op, auto Fn, typename ...Args>
+        static auto instrumented(struct _reent *r, Args ...args) {
+            auto timer = IoStats::Timer(static_cast<Fs *>(r->deviceData)->stats, Op);
+
+            auto rc = Fn(r, args...);
+
+            bool failed;
+            if constexpr (std::is_pointer_v<decltype(rc)>)
+                failed = !rc;
+            else
+                failed = rc < 0;
+
+            if (failed && __errno_r(r) != ENOENT)
+                timer.fail();
+
+            if constexpr (Op == IoStats::Op::Read) {
+                if (!failed)
+                    IoStats::add(static_cast<Fs *>(r->deviceData)->stats.bytes_read, rc);
+            }
+
+            return rc;
+        }
+
     protected:
         devoptab_t devoptab = {};
 };
 
+// Per-mount cache of directory listings and stat results, including negative ones
+// Paths are internal to the mount (eg. "/dir/file")
+class MetadataCache {
+    public:
+        using Clock = std::chrono::steady_clock;
+
+        constexpr static auto PositiveTtl = std::chrono::seconds(30);
+        constexpr static auto NegativeTtl = std::chrono::seconds(10);
+        constexpr static std::size_t MaxStats = 4096, MaxListings = 64;
+
+        struct DirEntry {
+            std::string name;
+            struct stat st;
+        };
+
+        struct Listing {
+            std::vector<DirEntry> entries;
+
+            // Whether the entries carry full attributes, or only the file type
+            bool complete = true;
+
+            // Validators for conditional requests (HTTP ETag/Last-Modified)
+            std::string etag, last_modified;
+
+            Clock::time_point expiry;
+        };
+
+        // Iteration state, either replaying a cached listing or recording a fresh one
+        struct DirState {
+            std::string path;
+            std::shared_ptr<const Listing> listing;
+            std::size_t index = 0;
+            Listing recorded;
+        };
+
+    public:
+        // Returns 0 for a cached entry, ENOENT for a cached negative entry, or nothing
+        std::optional<int> lookup_stat(std::string_view path, struct stat *st) {
+            auto key = MetadataCache::normalize(path);
+            auto now = Clock::now();
+
+            auto lk = std::scoped_lock(this->mutex);
+
+            if (auto it = this->stats.find(key); it != this->stats.end()) {
+                if (now < it->second.expiry) {
+                    it->second.last_use = ++this->use_counter;
+                    if (!it->second.exists)
+                        return ENOENT;
+                    *st = it->second.st;
+                    return 0;
+                }
+                this->stats.erase(it);
+            }
+
+            // Answer from the listing of the parent directory
+            auto parent = key.length() > 1 ? std::string(Path::parent(key)) : std::string();
+            if (auto it = this->listings.find(parent); !parent.empty() && it != this->listings.end() &&
+                    now < it->second.listing->expiry) {
+                auto &listing = *it->second.listing;
+                it->second.last_use = ++this->use_counter;
+
+                auto name = Path::filename(key);
+                auto &entries = listing.entries;
+                auto entry = std::find_if(entries.begin(), entries.end(), [&name](const auto &e) { return e.name == name; });
+
+                // Partial listings (eg. autoindex pages) may omit entries, so only complete ones are authoritative
+                if (entry == entries.end())
+                    return listing.complete ? std::optional(ENOENT) : std::nullopt;
+                if (listing.complete || S_ISDIR(entry->st.st_mode)) {
+                    *st = entry->st;
+                    return 0;
+                }
+            }
+
+            return std::nullopt;
+        }
+
+        void insert_stat(std::string_view path, const struct stat &st) {
+            this->insert_stat_entry(path, { true, st, Clock::now() + PositiveTtl });
+        }
+
+        void insert_negative(std::string_view path) {
+            this->insert_stat_entry(path, { false, {}, Clock::now() + NegativeTtl });
+        }
+
+        // Returns the cached listing if still fresh, or expired if allow_stale (for revalidation)
+        std::shared_ptr<const Listing> lookup_listing(std::string_view path, bool allow_stale = false) {
+            auto lk = std::scoped_lock(this->mutex);
+
+            auto it = this->listings.find(MetadataCache::normalize(path));
+            if (it == this->listings.end() || (!allow_stale && Clock::now() >= it->second.listing->expiry))
+                return nullptr;
+
+            it->second.last_use = ++this->use_counter;
+            return it->second.listing;
+        }
+
+        std::shared_ptr<const Listing> insert_listing(std::string_view path, Listing &&listing) {
+            listing.expiry = Clock::now() + PositiveTtl;
+            auto entry = std::make_shared<const Listing>(std::move(listing));
+
+            auto lk = std::scoped_lock(this->mutex);
+
+            MetadataCache::evict(this->listings, MaxListings, [](const auto &e) { return e.listing->expiry; });
+
+            this->listings.insert_or_assign(MetadataCache::normalize(path), ListingEntry{ entry, ++this->use_counter });
+            return entry;
+        }
+
+        // Extends the lifetime of a listing after a successful revalidation
+        void refresh_listing(std::string_view path) {
+            auto lk = std::scoped_lock(this->mutex);
+
+            if (auto it = this->listings.find(MetadataCache::normalize(path)); it != this->listings.end()) {
+                auto listing = std::make_shared<Listing>(*it->second.listing);
+                listing->expiry = Clock::now() + PositiveTtl;
+                it->second.listing = std::move(listing);
+            }
+        }
+
+        // Drops the entry and listing for path, and the listing of its parent
+        void invalidate(std::string_view path) {
+            auto key = MetadataCache::normalize(path);
+
+            auto lk = std::scoped_lock(this->mutex);
+
+            this->stats.erase(key);
+            this->listings.erase(key);
+            if (key.length() > 1)
+                this->listings.erase(std::string(Path::parent(key)));
+        }
+
+        void clear() {
+            auto lk = std::scoped_lock(this->mutex);
+
+            this->stats.clear();
+            this->listings.clear();
+        }
+
+        // Directory iteration helpers
+        // open_dir returns true if the listing can be replayed from the cache
+        bool open_dir(DirState &state, std::string_view path) {
+            state.path     = MetadataCache::normalize(path);
+            state.listing  = this->lookup_listing(state.path);
+            state.index    = 0;
+            state.recorded = {};
+            return !!state.listing;
+        }
+
+        bool next_cached(DirState &state, char *filename, struct stat *st) {
+            if (state.index >= state.listing->entries.size())
+                return false;
+
+            auto &entry = state.listing->entries[state.index++];
+            std::strncpy(filename, entry.name.c_str(), NAME_MAX);
+            *st = entry.st;
+            return true;
+        }
+
+        void record(DirState &state, std::string_view name, const struct stat &st) {
+            state.recorded.entries.push_back({ std::string(name), st });
+        }
+
+        // Commits a fully enumerated listing
+        void finish_dir(DirState &state) {
+            if (!state.listing) {
+                state.listing = this->insert_listing(state.path, std::move(state.recorded));
+                state.index   = state.listing->entries.size();
+            }
+            state.recorded = {};
+        }
+
+        void rewind_dir(DirState &state) {
+            state.index    = 0;
+            state.recorded = {};
+        }
+
+    private:
+        struct StatEntry {
+            bool exists;
+            struct stat st;
+            Clock::time_point expiry;
+            std::uint64_t last_use = 0;
+        };
+
+        struct ListingEntry {
+            std::shared_ptr<const Listing> listing;
+            std::uint64_t last_use;
+        };
+
+        // Makes room in a full map, by dropping expired entries, or failing that the least recently used eighth
+        // Expired listings are otherwise kept, for revalidation
+        template <typename Map, typename F>
+        static void evict(Map &map, std::size_t max_size, F &&expiry) {
+            if (map.size() < max_size)
+                return;
+
+            auto now = Clock::now();
+            std::erase_if(map, [&](const auto &e) { return now >= expiry(e.second); });
+            if (map.size() < max_size)
+                return;
+
+            std::vector<std::uint64_t> uses;
+            uses.reserve(map.size());
+            for (auto &[key, e]: map)
+                uses.push_back(e.last_use);
+
+            auto nth = uses.begin() + uses.size() / 8;
+            std::nth_element(uses.begin(), nth, uses.end());
+            std::erase_if(map, [threshold = *nth](const auto &e) { return e.second.last_use <= threshold; });
+        }
+
+        static std::string normalize(std::string_view path) {
+            while (path.length() > 1 && path.back() == '/')
+                path.remove_suffix(1);
+            return std::string(path);
+        }
+
+        void insert_stat_entry(std::string_view path, StatEntry &&entry) {
+            auto lk = std::scoped_lock(this->mutex);
+
+            MetadataCache::evict(this->stats, MaxStats, [](const auto &e) { return e.expiry; });
+
+            entry.last_use = ++this->use_counter;
+            this->stats.insert_or_assign(MetadataCache::normalize(path), std::move(entry));
+        }
+
+    private:
+        std::mutex mutex;
+        std::unordered_map<std::string, StatEntry> stats;
+        std::unordered_map<std::string, ListingEntry> listings;
+        std::uint64_t use_counter = 0;
+};
+
+// Disable Nagle's algorithm (requests are small and latency-bound), and size the receive
+// buffer after the bandwidth-delay product of the link, as estimated by the block cache
+// The receive buffer only matters before connecting, since the window scale is fixed by the handshake,
+// so it is left as is when rcvbuf is 0
+inline void tune_socket(int fd, std::size_t rcvbuf = 0) {
+    if (fd < 0)
+        return;
+
+    int nodelay = 1;
+    ::setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof(nodelay));
+
+    if (int size = rcvbuf; size)
+        ::setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &size, sizeof(size));
+}
+
+// Removes the oldest files with the given extension from a local cache directory, until the rest fits in max_size
+inline void trim_directory(std::string_view directory, std::string_view extension, std::uint64_t max_size) {
+    std::vector<std::tuple<std::int64_t, std::uint64_t, std::string>> files; // mtime, size, path
+    std::uint64_t total = 0;
+
+    std::error_code ec;
+    for (auto &entry: std::filesystem::directory_iterator(directory, ec)) {
+        auto path = entry.path().string();
+        if (!path.ends_with(extension))
+            continue;
+
+        struct stat st;
+        if (::stat(path.c_str(), &st) || !S_ISREG(st.st_mode))
+            continue;
+
+        total += st.st_size;
+        files.emplace_back(st.st_mtime, st.st_size, std::move(path));
+    }
+
+    if (total <= max_size)
+        return;
+
+    std::sort(files.begin(), files.end());
+    for (auto &[mtime, size, path]: files) {
+        if (total <= max_size)
+            break;
+        if (!std::remove(path.c_str()))
+            total -= size;
+    }
+}
+
 class NetworkFilesystem: public Filesystem {
     public:
         enum Protocol {
@@ -182,6 +516,9 @@ class NetworkFilesystem: public Filesystem {
             ProtocolMax,
         };
 
+        // Bound on each step of establishing a session, so that an unreachable host fails in a predictable time
+        constexpr static auto ConnectTimeout = std::chrono::seconds(3);
+
     public:
         virtual ~NetworkFilesystem() = default;
 
@@ -213,8 +550,136 @@ class NetworkFilesystem: public Filesystem {
     public:
         Protocol protocol = Protocol::Smb;
 
+        MetadataCache metadata_cache;
+
     protected:
         bool is_connected = false;
 };
 
+// Bounded set of protocol sessions, grown lazily
+// The first session serves metadata operations (listings, stat), while opened files are
+// spread over the others, so that playback reads never queue behind browsing
+// Sessions must provide a num_files counter, a mutex, and a connected() predicate
+template <typename S>
+class SessionPool {
+    public:
+        constexpr static std::size_t MaxSessions = 3;
+
+        // Sessions must have been disconnected beforehand. Those still referenced by open files are kept alive
+        // until released, and the previous primary session until the pool is destroyed, since metadata
+        // operations don't hold a reference
+        void reset(std::unique_ptr<S> &&primary = nullptr) {
+            auto lk = std::scoped_lock(this->mutex);
+
+            for (auto it = this->sessions.begin(); it != this->sessions.end(); ++it) {
+                if (it == this->sessions.begin())
+                    this->retired_primaries.emplace_back(std::move(*it));
+                else if ((*it)->num_files)
+                    this->retired.emplace_back(std::move(*it));
+            }
+
+            this->sessions.clear();
+            ++this->generation;
+
+            if (primary)
+                this->sessions.emplace_back(std::move(primary));
+        }
+
+        // Returns nullptr once the filesystem is disconnected
+        S *primary() {
+            auto lk = std::scoped_lock(this->mutex);
+            return !this->sessions.empty() ? this->sessions.front().get() : nullptr;
+        }
+
+        // Locks the primary session, returns nullptr if the filesystem is disconnected
+        S *lock_primary(std::unique_lock<decltype(S::mutex)> &lk) {
+            auto *session = this->primary();
+            if (!session)
+                return nullptr;
+
+            lk = std::unique_lock(session->mutex);
+            if (!session->connected()) {
+                lk.unlock();
+                return nullptr;
+            }
+
+            return session;
+        }
+
+        // create returns a connected session, or nullptr on failure, and destroy disconnects a session
+        // that can no longer be added. Establishing a session takes several round-trips, so create is called
+        // without holding the pool lock, the slot being reserved meanwhile
+        // Returns nullptr if the filesystem is disconnected
+        template <typename C, typename D>
+        S *acquire(C &&create, D &&destroy) {
+            auto lk = std::unique_lock(this->mutex);
+
+            if (this->sessions.empty())
+                return nullptr;
+
+            auto *best = this->least_loaded();
+            if ((!best || best->num_files) && this->sessions.size() + this->num_pending < SessionPool::MaxSessions) {
+                auto generation = this->generation;
+
+                ++this->num_pending;
+                lk.unlock();
+                auto session = create();
+                lk.lock();
+                --this->num_pending;
+
+                // The filesystem was disconnected in the meantime
+                if (this->generation != generation) {
+                    lk.unlock();
+                    if (session)
+                        destroy(*session);
+                    return nullptr;
+                }
+
+                best = session ? this->sessions.emplace_back(std::move(session)).get() : this->least_loaded();
+            }
+
+            // Share the primary session if a new one could not be established
+            if (!best)
+                best = this->sessions.front().get();
+
+            ++best->num_files;
+            return best;
+        }
+
+        void release(S &session) {
+            auto lk = std::scoped_lock(this->mutex);
+
+            if (--session.num_files)
+                return;
+
+            std::erase_if(this->retired, [&session](const auto &s) {
+                return s.get() == &session;
+            });
+        }
+
+        template <typename F>
+        void for_each(F &&f) {
+            auto lk = std::scoped_lock(this->mutex);
+            for (auto &session: this->sessions)
+                f(*session);
+        }
+
+    private:
+        S *least_loaded() {
+            S *best = nullptr;
+            for (auto it = this->sessions.begin() + 1; it < this->sessions.end(); ++it) {
+                if (!best || (*it)->num_files < best->num_files)
+                    best = it->get();
+            }
+            return best;
+        }
+
+    private:
+        std::mutex mutex;
+        std::vector<std::unique_ptr<S>> sessions;
+        std::vector<std::unique_ptr<S>> retired, retired_primaries;
+        std::size_t num_pending   = 0;
+        std::uint64_t generation  = 0;
+};
+
 } // namespace sw::fs
@@ -0,0 +1,349 @@
+// Copyright (c) 2024 averne <averne381@gmail.com>
+//
+// This file is part of SwitchWave.
+//
+// SwitchWave is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// SwitchWave is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with SwitchWave.  If not, see <http://www.gnu.org/licenses/>.
+
+#include <cerrno>
+#include <cstddef>
+#include <cstdio>
+#include <cstdlib>
+#include <algorithm>
+#include <array>
+#include <filesystem>
+#include <vector>
+#include <fcntl.h>
+#include <unistd.h>
+
+extern "C" {
+#include <libavutil/crc.h>
+}
+
+#include "utils.hpp"
+#include "fs/fs_common.hpp"
+#include "fs/fs_disk_cache.hpp"
+
+namespace sw::fs {
+
+namespace {
+
+std::uint32_t crc32(const void *data, std::size_t len) {
+    return ::av_crc(::av_crc_get_table(AV_CRC_32_IEEE_LE), 0, static_cast<const std::uint8_t *>(data), len);
+}
+
+bool read_at(int fd, std::uint64_t offset, void *buf, std::size_t len) {
+    if (::lseek(fd, offset, SEEK_SET) < 0)
+        return false;
+    return ::read(fd, buf, len) == ssize_t(len);
+}
+
+bool write_at(int fd, std::uint64_t offset, const void *buf, std::size_t len) {
+    if (::lseek(fd, offset, SEEK_SET) < 0)
+        return false;
+    return ::write(fd, buf, len) == ssize_t(len);
+}
+
+} // namespace
+
+DiskCache::SegmentFile::~SegmentFile() {
+    ::close(this->fd);
+    if (this->evicted)
+        ::unlink(this->path.c_str());
+}
+
+int DiskCache::open(std::string_view directory, std::uint64_t max_size) {
+    this->close();
+
+    std::error_code ec;
+    std::filesystem::create_directories(directory, ec);
+    if (ec)
+        return ec.value();
+
+    this->directory = directory;
+    this->max_size  = max_size;
+
+    this->worker = std::jthread([this](std::stop_token token) {
+        this->worker_fn(token);
+    });
+
+    return 0;
+}
+
+void DiskCache::close() {
+    if (!this->is_open())
+        return;
+
+    this->worker.request_stop();
+    this->worker.join();
+
+    this->segments.clear();
+    this->index.clear();
+    this->pending.clear();
+    this->total_size = 0;
+    this->ready      = false;
+}
+
+ssize_t DiskCache::read(std::uint64_t file_id, std::uint64_t index, void *buf, std::size_t len) {
+    auto key = Key{ file_id, index };
+
+    Location loc;
+    std::shared_ptr<SegmentFile> file;
+    {
+        auto lk = std::scoped_lock(this->mutex);
+        if (!this->ready)
+            return -ENOENT;
+
+        auto it = this->index.find(key);
+        if (it == this->index.end())
+            return -ENOENT;
+
+        loc = it->second;
+        if (loc.length > len)
+            return -EINVAL;
+
+        auto seg = this->segments.find(loc.segment);
+        if (seg == this->segments.end())
+            return -ENOENT;
+
+        file = seg->second.file;
+        seg->second.last_use = ++this->use_counter;
+    }
+
+    bool ok;
+    {
+        auto lk = std::scoped_lock(file->mutex);
+        ok = read_at(file->fd, loc.offset, buf, loc.length);
+    }
+
+    if (!ok || crc32(buf, loc.length) != loc.crc) {
+        auto lk = std::scoped_lock(this->mutex);
+        if (auto it = this->index.find(key); it != this->index.end() && it->second.offset == loc.offset)
+            this->index.erase(it);
+        return -EIO;
+    }
+
+    return loc.length;
+}
+
+void DiskCache::write(std::uint64_t file_id, std::uint64_t index, std::shared_ptr<const std::uint8_t[]> data,
+        std::size_t length) {
+    if (!this->is_open() || !length)
+        return;
+
+    {
+        auto lk = std::scoped_lock(this->mutex);
+
+        auto key = Key{ file_id, index };
+        if (this->pending.size() >= DiskCache::MaxPendingWrites || this->index.contains(key))
+            return;
+
+        this->pending.emplace_back(key, std::move(data), length);
+    }
+
+    this->condvar.notify_one();
+}
+
+std::string DiskCache::segment_path(std::uint32_t id) const {
+    std::array<char, 16> name;
+    std::snprintf(name.data(), name.size(), "%08x.seg", id);
+    return (Path(this->directory) / name.data()).base();
+}
+
+void DiskCache::load_segment(std::uint32_t id) {
+    auto path = this->segment_path(id);
+
+    auto fd = ::open(path.c_str(), O_RDWR);
+    if (fd < 0)
+        return;
+
+    auto file_size = ::lseek(fd, 0, SEEK_END);
+    if (file_size < 0) {
+        ::close(fd);
+        return;
+    }
+
+    std::vector<std::pair<Key, Location>> records;
+
+    std::uint64_t offset = 0;
+    while (offset + sizeof(RecordHeader) <= std::uint64_t(file_size)) {
+        RecordHeader hdr;
+        if (!read_at(fd, offset, &hdr, sizeof(hdr)))
+            break;
+
+        if (hdr.magic != DiskCache::RecordMagic ||
+                hdr.header_crc != crc32(&hdr, offsetof(RecordHeader, header_crc)) ||
+                offset + sizeof(hdr) + hdr.length > std::uint64_t(file_size))
+            break;
+
+        records.emplace_back(Key{ hdr.file_id, hdr.index }, Location{
+            .segment = id,
+            .offset  = std::uint32_t(offset + sizeof(hdr)),
+            .length  = hdr.length,
+            .crc     = hdr.data_crc,
+        });
+
+        offset += sizeof(hdr) + hdr.length;
+    }
+
+    // Drop the torn record left by an interrupted append
+    if (offset < std::uint64_t(file_size))
+        ::ftruncate(fd, offset);
+
+    auto lk = std::scoped_lock(this->mutex);
+
+    for (auto &[key, loc]: records)
+        this->index.insert_or_assign(key, loc);
+
+    this->segments.emplace(id, Segment{ std::make_shared<SegmentFile>(std::move(path), fd), offset, ++this->use_counter });
+    this->total_size += offset;
+}
+
+void DiskCache::load_index() {
+    // Segment ids are increasing, so loading them in order lets newer records replace older ones
+    std::vector<std::uint32_t> ids;
+
+    std::error_code ec;
+    for (auto &entry: std::filesystem::directory_iterator(this->directory, ec)) {
+        auto name = entry.path().filename().string();
+        if (name.length() != 12 || !name.ends_with(".seg"))
+            continue;
+
+        char *end;
+        auto id = std::strtoul(name.c_str(), &end, 16);
+        if (end == name.c_str() + 8)
+            ids.push_back(id);
+    }
+
+    std::sort(ids.begin(), ids.end());
+    for (auto id: ids)
+        this->load_segment(id);
+
+    auto lk = std::scoped_lock(this->mutex);
+    this->evict();
+    this->ready = true;
+}
+
+// Only called from the worker thread, which is the only one modifying the segment map
+int DiskCache::append(const PendingWrite &write) {
+    auto record_size = sizeof(RecordHeader) + write.length;
+
+    std::uint32_t id;
+    bool need_segment;
+    {
+        auto lk = std::scoped_lock(this->mutex);
+        if (this->index.contains(write.key))
+            return 0;
+
+        need_segment = this->segments.empty() ||
+            this->segments.rbegin()->second.size + record_size > DiskCache::SegmentSize;
+        id = this->segments.empty() ? 0 : this->segments.rbegin()->first + need_segment;
+    }
+
+    if (need_segment) {
+        auto path = this->segment_path(id);
+        auto fd = ::open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0666);
+        if (fd < 0)
+            return errno;
+
+        auto file = std::make_shared<SegmentFile>(std::move(path), fd);
+
+        auto lk = std::scoped_lock(this->mutex);
+        this->segments.emplace(id, Segment{ std::move(file), 0, ++this->use_counter });
+    }
+
+    // Only this thread grows segments, so the size can be read without the state lock
+    auto &segment = this->segments.at(id);
+    auto &file    = *segment.file;
+    auto offset   = segment.size;
+
+    RecordHeader hdr = {
+        .magic    = DiskCache::RecordMagic,
+        .length   = std::uint32_t(write.length),
+        .file_id  = write.key.file_id,
+        .index    = write.key.index,
+        .data_crc = crc32(write.data.get(), write.length),
+    };
+    hdr.header_crc = crc32(&hdr, offsetof(RecordHeader, header_crc));
+
+    // The header is written first, a record is only considered valid once its payload is entirely on disk
+    // Only reads from this segment wait on the write, others go through their own descriptor
+    {
+        auto lk = std::scoped_lock(file.mutex);
+        if (!write_at(file.fd, offset, &hdr, sizeof(hdr)) ||
+                !write_at(file.fd, offset + sizeof(hdr), write.data.get(), write.length)) {
+            auto error = errno;
+            ::ftruncate(file.fd, offset);
+            return error;
+        }
+    }
+
+    auto lk = std::scoped_lock(this->mutex);
+
+    segment.size     += record_size;
+    segment.last_use  = ++this->use_counter;
+    this->total_size += record_size;
+
+    this->index.insert_or_assign(write.key, Location{
+        .segment = id,
+        .offset  = std::uint32_t(offset + sizeof(hdr)),
+        .length  = std::uint32_t(write.length),
+        .crc     = hdr.data_crc,
+    });
+
+    this->evict();
+
+    return 0;
+}
+
+void DiskCache::evict() {
+    while (this->total_size > this->max_size && this->segments.size() > 1) {
+        // Never evict the segment being appended to
+        auto active = std::prev(this->segments.end());
+        auto victim = std::min_element(this->segments.begin(), active, [](const auto &a, const auto &b) {
+            return a.second.last_use < b.second.last_use;
+        });
+
+        auto id = victim->first;
+        std::erase_if(this->index, [id](const auto &entry) {
+            return entry.second.segment == id;
+        });
+
+        // Closed and unlinked once in-flight reads are done with it
+        victim->second.file->evicted = true;
+
+        this->total_size -= victim->second.size;
+        this->segments.erase(victim);
+    }
+}
+
+void DiskCache::worker_fn(std::stop_token token) {
+    this->load_index();
+
+    while (true) {
+        PendingWrite write;
+        {
+            auto lk = std::unique_lock(this->mutex);
+            if (!this->condvar.wait(lk, token, [this] { return !this->pending.empty(); }))
+                break;
+
+            write = std::move(this->pending.front());
+            this->pending.pop_front();
+        }
+
+        if (auto rc = this->append(write); rc)
+            std::printf("Failed to write to disk cache: %d\n", rc);
+    }
+}
+
+} // namespace sw::fs
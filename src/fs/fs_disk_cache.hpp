@@ -0,0 +1,137 @@
+// Copyright (c) 2024 averne <averne381@gmail.com>
+//
+// This file is part of SwitchWave.
+//
+// SwitchWave is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// SwitchWave is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with SwitchWave.  If not, see <http://www.gnu.org/licenses/>.
+
+#pragma once
+
+#include <cstdint>
+#include <condition_variable>
+#include <deque>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <unordered_map>
+#include <sys/types.h>
+
+namespace sw::fs {
+
+// Second cache tier on local storage, for blocks of network files
+// Blocks are appended to fixed-size segment files as self-describing records, so that the index can be rebuilt
+// from record headers alone, and a torn write only loses the tail of the last segment.
+// Whole segments are evicted in LRU order once the size limit is reached.
+class DiskCache {
+    public:
+        constexpr static std::size_t  SegmentSize      = 0x2000000; // 32MiB
+        constexpr static std::size_t  MaxPendingWrites = 32;
+        constexpr static std::uint32_t RecordMagic     = 0x4b4c4257; // "WBLK"
+
+    public:
+        DiskCache() = default;
+        ~DiskCache() {
+            this->close();
+        }
+
+        // Loads the index in the background, lookups miss until it is ready
+        int open(std::string_view directory, std::uint64_t max_size);
+        void close();
+
+        bool is_open() const {
+            return this->worker.joinable();
+        }
+
+        // Returns the length of the block, or a negative error code if it isn't cached
+        ssize_t read(std::uint64_t file_id, std::uint64_t index, void *buf, std::size_t len);
+
+        // Queues the block to be written, it is dropped if the writer lags behind
+        void write(std::uint64_t file_id, std::uint64_t index, std::shared_ptr<const std::uint8_t[]> data,
+            std::size_t length);
+
+    private:
+        struct RecordHeader {
+            std::uint32_t magic, length;
+            std::uint64_t file_id, index;
+            std::uint32_t data_crc, header_crc; // header_crc covers the preceding fields
+        };
+
+        struct Key {
+            std::uint64_t file_id, index;
+
+            bool operator ==(const Key &) const = default;
+        };
+
+        struct KeyHash {
+            std::size_t operator ()(const Key &key) const {
+                return key.file_id ^ (key.index * 0x9e3779b97f4a7c15ull);
+            }
+        };
+
+        struct Location {
+            std::uint32_t segment, offset, length, crc;
+        };
+
+        // Shared with in-flight reads, so that eviction can't close the descriptor under them
+        struct SegmentFile {
+            std::string path;
+            int fd = -1;
+            bool evicted = false;      // Unlinked once the last reference is dropped
+            std::mutex mutex;          // Serializes seeks on the descriptor
+
+            SegmentFile(std::string path, int fd): path(std::move(path)), fd(fd) { }
+            ~SegmentFile();
+        };
+
+        struct Segment {
+            std::shared_ptr<SegmentFile> file;
+            std::uint64_t size = 0, last_use = 0;
+        };
+
+        struct PendingWrite {
+            Key key;
+            std::shared_ptr<const std::uint8_t[]> data;
+            std::size_t length;
+        };
+
+    private:
+        std::string segment_path(std::uint32_t id) const;
+
+        // Scans the record headers of a segment, and truncates it after the last valid one
+        void load_segment(std::uint32_t id);
+        void load_index();
+
+        int append(const PendingWrite &write);
+        void evict();
+
+        void worker_fn(std::stop_token token);
+
+    private:
+        std::string directory;
+        std::uint64_t max_size = 0, total_size = 0, use_counter = 0;
+
+        std::mutex mutex;
+        std::condition_variable_any condvar;
+        bool ready = false;
+
+        std::map<std::uint32_t, Segment> segments;
+        std::unordered_map<Key, Location, KeyHash> index;
+        std::deque<PendingWrite> pending;
+
+        std::jthread worker;
+};
+
+} // namespace sw::fs
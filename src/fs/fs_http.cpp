@@ -15,11 +15,20 @@
 // You should have received a copy of the GNU General Public License
 // along with SwitchWave.  If not, see <http://www.gnu.org/licenses/>.
 
+#include <cctype>
 #include <cstdio>
+#include <cstdlib>
 #include <cstring>
+#include <algorithm>
+#include <array>
+#include <chrono>
 #include <memory>
+#include <optional>
 #include <string>
 #include <string_view>
+#include <tuple>
+#include <fcntl.h>
+#include <strings.h>
 #include <sys/syslimits.h>
 
 #include <curl/curl.h>
@@ -30,13 +39,87 @@ namespace sw::fs {
 
 namespace {
 
-std::size_t string_write_cb(char *ptr, std::size_t size, std::size_t nmemb, void *userdata) {
-    auto *str = static_cast<std::string *>(userdata);
+struct RangeWriter {
+    char *buf;
+    std::size_t len, done;
+};
+
+std::size_t range_write_cb(char *ptr, std::size_t size, std::size_t nmemb, void *userdata) {
+    auto *writer = static_cast<RangeWriter *>(userdata);
+    auto total = size * nmemb, copy = std::min(total, writer->len - writer->done);
+
+    std::memcpy(writer->buf + writer->done, ptr, copy);
+    writer->done += copy;
+
+    // Returning a short count aborts the transfer, in case the server sent more than requested
+    return copy;
+}
+
+struct Validators {
+    std::string etag, last_modified;
+};
+
+std::size_t validators_header_cb(char *ptr, std::size_t size, std::size_t nmemb, void *userdata) {
+    auto *validators = static_cast<Validators *>(userdata);
     auto total = size * nmemb;
-    str->append(ptr, total);
+    auto line  = std::string_view(ptr, total);
+
+    // Headers of a previous response, when following redirects
+    if (line.starts_with("HTTP/")) {
+        *validators = {};
+        return total;
+    }
+
+    auto colon = line.find(':');
+    if (colon == std::string_view::npos)
+        return total;
+
+    auto name = line.substr(0, colon), value = line.substr(colon + 1);
+    while (!value.empty() && (value.front() == ' ' || value.front() == '\t'))
+        value.remove_prefix(1);
+    while (!value.empty() && (value.back() == '\r' || value.back() == '\n' || value.back() == ' '))
+        value.remove_suffix(1);
+
+    if (name.length() == 4 && ::strncasecmp(name.data(), "etag", 4) == 0)
+        validators->etag = value;
+    else if (name.length() == 13 && ::strncasecmp(name.data(), "last-modified", 13) == 0)
+        validators->last_modified = value;
+
     return total;
 }
 
+void share_lock_cb(CURL *curl, curl_lock_data data, curl_lock_access access, void *userptr) {
+    static_cast<std::mutex *>(userptr)[data].lock();
+}
+
+void share_unlock_cb(CURL *curl, curl_lock_data data, void *userptr) {
+    static_cast<std::mutex *>(userptr)[data].unlock();
+}
+
+int sockopt_cb(void *clientp, curl_socket_t fd, curlsocktype purpose) {
+    if (purpose == CURLSOCKTYPE_IPCXN)
+        tune_socket(fd, static_cast<LinkEstimator *>(clientp)->recommended_rcvbuf());
+
+    return CURL_SOCKOPT_OK;
+}
+
+int http_translate_status(long code) {
+    switch (code) {
+        case 200 ... 299:
+            return 0;
+        case 401:
+        case 403:
+            return EACCES;
+        case 404:
+        case 410:
+            return ENOENT;
+        case 416:
+            return ESPIPE;
+        default:
+            return EIO;
+    }
+}
+
 std::string url_decode(std::string_view s) {
     std::string result;
     result.reserve(s.size());
@@ -76,60 +159,623 @@ std::string url_encode_path(std::string_view s) {
     return result;
 }
 
-void parse_autoindex(std::string_view html, std::vector<HttpFs::DirEntry> &entries) {
-    // Narrow search to <table> or <body> if present
-    auto body = html;
-    if (auto pos = html.find("<table"); pos != std::string_view::npos)
-        body = html.substr(pos);
-    else if (auto pos2 = html.find("<body"); pos2 != std::string_view::npos)
-        body = html.substr(pos2);
-
-    // Iterate over <a href="..."> tags
-    std::string_view needle = "href=\"";
-    std::size_t search_pos = 0;
+std::string decode_entities(std::string_view s) {
+    std::string result;
+    result.reserve(s.size());
 
-    while (search_pos < body.size()) {
-        auto href_start = body.find(needle, search_pos);
-        if (href_start == std::string_view::npos)
-            break;
+    for (std::size_t i = 0; i < s.size(); ++i) {
+        if (s[i] == '&') {
+            if (auto end = s.find(';', i); end != std::string_view::npos && end - i <= 8) {
+                auto entity = s.substr(i + 1, end - i - 1);
+
+                char c = 0;
+                if (entity == "amp")
+                    c = '&';
+                else if (entity == "lt")
+                    c = '<';
+                else if (entity == "gt")
+                    c = '>';
+                else if (entity == "quot")
+                    c = '"';
+                else if (entity == "apos")
+                    c = '\'';
+                else if (entity == "nbsp")
+                    c = ' ';
+                else if (entity.starts_with('#') && entity.length() > 1) {
+                    auto val = (entity[1] == 'x' || entity[1] == 'X') ?
+                        std::strtoul(entity.data() + 2, nullptr, 16) : std::strtoul(entity.data() + 1, nullptr, 10);
+                    if (val > 0 && val < 0x80)
+                        c = char(val);
+                }
+
+                if (c) {
+                    result += c;
+                    i = end;
+                    continue;
+                }
+            }
+        }
+        result += s[i];
+    }
 
-        href_start += needle.size();
-        auto href_end = body.find('"', href_start);
-        if (href_end == std::string_view::npos)
-            break;
+    return result;
+}
 
-        search_pos = href_end + 1;
+bool iequals(std::string_view a, std::string_view b) {
+    return a.length() == b.length() && ::strncasecmp(a.data(), b.data(), a.length()) == 0;
+}
 
-        auto href = body.substr(href_start, href_end - href_start);
+std::size_t ifind(std::string_view haystack, std::string_view needle, std::size_t pos = 0) {
+    for (; pos + needle.length() <= haystack.length(); ++pos) {
+        if (iequals(haystack.substr(pos, needle.length()), needle))
+            return pos;
+    }
+    return std::string_view::npos;
+}
 
-        // Skip parent directory links
-        if (href == "../" || href == "..")
+// Value of the first occurrence of a quoted attribute in a fragment of markup
+std::optional<std::string_view> find_attribute(std::string_view markup, std::string_view name) {
+    for (auto pos = ifind(markup, name); pos != std::string_view::npos; pos = ifind(markup, name, pos + 1)) {
+        // Reject partial matches (eg. "data-href")
+        if (pos > 0 && !std::isspace(static_cast<unsigned char>(markup[pos - 1])))
             continue;
 
-        // Skip external links (absolute URLs)
-        if (href.find("://") != std::string_view::npos)
+        auto eq = pos + name.length();
+        if (eq + 1 >= markup.length() || markup[eq] != '=' || (markup[eq + 1] != '"' && markup[eq + 1] != '\''))
             continue;
 
-        // Skip query/anchor-only links
-        if (!href.empty() && (href[0] == '?' || href[0] == '#'))
-            continue;
+        auto end = markup.find(markup[eq + 1], eq + 2);
+        if (end == std::string_view::npos)
+            return std::nullopt;
 
-        // Skip absolute paths that go to parent
-        if (!href.empty() && href[0] == '/')
-            continue;
+        return markup.substr(eq + 2, end - eq - 2);
+    }
+
+    return std::nullopt;
+}
+
+int month_from_name(std::string_view name) {
+    constexpr static std::array months = {
+        "jan", "feb", "mar", "apr", "may", "jun", "jul", "aug", "sep", "oct", "nov", "dec",
+    };
+
+    if (name.length() < 3)
+        return 0;
+
+    for (std::size_t i = 0; i < months.size(); ++i) {
+        if (iequals(name.substr(0, 3), months[i]))
+            return i + 1;
+    }
+
+    return 0;
+}
+
+// Parses the date formats used by autoindex modules, in UTC:
+// "2024-10-16 12:34[:56]", "2024-10-16T12:34:56Z", "16-Oct-2024 12:34", "2024-Oct-16 12:34:56",
+// and "Wed, 16 Oct 2024 12:34:56 GMT"
+// Returns the timestamp and the number of characters consumed
+std::optional<std::pair<std::int64_t, std::size_t>> parse_date(std::string_view s) {
+    std::size_t pos = 0;
+
+    auto skip = [&](std::string_view chars) {
+        while (pos < s.length() && chars.find(s[pos]) != std::string_view::npos)
+            ++pos;
+    };
+
+    auto number = [&](int &val) {
+        auto start = pos;
+        for (val = 0; pos < s.length() && std::isdigit(static_cast<unsigned char>(s[pos])) && pos - start < 4; ++pos)
+            val = val * 10 + (s[pos] - '0');
+        return pos - start;
+    };
+
+    auto word = [&] {
+        auto start = pos;
+        while (pos < s.length() && std::isalpha(static_cast<unsigned char>(s[pos])))
+            ++pos;
+        return s.substr(start, pos - start);
+    };
+
+    // Weekday
+    if (pos < s.length() && std::isalpha(static_cast<unsigned char>(s[pos]))) {
+        word();
+        skip(", ");
+    }
 
-        auto decoded = url_decode(href);
-        bool is_dir = !decoded.empty() && decoded.back() == '/';
+    int a, b = 0, c, month = 0;
+    auto len_a = number(a);
+    skip("-/ ");
+    if (pos < s.length() && std::isalpha(static_cast<unsigned char>(s[pos])))
+        month = month_from_name(word());
+    else if (!number(b))
+        return std::nullopt;
+    skip("-/ ");
+    auto len_c = number(c);
+
+    int year, day;
+    if (len_a == 4 && len_c)
+        year = a, day = c, month = month ? month : b;
+    else if (len_a && len_c == 4 && month)
+        year = c, day = a;
+    else
+        return std::nullopt;
+
+    int hour = 0, minute = 0, second = 0;
+    skip(" T");
+    if (number(hour)) {
+        if (pos >= s.length() || s[pos++] != ':' || !number(minute))
+            return std::nullopt;
+        if (pos < s.length() && s[pos] == ':') {
+            ++pos;
+            number(second);
+        }
+        if (pos < s.length() && s[pos] == '.') {
+            ++pos;
+            while (pos < s.length() && std::isdigit(static_cast<unsigned char>(s[pos])))
+                ++pos;
+        }
+    }
+
+    if (month < 1 || month > 12 || day < 1 || day > 31 || hour > 23 || minute > 59 || second > 60)
+        return std::nullopt;
+
+    auto days = std::chrono::sys_days(std::chrono::year(year) / std::chrono::month(month) / std::chrono::day(day));
+    return std::pair(days.time_since_epoch().count() * 86400ll + hour * 3600 + minute * 60 + second, pos);
+}
+
+// Parses "12345", "1.2M", "12 KiB", "3.4 GB" or "-"
+// Returns the size, whether it is exact, and the number of characters consumed
+std::optional<std::tuple<std::uint64_t, bool, std::size_t>> parse_size(std::string_view s) {
+    if (s.starts_with('-'))
+        return std::tuple(std::uint64_t(0), false, std::size_t(1));
+
+    std::size_t pos = 0;
+    std::uint64_t integer = 0;
+    while (pos < s.length() && std::isdigit(static_cast<unsigned char>(s[pos])))
+        integer = integer * 10 + (s[pos++] - '0');
 
-        // Remove trailing slash for directory names
-        if (is_dir && decoded.size() > 1)
-            decoded.pop_back();
+    if (pos == 0)
+        return std::nullopt;
 
-        if (!decoded.empty())
-            entries.push_back({ std::move(decoded), is_dir });
+    double fraction = 0, scale = 0.1;
+    if (pos + 1 < s.length() && s[pos] == '.' && std::isdigit(static_cast<unsigned char>(s[pos + 1]))) {
+        for (++pos; pos < s.length() && std::isdigit(static_cast<unsigned char>(s[pos])); ++pos, scale /= 10)
+            fraction += (s[pos] - '0') * scale;
     }
+
+    auto unit_pos = pos;
+    while (unit_pos < s.length() && s[unit_pos] == ' ')
+        ++unit_pos;
+
+    int shift = -1;
+    if (unit_pos < s.length()) {
+        switch (std::toupper(static_cast<unsigned char>(s[unit_pos]))) {
+            case 'B': shift = 0;  break;
+            case 'K': shift = 10; break;
+            case 'M': shift = 20; break;
+            case 'G': shift = 30; break;
+            case 'T': shift = 40; break;
+        }
+    }
+
+    // Not a unit, but the start of another column
+    auto after = unit_pos + 1;
+    if (shift >= 0 && after < s.length() && std::isalpha(static_cast<unsigned char>(s[after])) &&
+            s[after] != 'i' && s[after] != 'B' && s[after] != 'b')
+        shift = -1;
+
+    if (shift < 0)
+        return std::tuple(integer, fraction == 0, pos);
+
+    pos = after;
+    while (pos < s.length() && (s[pos] == 'i' || s[pos] == 'B' || s[pos] == 'b'))
+        ++pos;
+
+    return std::tuple(std::uint64_t((integer + fraction) * (1ull << shift)), shift == 0, pos);
 }
 
+// Incremental parser for directory listings, fed directly from the transfer
+// Understands the HTML indexes of nginx, Apache, Caddy and lighttpd, and the JSON and XML formats of nginx/Caddy
+// Only the record currently being received is buffered
+class AutoindexParser {
+    public:
+        AutoindexParser(std::vector<HttpFs::DirEntry> &entries): entries(entries) { }
+
+        void feed(std::string_view data) {
+            this->pending.append(data);
+
+            if (this->format == Format::Unknown && !this->detect_format())
+                return;
+
+            std::size_t consumed = 0;
+            switch (this->format) {
+                case Format::Html:
+                    consumed = this->parse_html(false);
+                    break;
+                case Format::Json:
+                    consumed = this->parse_json();
+                    break;
+                case Format::Xml:
+                    consumed = this->parse_xml();
+                    break;
+                default:
+                    break;
+            }
+
+            this->pending.erase(0, consumed);
+        }
+
+        void finish() {
+            if (this->format == Format::Html)
+                this->parse_html(true);
+            this->pending.clear();
+        }
+
+        static std::size_t write_cb(char *ptr, std::size_t size, std::size_t nmemb, void *userdata) {
+            static_cast<AutoindexParser *>(userdata)->feed({ ptr, size * nmemb });
+            return size * nmemb;
+        }
+
+    private:
+        enum class Format {
+            Unknown,
+            Html,
+            Json,
+            Xml,
+        };
+
+        bool detect_format() {
+            auto pos = this->pending.find_first_not_of(" \t\r\n");
+            if (pos == std::string::npos || this->pending.length() - pos < 5)
+                return false;
+
+            auto start = std::string_view(this->pending).substr(pos);
+            if (start.starts_with('[') || start.starts_with('{'))
+                this->format = Format::Json;
+            else if (start.starts_with("<?xml") || start.starts_with("<list"))
+                this->format = Format::Xml;
+            else
+                this->format = Format::Html;
+
+            return true;
+        }
+
+        void add_entry(std::string_view name, bool is_dir, std::uint64_t size, bool exact_size, std::int64_t mtime) {
+            // Skip parent directory links, and anything pointing outside of the directory
+            if (name.empty() || name == "." || name == "./" || name == ".." || name == "../")
+                return;
+
+            if (name.find("://") != std::string_view::npos || name[0] == '?' || name[0] == '#' || name[0] == '/')
+                return;
+
+            if (name.starts_with("./"))
+                name.remove_prefix(2);
+
+            // Drop query strings (eg. sort links)
+            if (auto pos = name.find_first_of("?#"); pos != std::string_view::npos)
+                name = name.substr(0, pos);
+
+            if (name.ends_with('/')) {
+                is_dir = true;
+                name.remove_suffix(1);
+            }
+
+            // Subdirectories are not part of this listing
+            if (name.empty() || name.find('/') != std::string_view::npos)
+                return;
+
+            this->entries.push_back({
+                .name       = std::string(name),
+                .is_dir     = is_dir,
+                .size       = is_dir ? 0 : size,
+                .exact_size = is_dir || exact_size,
+                .mtime      = mtime,
+            });
+        }
+
+        // Records are delimited by anchors, each one describing an entry along with the columns that follow it
+        std::size_t parse_html(bool at_end) {
+            auto data = std::string_view(this->pending);
+
+            auto find_anchor = [&data](std::size_t pos) {
+                for (; (pos = data.find('<', pos)) != std::string_view::npos; ++pos) {
+                    if (pos + 2 >= data.length())
+                        return std::string_view::npos;
+                    if ((data[pos + 1] == 'a' || data[pos + 1] == 'A') && std::isspace(static_cast<unsigned char>(data[pos + 2])))
+                        return pos;
+                }
+                return std::string_view::npos;
+            };
+
+            auto start = find_anchor(0);
+            if (start == std::string_view::npos)
+                return at_end ? data.length() : data.length() - std::min<std::size_t>(data.length(), 2);
+
+            while (true) {
+                auto next = find_anchor(start + 2);
+                if (next == std::string_view::npos) {
+                    if (at_end)
+                        this->parse_html_record(data.substr(start));
+                    return start;
+                }
+
+                this->parse_html_record(data.substr(start, next - start));
+                start = next;
+            }
+        }
+
+        void parse_html_record(std::string_view record) {
+            auto tag_end = record.find('>');
+            if (tag_end == std::string_view::npos)
+                return;
+
+            auto href = find_attribute(record.substr(0, tag_end), "href");
+            if (!href)
+                return;
+
+            auto name = url_decode(decode_entities(*href));
+
+            std::uint64_t size = 0;
+            std::int64_t mtime = -1;
+            bool has_size = false, exact_size = false;
+
+            // Caddy gives exact values in attributes
+            if (auto order = find_attribute(record, "data-order"); order && !order->empty() &&
+                    std::all_of(order->begin(), order->end(), [](char c) { return std::isdigit(static_cast<unsigned char>(c)); }))
+                size = std::strtoull(std::string(*order).c_str(), nullptr, 10), has_size = exact_size = true;
+
+            if (auto datetime = find_attribute(record, "datetime"); datetime) {
+                if (auto date = parse_date(*datetime); date)
+                    mtime = date->first;
+            }
+
+            // Otherwise, read the columns following the link: a date, then the size
+            if (!has_size || mtime < 0) {
+                auto text = std::string();
+                auto link_end = ifind(record, "</a>");
+                auto columns = link_end != std::string_view::npos ? record.substr(link_end + 4) : record.substr(tag_end + 1);
+
+                bool in_tag = false;
+                for (auto c: columns) {
+                    if (c == '<')
+                        in_tag = true;
+                    else if (c == '>')
+                        in_tag = false, text += ' ';
+                    else if (!in_tag)
+                        text += c;
+                }
+
+                text = decode_entities(text);
+
+                auto view = std::string_view(text);
+                auto pos  = view.find_first_of("0123456789");
+                if (pos != std::string_view::npos) {
+                    if (auto date = parse_date(view.substr(pos)); date) {
+                        if (mtime < 0)
+                            mtime = date->first;
+                        pos = view.find_first_not_of(' ', pos + date->second);
+                    }
+                }
+
+                if (!has_size && pos != std::string_view::npos) {
+                    if (auto sz = parse_size(view.substr(pos)); sz)
+                        size = std::get<0>(*sz), exact_size = std::get<1>(*sz);
+                }
+            }
+
+            this->add_entry(name, false, size, exact_size, mtime);
+        }
+
+        // nginx: <file mtime="2024-10-16T12:34:56Z" size="1234">name</file>
+        std::size_t parse_xml() {
+            auto data = std::string_view(this->pending);
+
+            std::size_t pos = 0;
+            while ((pos = data.find('<', pos)) != std::string_view::npos) {
+                auto element = data.substr(pos + 1);
+
+                bool is_dir = element.starts_with("directory");
+                if (!is_dir && !element.starts_with("file")) {
+                    if (element.length() < 9)
+                        return pos;
+                    ++pos;
+                    continue;
+                }
+
+                auto close_tag = is_dir ? std::string_view("</directory>") : std::string_view("</file>");
+                auto end = data.find(close_tag, pos);
+                if (end == std::string_view::npos)
+                    return pos;
+
+                auto record = data.substr(pos, end - pos);
+                auto tag_end = record.find('>');
+                if (tag_end != std::string_view::npos) {
+                    auto attrs = record.substr(0, tag_end);
+
+                    std::uint64_t size = 0;
+                    std::int64_t mtime = -1;
+                    if (auto attr = find_attribute(attrs, "size"); attr)
+                        size = std::strtoull(std::string(*attr).c_str(), nullptr, 10);
+                    if (auto attr = find_attribute(attrs, "mtime"); attr) {
+                        if (auto date = parse_date(*attr); date)
+                            mtime = date->first;
+                    }
+
+                    auto name = decode_entities(record.substr(tag_end + 1));
+                    this->add_entry(name, is_dir, size, true, mtime);
+                }
+
+                pos = end + close_tag.length();
+            }
+
+            return data.length();
+        }
+
+        // Array of flat objects, eg. nginx: {"name":"a","type":"file","mtime":"...","size":1}
+        // or Caddy: {"name":"a","size":1,"url":"./a","mod_time":"...","is_dir":false}
+        std::size_t parse_json() {
+            auto data = std::string_view(this->pending);
+
+            // Incomplete objects are kept at the start of the buffer
+            auto pos = this->json_scan_pos;
+            auto record_start = this->json_depth >= 2 ? std::size_t(0) : std::string_view::npos;
+            for (; pos < data.length(); ++pos) {
+                auto c = data[pos];
+
+                if (this->json_in_string) {
+                    if (this->json_escape)
+                        this->json_escape = false;
+                    else if (c == '\\')
+                        this->json_escape = true;
+                    else if (c == '"')
+                        this->json_in_string = false;
+                    continue;
+                }
+
+                if (c == '"') {
+                    this->json_in_string = true;
+                } else if (c == '{' || c == '[') {
+                    if (++this->json_depth == 2 && c == '{')
+                        record_start = pos;
+                } else if (c == '}' || c == ']') {
+                    if (this->json_depth-- == 2 && c == '}' && record_start != std::string_view::npos) {
+                        this->parse_json_record(data.substr(record_start, pos - record_start + 1));
+                        record_start = std::string_view::npos;
+                    }
+                }
+            }
+
+            if (record_start != std::string_view::npos) {
+                this->json_scan_pos = pos - record_start;
+                return record_start;
+            }
+
+            this->json_scan_pos = 0;
+            return data.length();
+        }
+
+        void parse_json_record(std::string_view object) {
+            std::string name;
+            std::uint64_t size = 0;
+            std::int64_t mtime = -1;
+            bool is_dir = false;
+
+            std::size_t pos = 1;
+
+            auto skip_ws = [&] {
+                while (pos < object.length() && std::isspace(static_cast<unsigned char>(object[pos])))
+                    ++pos;
+            };
+
+            auto read_string = [&] {
+                std::string str;
+                for (++pos; pos < object.length() && object[pos] != '"'; ++pos) {
+                    if (object[pos] == '\\' && pos + 1 < object.length()) {
+                        switch (auto c = object[++pos]) {
+                            case 'n': str += '\n'; break;
+                            case 't': str += '\t'; break;
+                            case 'u': {
+                                auto read_hex = [&](std::size_t at) {
+                                    return std::strtoul(std::string(object.substr(at, 4)).c_str(), nullptr, 16);
+                                };
+
+                                auto cp = read_hex(pos + 1);
+                                pos += 4;
+
+                                // Characters outside the BMP are escaped as a surrogate pair
+                                if (cp >= 0xd800 && cp < 0xdc00 && pos + 6 < object.length() &&
+                                        object.substr(pos + 1, 2) == "\\u") {
+                                    if (auto lo = read_hex(pos + 3); lo >= 0xdc00 && lo < 0xe000) {
+                                        cp = 0x10000 + ((cp - 0xd800) << 10) + (lo - 0xdc00);
+                                        pos += 6;
+                                    }
+                                }
+
+                                // Unpaired surrogates can't be encoded
+                                if (cp >= 0xd800 && cp < 0xe000)
+                                    cp = 0xfffd;
+
+                                if (cp < 0x80) {
+                                    str += char(cp);
+                                } else if (cp < 0x800) {
+                                    str += char(0xc0 | (cp >> 6));
+                                    str += char(0x80 | (cp & 0x3f));
+                                } else if (cp < 0x10000) {
+                                    str += char(0xe0 | (cp >> 12));
+                                    str += char(0x80 | ((cp >> 6) & 0x3f));
+                                    str += char(0x80 | (cp & 0x3f));
+                                } else {
+                                    str += char(0xf0 | (cp >> 18));
+                                    str += char(0x80 | ((cp >> 12) & 0x3f));
+                                    str += char(0x80 | ((cp >> 6) & 0x3f));
+                                    str += char(0x80 | (cp & 0x3f));
+                                }
+                                break;
+                            }
+                            default:  str += c;    break;
+                        }
+                    } else {
+                        str += object[pos];
+                    }
+                }
+                ++pos;
+                return str;
+            };
+
+            while (true) {
+                skip_ws();
+                if (pos >= object.length() || object[pos] != '"')
+                    break;
+
+                auto key = read_string();
+                skip_ws();
+                if (pos >= object.length() || object[pos] != ':')
+                    break;
+                ++pos;
+                skip_ws();
+                if (pos >= object.length())
+                    break;
+
+                if (object[pos] == '"') {
+                    auto value = read_string();
+                    if (key == "name")
+                        name = std::move(value);
+                    else if (key == "type")
+                        is_dir = value == "directory";
+                    else if (key == "mtime" || key == "mod_time") {
+                        if (auto date = parse_date(value); date)
+                            mtime = date->first;
+                    }
+                } else {
+                    auto end = object.find_first_of(",}", pos);
+                    auto value = object.substr(pos, end - pos);
+                    if (key == "size")
+                        size = std::strtoull(std::string(value).c_str(), nullptr, 10);
+                    else if (key == "is_dir")
+                        is_dir = value.starts_with("true");
+                    pos = end;
+                }
+
+                skip_ws();
+                if (pos >= object.length() || object[pos] != ',')
+                    break;
+                ++pos;
+            }
+
+            this->add_entry(name, is_dir, size, true, mtime);
+        }
+
+    private:
+        std::vector<HttpFs::DirEntry> &entries;
+
+        Format format = Format::Unknown;
+        std::string pending;
+
+        std::size_t json_scan_pos = 0;
+        int json_depth = 0;
+        bool json_in_string = false, json_escape = false;
+};
+
 } // namespace
 
 HttpFs::HttpFs(Context &context, std::string_view name, std::string_view mount_name): context(context) {
@@ -140,24 +786,24 @@ HttpFs::HttpFs(Context &context, std::string_view name, std::string_view mount_n
     this->devoptab = {
         .name         = this->name.data(),
 
-        .structSize   = 0,
-        .open_r       = HttpFs::http_open,
+        .structSize   = sizeof(HttpFsFile),
+        .open_r       = Filesystem::instrumented<HttpFs, IoStats::Op::Open, HttpFs::http_open>,
         .close_r      = HttpFs::http_close,
-        .read_r       = HttpFs::http_read,
+        .read_r       = Filesystem::instrumented<HttpFs, IoStats::Op::Read, HttpFs::http_read>,
         .seek_r       = HttpFs::http_seek,
-        .fstat_r      = HttpFs::http_fstat,
+        .fstat_r      = Filesystem::instrumented<HttpFs, IoStats::Op::Stat, HttpFs::http_fstat>,
 
-        .stat_r       = HttpFs::http_stat,
+        .stat_r       = Filesystem::instrumented<HttpFs, IoStats::Op::Stat, HttpFs::http_stat>,
 
         .dirStateSize = sizeof(HttpFsDir),
-        .diropen_r    = HttpFs::http_diropen,
+        .diropen_r    = Filesystem::instrumented<HttpFs, IoStats::Op::Readdir, HttpFs::http_diropen>,
         .dirreset_r   = HttpFs::http_dirreset,
-        .dirnext_r    = HttpFs::http_dirnext,
+        .dirnext_r    = Filesystem::instrumented<HttpFs, IoStats::Op::Readdir, HttpFs::http_dirnext>,
         .dirclose_r   = HttpFs::http_dirclose,
 
         .deviceData   = this,
 
-        .lstat_r      = HttpFs::http_lstat,
+        .lstat_r      = Filesystem::instrumented<HttpFs, IoStats::Op::Stat, HttpFs::http_lstat>,
     };
 }
 
@@ -165,12 +811,47 @@ HttpFs::~HttpFs() {
     if (this->is_connected)
         this->disconnect();
 
+    // Handles left over from a failed connection attempt
+    for (auto *curl: this->curl_pool)
+        ::curl_easy_cleanup(curl);
+
+    if (this->curl_share)
+        ::curl_share_cleanup(this->curl_share);
+
+    {
+        auto lk = std::scoped_lock(HttpFs::lib_mutex);
+        if (--HttpFs::lib_refcount == 0)
+            ::curl_global_cleanup();
+    }
+
     this->unregister_fs();
 }
 
 int HttpFs::initialize() {
-    if (auto rc = ::curl_global_init(CURL_GLOBAL_DEFAULT); rc)
-        return EIO;
+    static_assert(CURL_LOCK_DATA_LAST <= std::tuple_size_v<decltype(HttpFs::share_mutexes)>);
+
+    {
+        auto lk = std::scoped_lock(HttpFs::lib_mutex);
+        if (HttpFs::lib_refcount++ == 0) {
+            if (auto rc = ::curl_global_init(CURL_GLOBAL_DEFAULT); rc)
+                return EIO;
+        }
+    }
+
+    auto *share = ::curl_share_init();
+    if (!share)
+        return ENOMEM;
+
+    ::curl_share_setopt(share, CURLSHOPT_LOCKFUNC,   share_lock_cb);
+    ::curl_share_setopt(share, CURLSHOPT_UNLOCKFUNC, share_unlock_cb);
+    ::curl_share_setopt(share, CURLSHOPT_USERDATA,   this->share_mutexes.data());
+    ::curl_share_setopt(share, CURLSHOPT_SHARE,      CURL_LOCK_DATA_DNS);
+    ::curl_share_setopt(share, CURLSHOPT_SHARE,      CURL_LOCK_DATA_SSL_SESSION);
+
+    // The connection cache is not shared, libcurl doesn't support using it from concurrent threads
+    // Pooled handles keep their own connections alive between requests instead
+
+    this->curl_share = share;
 
     return 0;
 }
@@ -207,33 +888,17 @@ int HttpFs::connect(std::string_view host, std::uint16_t port, std::string_view
         this->userpwd += password;
     }
 
-    // Build auth URL prefix with embedded credentials for make_url()
-    std::string auth_authority = scheme;
-    if (!username.empty()) {
-        auth_authority += username;
-        auth_authority += ':';
-        auth_authority += password;
-        auth_authority += '@';
-    }
-    auth_authority += host_port;
-
-    auto auth_base = Path(std::move(auth_authority));
-    if (!share.empty())
-        auth_base /= Path(std::string(share));
-    this->auth_url_prefix = auth_base.base();
-
-    // Test connection with HEAD request
-    auto *curl = ::curl_easy_init();
+    // Test connection with HEAD request, the connection is then kept for later operations
+    auto *curl = this->acquire_curl_handle();
     if (!curl)
         return ENOMEM;
 
-    this->setup_curl_handle(curl);
     ::curl_easy_setopt(curl, CURLOPT_URL, this->base_url.c_str());
     ::curl_easy_setopt(curl, CURLOPT_NOBODY, 1L);
-    ::curl_easy_setopt(curl, CURLOPT_CONNECTTIMEOUT, 3L);
+    ::curl_easy_setopt(curl, CURLOPT_CONNECTTIMEOUT, long(ConnectTimeout.count()));
 
     auto res = ::curl_easy_perform(curl);
-    ::curl_easy_cleanup(curl);
+    this->release_curl_handle(curl);
 
     if (res != CURLE_OK) {
         std::printf("HTTP connect failed: %s\n", ::curl_easy_strerror(res));
@@ -251,7 +916,14 @@ int HttpFs::disconnect() {
 
     this->is_connected = false;
 
-    ::curl_global_cleanup();
+    {
+        auto pool_lk = std::scoped_lock(this->pool_mutex);
+        for (auto *curl: this->curl_pool)
+            ::curl_easy_cleanup(curl);
+        this->curl_pool.clear();
+    }
+
+    this->metadata_cache.clear();
 
     return 0;
 }
@@ -264,6 +936,9 @@ void HttpFs::setup_curl_handle(void *handle) {
     ::curl_easy_setopt(curl, CURLOPT_CONNECTTIMEOUT, 5L);
     ::curl_easy_setopt(curl, CURLOPT_FOLLOWLOCATION, 1L);
     ::curl_easy_setopt(curl, CURLOPT_USERAGENT, "SwitchWave/1.0");
+    ::curl_easy_setopt(curl, CURLOPT_SHARE, this->curl_share);
+    ::curl_easy_setopt(curl, CURLOPT_SOCKOPTFUNCTION, sockopt_cb);
+    ::curl_easy_setopt(curl, CURLOPT_SOCKOPTDATA, &this->context.block_cache.estimator(this->mount_name));
 
     if (!this->userpwd.empty()) {
         ::curl_easy_setopt(curl, CURLOPT_HTTPAUTH, CURLAUTH_BASIC);
@@ -271,39 +946,193 @@ void HttpFs::setup_curl_handle(void *handle) {
     }
 }
 
+void *HttpFs::acquire_curl_handle() {
+    {
+        auto lk = std::scoped_lock(this->pool_mutex);
+        if (!this->curl_pool.empty()) {
+            auto *curl = this->curl_pool.back();
+            this->curl_pool.pop_back();
+            return curl;
+        }
+    }
+
+    auto *curl = ::curl_easy_init();
+    if (curl)
+        this->setup_curl_handle(curl);
+    return curl;
+}
+
+void HttpFs::release_curl_handle(void *handle) {
+    auto *curl = static_cast<CURL *>(handle);
+
+    // Resetting options keeps the live connections and caches of the handle
+    ::curl_easy_reset(curl);
+    this->setup_curl_handle(curl);
+
+    auto lk = std::scoped_lock(this->pool_mutex);
+    if (this->curl_pool.size() < HttpFs::MaxPooledHandles)
+        this->curl_pool.push_back(curl);
+    else
+        ::curl_easy_cleanup(curl);
+}
+
+ssize_t HttpFs::pread(const std::string &url, std::uint64_t offset, char *buf, std::size_t len) {
+    auto *curl = this->acquire_curl_handle();
+    if (!curl)
+        return -ENOMEM;
+    SW_SCOPEGUARD([&] { this->release_curl_handle(curl); });
+
+    auto range  = std::to_string(offset) + '-' + std::to_string(offset + len - 1);
+    auto writer = RangeWriter{ buf, len, 0 };
+
+    ::curl_easy_setopt(curl, CURLOPT_URL, url.c_str());
+    ::curl_easy_setopt(curl, CURLOPT_RANGE, range.c_str());
+    ::curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, range_write_cb);
+    ::curl_easy_setopt(curl, CURLOPT_WRITEDATA, &writer);
+
+    auto res = ::curl_easy_perform(curl);
+    if (res != CURLE_OK && !(res == CURLE_WRITE_ERROR && writer.done == len)) {
+        std::printf("HTTP read failed: %s\n", ::curl_easy_strerror(res));
+        return -EIO;
+    }
+
+    long http_code = 0;
+    ::curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &http_code);
+
+    // Past the end of the file
+    if (http_code == 416)
+        return 0;
+
+    if (auto rc = http_translate_status(http_code); rc)
+        return -rc;
+
+    // The server ignored the range and sent the file from the start
+    if (http_code != 206 && offset != 0)
+        return -ESPIPE;
+
+    return writer.done;
+}
+
 std::string HttpFs::translate_path(const char *path) {
     return this->cwd + (path + this->mount_name.length());
 }
 
-std::string HttpFs::make_url(std::string_view path) const {
-    auto internal = Path::internal(path);
-    return this->auth_url_prefix + url_encode_path(internal);
+int HttpFs::http_open(struct _reent *r, void *fileStruct, const char *path, int flags, int mode) {
+    auto *priv      = static_cast<HttpFs *>(r->deviceData);
+    auto *priv_file = std::construct_at(static_cast<HttpFsFile *>(fileStruct));
+
+    if ((flags & O_ACCMODE) != O_RDONLY) {
+        std::destroy_at(priv_file);
+        __errno_r(r) = EROFS;
+        return -1;
+    }
+
+    auto internal_path = priv->translate_path(path);
+    priv_file->url = priv->base_url + url_encode_path(internal_path);
+
+    // A listing with exact sizes, or a recent stat, saves the HEAD request
+    if (struct stat st; priv->metadata_cache.lookup_stat(internal_path, &st) == 0 && S_ISREG(st.st_mode)) {
+        priv_file->size  = st.st_size;
+        priv_file->mtime = st.st_mtim.tv_sec;
+        priv->open_stream(*priv_file, internal_path);
+        return 0;
+    }
+
+    auto *curl = priv->acquire_curl_handle();
+    if (!curl) {
+        std::destroy_at(priv_file);
+        __errno_r(r) = ENOMEM;
+        return -1;
+    }
+    SW_SCOPEGUARD([&] { priv->release_curl_handle(curl); });
+
+    ::curl_easy_setopt(curl, CURLOPT_URL, priv_file->url.c_str());
+    ::curl_easy_setopt(curl, CURLOPT_NOBODY, 1L);
+    ::curl_easy_setopt(curl, CURLOPT_FILETIME, 1L);
+
+    if (auto res = ::curl_easy_perform(curl); res != CURLE_OK) {
+        std::destroy_at(priv_file);
+        __errno_r(r) = EIO;
+        return -1;
+    }
+
+    long http_code = 0;
+    curl_off_t size = -1, mtime = -1;
+    ::curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &http_code);
+    ::curl_easy_getinfo(curl, CURLINFO_CONTENT_LENGTH_DOWNLOAD_T, &size);
+    ::curl_easy_getinfo(curl, CURLINFO_FILETIME_T, &mtime);
+
+    if (auto rc = http_translate_status(http_code); rc) {
+        std::destroy_at(priv_file);
+        __errno_r(r) = rc;
+        return -1;
+    }
+
+    // Range requests need a known length
+    if (size < 0) {
+        std::destroy_at(priv_file);
+        __errno_r(r) = ESPIPE;
+        return -1;
+    }
+
+    priv_file->size  = size;
+    priv_file->mtime = mtime;
+
+    priv->open_stream(*priv_file, internal_path);
+
+    return 0;
 }
 
-// File operations: not supported, files are accessed via direct HTTP URL
-int HttpFs::http_open(struct _reent *r, void *fileStruct, const char *path, int flags, int mode) {
-    __errno_r(r) = ENOSYS;
-    return -1;
+void HttpFs::open_stream(HttpFsFile &file, std::string_view path) {
+    file.stream.open(this->context.block_cache, this->stats, this->mount_name, path, file.size, file.mtime,
+        [this, &file](std::uint64_t offset, void *buf, std::size_t len) -> ssize_t {
+            return this->pread(file.url, offset, static_cast<char *>(buf), len);
+        });
 }
 
 int HttpFs::http_close(struct _reent *r, void *fd) {
-    __errno_r(r) = ENOSYS;
-    return -1;
+    auto *priv_file = static_cast<HttpFsFile *>(fd);
+
+    priv_file->stream.close();
+    std::destroy_at(priv_file);
+
+    return 0;
 }
 
 ssize_t HttpFs::http_read(struct _reent *r, void *fd, char *ptr, size_t len) {
-    __errno_r(r) = ENOSYS;
-    return -1;
+    auto *priv_file = static_cast<HttpFsFile *>(fd);
+
+    if (auto rc = priv_file->stream.read(ptr, len); rc < 0) {
+        __errno_r(r) = -rc;
+        return -1;
+    } else {
+        return rc;
+    }
 }
 
 off_t HttpFs::http_seek(struct _reent *r, void *fd, off_t pos, int dir) {
-    __errno_r(r) = ENOSYS;
-    return -1;
+    auto *priv_file = static_cast<HttpFsFile *>(fd);
+
+    if (auto rc = priv_file->stream.seek(pos, dir); rc < 0) {
+        __errno_r(r) = -rc;
+        return -1;
+    } else {
+        return rc;
+    }
 }
 
 int HttpFs::http_fstat(struct _reent *r, void *fd, struct stat *st) {
-    __errno_r(r) = ENOSYS;
-    return -1;
+    auto *priv_file = static_cast<HttpFsFile *>(fd);
+
+    *st = {
+        .st_mode = S_IFREG,
+        .st_size = off_t(priv_file->size),
+        .st_mtim = {
+            .tv_sec = long(std::max<std::int64_t>(priv_file->mtime, 0)),
+        },
+    };
+
+    return 0;
 }
 
 int HttpFs::http_stat(struct _reent *r, const char *file, struct stat *st) {
@@ -312,21 +1141,28 @@ int HttpFs::http_stat(struct _reent *r, const char *file, struct stat *st) {
     auto internal_path = priv->translate_path(file);
     auto url = priv->base_url + url_encode_path(internal_path);
 
+    if (auto rc = priv->metadata_cache.lookup_stat(internal_path, st); rc) {
+        if (*rc) {
+            __errno_r(r) = *rc;
+            return -1;
+        }
+        return 0;
+    }
+
     auto lk = std::scoped_lock(priv->session_mutex);
 
-    auto *curl = ::curl_easy_init();
+    auto *curl = priv->acquire_curl_handle();
     if (!curl) {
         __errno_r(r) = ENOMEM;
         return -1;
     }
+    SW_SCOPEGUARD([&] { priv->release_curl_handle(curl); });
 
-    priv->setup_curl_handle(curl);
     ::curl_easy_setopt(curl, CURLOPT_URL, url.c_str());
     ::curl_easy_setopt(curl, CURLOPT_NOBODY, 1L);
 
     auto res = ::curl_easy_perform(curl);
     if (res != CURLE_OK) {
-        ::curl_easy_cleanup(curl);
         __errno_r(r) = ENOENT;
         return -1;
     }
@@ -343,13 +1179,16 @@ int HttpFs::http_stat(struct _reent *r, const char *file, struct stat *st) {
             ::curl_easy_getinfo(curl, CURLINFO_CONTENT_LENGTH_DOWNLOAD_T, &cl);
             st->st_size = (cl >= 0) ? cl : 0;
             st->st_mode = S_IFREG;
+            priv->metadata_cache.insert_stat(internal_path, *st);
             break;
         }
         case 301:
         case 302:
             st->st_mode = S_IFDIR;
+            priv->metadata_cache.insert_stat(internal_path, *st);
             break;
         case 404:
+            priv->metadata_cache.insert_negative(internal_path);
             __errno_r(r) = ENOENT, ret = -1;
             break;
         case 403:
@@ -360,7 +1199,6 @@ int HttpFs::http_stat(struct _reent *r, const char *file, struct stat *st) {
             break;
     }
 
-    ::curl_easy_cleanup(curl);
     return ret;
 }
 
@@ -371,31 +1209,51 @@ int HttpFs::http_lstat(struct _reent *r, const char *file, struct stat *st) {
 DIR_ITER *HttpFs::http_diropen(struct _reent *r, DIR_ITER *dirState, const char *path) {
     auto *priv = static_cast<HttpFs *>(r->deviceData);
     auto *priv_dir = std::construct_at(reinterpret_cast<HttpFsDir *>(dirState->dirStruct));
-    priv_dir->index = 0;
 
     auto internal_path = priv->translate_path(path);
+    if (priv->metadata_cache.open_dir(priv_dir->cache, internal_path))
+        return dirState;
+
     auto url = priv->base_url + url_encode_path(internal_path);
     if (url.back() != '/')
         url += '/';
 
+    // An expired listing can still be revalidated with a conditional request
+    auto stale = priv->metadata_cache.lookup_listing(internal_path, true);
+
     auto lk = std::scoped_lock(priv->session_mutex);
 
-    auto *curl = ::curl_easy_init();
+    auto *curl = priv->acquire_curl_handle();
     if (!curl) {
         std::destroy_at(priv_dir);
         __errno_r(r) = ENOMEM;
         return nullptr;
     }
 
-    priv->setup_curl_handle(curl);
-
-    std::string html;
+    std::vector<DirEntry> entries;
+    auto parser = AutoindexParser(entries);
+    Validators validators;
     ::curl_easy_setopt(curl, CURLOPT_URL, url.c_str());
-    ::curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, string_write_cb);
-    ::curl_easy_setopt(curl, CURLOPT_WRITEDATA, &html);
+    ::curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, AutoindexParser::write_cb);
+    ::curl_easy_setopt(curl, CURLOPT_WRITEDATA, &parser);
+    ::curl_easy_setopt(curl, CURLOPT_HEADERFUNCTION, validators_header_cb);
+    ::curl_easy_setopt(curl, CURLOPT_HEADERDATA, &validators);
+
+    struct curl_slist *headers = nullptr;
+    if (stale && !stale->etag.empty())
+        headers = ::curl_slist_append(headers, ("If-None-Match: " + stale->etag).c_str());
+    if (stale && !stale->last_modified.empty())
+        headers = ::curl_slist_append(headers, ("If-Modified-Since: " + stale->last_modified).c_str());
+    if (headers)
+        ::curl_easy_setopt(curl, CURLOPT_HTTPHEADER, headers);
 
     auto res = ::curl_easy_perform(curl);
-    ::curl_easy_cleanup(curl);
+
+    long http_code = 0;
+    ::curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &http_code);
+
+    priv->release_curl_handle(curl);
+    ::curl_slist_free_all(headers);
 
     if (res != CURLE_OK) {
         std::destroy_at(priv_dir);
@@ -403,32 +1261,62 @@ DIR_ITER *HttpFs::http_diropen(struct _reent *r, DIR_ITER *dirState, const char
         return nullptr;
     }
 
-    parse_autoindex(html, priv_dir->entries);
+    if (http_code == 304 && stale) {
+        priv->metadata_cache.refresh_listing(internal_path);
+        priv_dir->cache.listing = stale;
+        return dirState;
+    }
+
+    if (auto rc = http_translate_status(http_code); rc) {
+        if (rc == ENOENT)
+            priv->metadata_cache.insert_negative(internal_path);
+        std::destroy_at(priv_dir);
+        __errno_r(r) = rc;
+        return nullptr;
+    }
+
+    parser.finish();
+
+    // Sizes shown in a human-readable form are only approximations, stats then still need a HEAD request
+    auto listing = MetadataCache::Listing{
+        .complete      = std::all_of(entries.begin(), entries.end(), [](const auto &e) { return e.exact_size; }),
+        .etag          = std::move(validators.etag),
+        .last_modified = std::move(validators.last_modified),
+    };
+
+    listing.entries.reserve(entries.size());
+    for (auto &entry: entries) {
+        listing.entries.push_back({ std::move(entry.name), {
+            .st_mode = mode_t(entry.is_dir ? S_IFDIR : S_IFREG),
+            .st_size = off_t(entry.size),
+            .st_mtim = {
+                .tv_sec = long(std::max<std::int64_t>(entry.mtime, 0)),
+            },
+        }});
+    }
+
+    priv_dir->cache.listing = priv->metadata_cache.insert_listing(internal_path, std::move(listing));
 
     return dirState;
 }
 
 int HttpFs::http_dirreset(struct _reent *r, DIR_ITER *dirState) {
+    auto *priv     = static_cast<HttpFs    *>(r->deviceData);
     auto *priv_dir = static_cast<HttpFsDir *>(dirState->dirStruct);
-    priv_dir->index = 0;
 
+    priv->metadata_cache.rewind_dir(priv_dir->cache);
     return 0;
 }
 
 int HttpFs::http_dirnext(struct _reent *r, DIR_ITER *dirState, char *filename, struct stat *filestat) {
+    auto *priv     = static_cast<HttpFs    *>(r->deviceData);
     auto *priv_dir = static_cast<HttpFsDir *>(dirState->dirStruct);
 
-    if (priv_dir->index >= priv_dir->entries.size()) {
+    if (!priv->metadata_cache.next_cached(priv_dir->cache, filename, filestat)) {
         __errno_r(r) = ENOENT;
         return -1;
     }
 
-    auto &entry = priv_dir->entries[priv_dir->index++];
-    std::strncpy(filename, entry.href.c_str(), NAME_MAX);
-
-    *filestat = {};
-    filestat->st_mode = entry.is_dir ? S_IFDIR : S_IFREG;
-
     return 0;
 }
 
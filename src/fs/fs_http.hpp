@@ -17,6 +17,7 @@
 
 #pragma once
 
+#include <array>
 #include <mutex>
 #include <string>
 #include <string_view>
@@ -24,6 +25,8 @@
 
 #include "context.hpp"
 #include "fs/fs_common.hpp"
+#include "fs/fs_cache.hpp"
+#include "fs/fs_scheduler.hpp"
 
 namespace sw::fs {
 
@@ -37,17 +40,34 @@ class HttpFs final: public NetworkFilesystem {
             std::string_view username, std::string_view password) override;
         virtual int disconnect() override;
 
-        std::string make_url(std::string_view path) const;
-
         struct DirEntry {
-            std::string href;
+            std::string name;
             bool is_dir;
+            std::uint64_t size;
+            bool exact_size;
+            std::int64_t mtime; // -1 if unknown
         };
 
     private:
+        constexpr static std::size_t MaxPooledHandles = 4;
+
+        // Shares are mounted concurrently, and library setup and teardown are not thread-safe
+        static inline std::mutex lib_mutex;
+        static inline int lib_refcount = 0;
+
         std::string translate_path(const char *path);
         void setup_curl_handle(void *curl);
 
+        // Easy handles are recycled so that connections (and TLS sessions) are kept alive
+        void *acquire_curl_handle();
+        void  release_curl_handle(void *curl);
+
+        // Returns a negative error code on failure
+        ssize_t pread(const std::string &url, std::uint64_t offset, char *buf, std::size_t len);
+
+        struct HttpFsFile;
+        void open_stream(HttpFsFile &file, std::string_view path);
+
         static int       http_open    (struct _reent *r, void *fileStruct, const char *path, int flags, int mode);
         static int       http_close   (struct _reent *r, void *fd);
         static ssize_t   http_read    (struct _reent *r, void *fd, char *ptr, size_t len);
@@ -60,9 +80,15 @@ class HttpFs final: public NetworkFilesystem {
         static int       http_dirclose(struct _reent *r, DIR_ITER *dirState);
         static int       http_lstat   (struct _reent *r, const char *file, struct stat *st);
 
+        struct HttpFsFile {
+            std::string url;
+            std::uint64_t size;
+            std::int64_t mtime;
+            BlockCache::Stream stream;
+        };
+
         struct HttpFsDir {
-            std::vector<DirEntry> entries;
-            std::size_t index;
+            MetadataCache::DirState cache;
         };
 
     private:
@@ -70,11 +96,17 @@ class HttpFs final: public NetworkFilesystem {
 
         std::string base_url;
         std::string userpwd;
-        std::string auth_url_prefix;
 
         std::string cwd = "";
 
-        std::mutex session_mutex;
+        IoScheduler::Gate session_mutex;
+
+        std::mutex pool_mutex;
+        std::vector<void *> curl_pool;
+
+        // DNS cache and TLS sessions, shared by all handles of the pool
+        void *curl_share = nullptr;
+        std::array<std::mutex, 10> share_mutexes; // Indexed by curl_lock_data
 };
 
 } // namespace sw::fs
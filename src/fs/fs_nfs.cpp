@@ -15,6 +15,10 @@
 // You should have received a copy of the GNU General Public License
 // along with SwitchWave.  If not, see <http://www.gnu.org/licenses/>.
 
+#include <algorithm>
+#include <cstring>
+#include <memory>
+#include <vector>
 #include <fcntl.h>
 #include <sys/socket.h>
 #include <arpa/inet.h>
@@ -62,26 +66,26 @@ NfsFs::NfsFs(Context &context, std::string_view name, std::string_view mount_nam
         .name         = this->name.data(),
 
         .structSize   = sizeof(NfsFsFile),
-        .open_r       = NfsFs::nfs_open,
+        .open_r       = Filesystem::instrumented<NfsFs, IoStats::Op::Open, NfsFs::nfs_open>,
         .close_r      = NfsFs::nfs_close,
-        .read_r       = NfsFs::nfs_read,
+        .read_r       = Filesystem::instrumented<NfsFs, IoStats::Op::Read, NfsFs::nfs_read>,
         .seek_r       = NfsFs::nfs_seek,
-        .fstat_r      = NfsFs::nfs_fstat,
+        .fstat_r      = Filesystem::instrumented<NfsFs, IoStats::Op::Stat, NfsFs::nfs_fstat>,
 
-        .stat_r       = NfsFs::nfs_stat,
+        .stat_r       = Filesystem::instrumented<NfsFs, IoStats::Op::Stat, NfsFs::nfs_stat>,
         .chdir_r      = NfsFs::nfs_chdir,
 
         .dirStateSize = sizeof(NfsFsDir),
-        .diropen_r    = NfsFs::nfs_diropen,
+        .diropen_r    = Filesystem::instrumented<NfsFs, IoStats::Op::Readdir, NfsFs::nfs_diropen>,
         .dirreset_r   = NfsFs::nfs_dirreset,
-        .dirnext_r    = NfsFs::nfs_dirnext,
+        .dirnext_r    = Filesystem::instrumented<NfsFs, IoStats::Op::Readdir, NfsFs::nfs_dirnext>,
         .dirclose_r   = NfsFs::nfs_dirclose,
 
         .statvfs_r    = NfsFs::nfs_statvfs,
 
         .deviceData   = this,
 
-        .lstat_r      = NfsFs::nfs_lstat,
+        .lstat_r      = Filesystem::instrumented<NfsFs, IoStats::Op::Stat, NfsFs::nfs_lstat>,
     };
 }
 
@@ -93,11 +97,13 @@ NfsFs::~NfsFs() {
 }
 
 int NfsFs::initialize() {
-    this->nfs_ctx = ::nfs_init_context();
-    if (!this->nfs_ctx)
+    auto session = std::make_unique<NfsSession>();
+
+    session->nfs_ctx = ::nfs_init_context();
+    if (!session->nfs_ctx)
         return ENOMEM;
 
-    ::nfs_set_timeout(this->nfs_ctx, 3000);
+    this->sessions.reset(std::move(session));
 
     return 0;
 }
@@ -111,10 +117,16 @@ int NfsFs::connect(std::string_view host, std::uint16_t port, std::string_view s
     //     exports = exports->ex_next;
     // }
 
-    auto lk = std::scoped_lock(this->session_mutex);
+    // Kept to establish additional sessions
+    this->host  = host;
+    this->share = share;
+
+    auto *session = this->sessions.primary();
+    if (!session)
+        return ENOTCONN;
 
-    if (auto rc = ::nfs_mount(this->nfs_ctx, host.data(), share.data()); rc < 0)
-        return -rc;
+    if (auto rc = this->connect_session(*session); rc)
+        return rc;
 
     this->is_connected = true;
 
@@ -124,53 +136,311 @@ int NfsFs::connect(std::string_view host, std::uint16_t port, std::string_view s
 int NfsFs::disconnect() {
     int rc = 0;
 
-    auto lk = std::scoped_lock(this->session_mutex);
+    this->sessions.for_each([this](NfsSession &session) {
+        this->disconnect_session(session);
+    });
 
-    if (this->nfs_ctx)
-        ::nfs_destroy_context(this->nfs_ctx);
+    this->sessions.reset();
+    this->metadata_cache.clear();
 
     this->is_connected = false;
 
     return rc;
 }
 
+int NfsFs::connect_session(NfsSession &session) {
+    {
+        auto lk = std::scoped_lock(session.mutex);
+
+        if (!session.nfs_ctx) {
+            session.nfs_ctx = ::nfs_init_context();
+            if (!session.nfs_ctx)
+                return ENOMEM;
+        }
+
+        ::nfs_set_timeout(session.nfs_ctx, std::chrono::milliseconds(ConnectTimeout).count());
+
+        ::nfs_set_readahead(session.nfs_ctx, this->readahead_size);
+        ::nfs_set_pagecache(session.nfs_ctx, this->pagecache_pages);
+
+        if (::nfs_set_version(session.nfs_ctx, this->version == 4 ? NFS_V4 : NFS_V3))
+            return EINVAL;
+
+        if (auto rc = ::nfs_mount(session.nfs_ctx, this->host.c_str(), this->share.c_str()); rc < 0)
+            return -rc;
+
+        // libnfs creates the socket and connects in the same call, too late to size the receive buffer
+        tune_socket(::nfs_get_fd(session.nfs_ctx));
+
+        session.read_size = ::nfs_get_readmax(session.nfs_ctx);
+    }
+
+    session.service_thread = std::jthread([&session](std::stop_token token) {
+        NfsFs::service_thread_fn(token, session);
+    });
+
+    return 0;
+}
+
+void NfsFs::disconnect_session(NfsSession &session) {
+    // The service thread needs the session mutex to exit
+    if (session.service_thread.joinable()) {
+        session.service_thread.request_stop();
+        session.service_thread.join();
+    }
+
+    auto lk = std::scoped_lock(session.mutex);
+
+    if (session.nfs_ctx) {
+        ::nfs_destroy_context(session.nfs_ctx);
+        session.nfs_ctx = nullptr;
+    }
+}
+
 std::string_view NfsFs::translate_path(const char *path) {
     return path + this->mount_name.length();
 }
 
+struct NfsFs::ReadRequest {
+    NfsSession *session;
+    struct nfsfh *handle;
+    std::uint64_t offset;
+    std::uint8_t *buf;
+    std::size_t len, chunk_size, num_chunks;
+    IoScheduler::Priority priority;
+
+    std::size_t next = 0;
+    int inflight = 0, error = 0;
+    std::vector<int> results;
+};
+
+struct NfsFs::ReadChunk {
+    ReadRequest *req;
+    std::size_t idx;
+};
+
+ssize_t NfsFs::pread_pipelined(NfsSession &session, struct nfsfh *handle,
+        std::uint64_t offset, std::uint8_t *buf, std::size_t len) {
+    auto chunk_size = session.read_size ? session.read_size : len;
+    auto num_chunks = (len + chunk_size - 1) / chunk_size;
+
+    auto req = ReadRequest{
+        .session    = &session,
+        .handle     = handle,
+        .offset     = offset,
+        .buf        = buf,
+        .len        = len,
+        .chunk_size = chunk_size,
+        .num_chunks = num_chunks,
+        .priority   = IoScheduler::current_priority(),
+        .results    = std::vector<int>(num_chunks, 0),
+    };
+
+    auto &pending = session.pending_reads[std::size_t(req.priority)];
+
+    auto lk = std::unique_lock(session.mutex);
+
+    if (!session.connected())
+        return -ENOTCONN;
+
+    NfsFs::issue_reads(req);
+
+    // Further requests are queued from the completion callback, as the window advances
+    if (req.inflight) {
+        ++pending;
+        session.service_condvar.notify_one();
+        session.read_condvar.wait(lk, [&req] { return req.inflight == 0; });
+        --pending;
+    }
+
+    // Reassemble in order, stopping at the first short or failed read
+    std::size_t done = 0;
+    for (std::size_t i = 0; i < num_chunks; ++i) {
+        auto res = req.results[i];
+        if (res < 0)
+            return done ? done : res;
+
+        done += res;
+        if (std::size_t(res) < std::min(chunk_size, len - i * chunk_size))
+            break;
+    }
+
+    return (req.error && !done) ? -req.error : done;
+}
+
+void NfsFs::issue_reads(ReadRequest &req) {
+    auto &pending = req.session->pending_reads;
+
+    while (!req.error && req.next < req.num_chunks && req.inflight < int(NfsFs::MaxInflightReads)) {
+        // Stop early if more urgent reads are waiting on the session, the caller will come back for the rest
+        if (req.next > 0 && std::any_of(pending.begin(), pending.begin() + std::size_t(req.priority),
+                [](int count) { return count > 0; }))
+            break;
+
+        auto chunk_off = req.next * req.chunk_size, chunk_len = std::min(req.chunk_size, req.len - chunk_off);
+
+        auto *chunk = new ReadChunk{ &req, req.next };
+        if (auto rc = ::nfs_pread_async(req.session->nfs_ctx, req.handle, req.offset + chunk_off, chunk_len,
+                NfsFs::pread_cb, chunk); rc < 0) {
+            delete chunk;
+            req.error = -rc;
+            break;
+        }
+
+        ++req.inflight, ++req.next;
+    }
+}
+
+void NfsFs::pread_cb(int err, struct nfs_context *nfs, void *data, void *private_data) {
+    auto *chunk = static_cast<ReadChunk *>(private_data);
+    auto &req   = *chunk->req;
+    SW_SCOPEGUARD([&chunk] { delete chunk; });
+
+    // Callbacks run with the session mutex held, either from the service thread or a synchronous call
+    req.results[chunk->idx] = err;
+    if (err > 0)
+        std::memcpy(req.buf + chunk->idx * req.chunk_size, data, err);
+    else if (err < 0)
+        req.error = -err;
+
+    --req.inflight;
+    NfsFs::issue_reads(req);
+
+    if (!req.inflight)
+        req.session->read_condvar.notify_all();
+}
+
+void NfsFs::service_thread_fn(std::stop_token token, NfsSession &session) {
+    auto lk = std::unique_lock(session.mutex);
+
+    while (true) {
+        if (!session.service_condvar.wait(lk, token, [&session] {
+            return std::any_of(session.pending_reads.begin(), session.pending_reads.end(),
+                [](int count) { return count > 0; });
+        }))
+            break;
+
+        auto pfd = pollfd{
+            .fd     = ::nfs_get_fd(session.nfs_ctx),
+            .events = short(::nfs_which_events(session.nfs_ctx)),
+        };
+
+        // Short timeout, since requests queued while polling only update the event mask on the next iteration
+        lk.unlock();
+        auto rc = ::poll(&pfd, 1, 10);
+        lk.lock();
+
+        if (rc < 0)
+            continue;
+
+        // Timed out requests are failed by libnfs, which completes the waiting reads
+        ::nfs_service(session.nfs_ctx, pfd.revents);
+    }
+}
+
 int NfsFs::nfs_open(struct _reent *r, void *fileStruct, const char *path, int flags, int mode) {
-    auto *priv      = static_cast<NfsFs     *>(r->deviceData);
-    auto *priv_file = static_cast<NfsFsFile *>(fileStruct);
+    auto *priv      = static_cast<NfsFs *>(r->deviceData);
+    auto *priv_file = std::construct_at(static_cast<NfsFsFile *>(fileStruct));
 
     auto internal_path = priv->translate_path(path);
     if (internal_path.empty()) {
+        std::destroy_at(priv_file);
         __errno_r(r) = EINVAL;
         return -1;
     }
 
-    auto lk = std::scoped_lock(priv->session_mutex);
+    bool is_readonly = (flags & O_ACCMODE) == O_RDONLY && !(flags & (O_CREAT | O_TRUNC));
+    if (!is_readonly)
+        priv->metadata_cache.invalidate(internal_path);
 
-    if (auto rc = ::nfs_open2(priv->nfs_ctx, internal_path.data(),
-            flags, mode, &priv_file->handle); rc < 0) {
-        __errno_r(r) = -rc;
+    // Attributes from a recent listing or stat save a round-trip, the complete set is only fetched by fstat
+    struct stat cached_st;
+    bool is_cached = is_readonly &&
+        priv->metadata_cache.lookup_stat(internal_path, &cached_st) == 0 && S_ISREG(cached_st.st_mode);
+
+    auto *session = priv->sessions.acquire([priv]() -> std::unique_ptr<NfsSession> {
+        auto session = std::make_unique<NfsSession>();
+        if (priv->connect_session(*session)) {
+            priv->disconnect_session(*session);
+            return nullptr;
+        }
+        return session;
+    }, [priv](NfsSession &session) {
+        priv->disconnect_session(session);
+    });
+
+    if (!session) {
+        std::destroy_at(priv_file);
+        __errno_r(r) = ENOTCONN;
         return -1;
     }
 
-    if (auto rc = ::nfs_fstat64(priv->nfs_ctx, priv_file->handle, &priv_file->stat); rc < 0) {
-        __errno_r(r) = -rc;
-        return -1;
+    priv_file->session = session;
+
+    {
+        auto lk = std::scoped_lock(session->mutex);
+
+        if (!session->connected()) {
+            priv->sessions.release(*session);
+            std::destroy_at(priv_file);
+            __errno_r(r) = ENOTCONN;
+            return -1;
+        }
+
+        if (auto rc = ::nfs_open2(session->nfs_ctx, internal_path.data(),
+                flags, mode, &priv_file->handle); rc < 0) {
+            priv->sessions.release(*session);
+            std::destroy_at(priv_file);
+            __errno_r(r) = -rc;
+            return -1;
+        }
+
+        if (is_cached) {
+            priv_file->stat = {};
+            priv_file->stat.nfs_mode       = cached_st.st_mode;
+            priv_file->stat.nfs_size       = cached_st.st_size;
+            priv_file->stat.nfs_mtime      = cached_st.st_mtim.tv_sec;
+            priv_file->stat.nfs_mtime_nsec = cached_st.st_mtim.tv_nsec;
+            priv_file->has_stat            = false;
+        } else {
+            if (auto rc = ::nfs_fstat64(session->nfs_ctx, priv_file->handle, &priv_file->stat); rc < 0) {
+                ::nfs_close(session->nfs_ctx, priv_file->handle);
+                priv->sessions.release(*session);
+                std::destroy_at(priv_file);
+                __errno_r(r) = -rc;
+                return -1;
+            }
+            priv_file->has_stat = true;
+        }
     }
 
+    priv_file->stream.open(priv->context.block_cache, priv->stats, priv->mount_name, internal_path,
+        priv_file->stat.nfs_size, priv_file->stat.nfs_mtime,
+        [session, handle = priv_file->handle](std::uint64_t offset, void *buf, std::size_t len) -> ssize_t {
+            return NfsFs::pread_pipelined(*session, handle, offset, static_cast<std::uint8_t *>(buf), len);
+        });
+
     return 0;
 }
 
 int NfsFs::nfs_close(struct _reent *r, void *fd) {
     auto *priv      = static_cast<NfsFs     *>(r->deviceData);
     auto *priv_file = static_cast<NfsFsFile *>(fd);
+    auto &session   = *priv_file->session;
+    SW_SCOPEGUARD([&] {
+        priv->sessions.release(session);
+        std::destroy_at(priv_file);
+    });
+
+    priv_file->stream.close();
+
+    auto lk = std::scoped_lock(session.mutex);
 
-    auto lk = std::scoped_lock(priv->session_mutex);
+    // The handle went away with the session
+    if (!session.connected())
+        return 0;
 
-    if (auto rc = ::nfs_close(priv->nfs_ctx, priv_file->handle); rc < 0) {
+    if (auto rc = ::nfs_close(session.nfs_ctx, priv_file->handle); rc < 0) {
         __errno_r(r) = -rc;
         return -1;
     }
@@ -179,12 +449,9 @@ int NfsFs::nfs_close(struct _reent *r, void *fd) {
 }
 
 ssize_t NfsFs::nfs_read(struct _reent *r, void *fd, char *ptr, size_t len) {
-    auto *priv      = static_cast<NfsFs     *>(r->deviceData);
     auto *priv_file = static_cast<NfsFsFile *>(fd);
 
-    auto lk = std::scoped_lock(priv->session_mutex);
-
-    if (auto rc = ::nfs_read(priv->nfs_ctx, priv_file->handle, len, ptr); rc < 0) {
+    if (auto rc = priv_file->stream.read(ptr, len); rc < 0) {
         __errno_r(r) = -rc;
         return -1;
     } else {
@@ -193,23 +460,29 @@ ssize_t NfsFs::nfs_read(struct _reent *r, void *fd, char *ptr, size_t len) {
 }
 
 off_t NfsFs::nfs_seek(struct _reent *r, void *fd, off_t pos, int dir) {
-    auto *priv      = static_cast<NfsFs     *>(r->deviceData);
     auto *priv_file = static_cast<NfsFsFile *>(fd);
 
-    auto lk = std::scoped_lock(priv->session_mutex);
-
-    std::uint64_t absolute;
-    if (auto rc = ::nfs_lseek(priv->nfs_ctx, priv_file->handle, pos, dir, &absolute); rc < 0) {
+    if (auto rc = priv_file->stream.seek(pos, dir); rc < 0) {
         __errno_r(r) = -rc;
         return -1;
     } else {
-        return absolute;
+        return rc;
     }
 }
 
 int NfsFs::nfs_fstat(struct _reent *r, void *fd, struct stat *st) {
     auto *priv_file = static_cast<NfsFsFile *>(fd);
 
+    if (!priv_file->has_stat) {
+        auto &session = *priv_file->session;
+        auto lk = std::scoped_lock(session.mutex);
+
+        // Keep the partial attributes on failure
+        struct nfs_stat_64 buf;
+        if (session.connected() && ::nfs_fstat64(session.nfs_ctx, priv_file->handle, &buf) == 0)
+            priv_file->stat = buf, priv_file->has_stat = true;
+    }
+
     nfs_translate_stat(priv_file->stat, st);
     return 0;
 }
@@ -223,15 +496,31 @@ int NfsFs::nfs_stat(struct _reent *r, const char *file, struct stat *st) {
         return -1;
     }
 
-    auto lk = std::scoped_lock(priv->session_mutex);
+    if (auto rc = priv->metadata_cache.lookup_stat(internal_path, st); rc) {
+        if (*rc) {
+            __errno_r(r) = *rc;
+            return -1;
+        }
+        return 0;
+    }
+
+    auto lk = std::unique_lock<IoScheduler::Gate>();
+    auto *session = priv->sessions.lock_primary(lk);
+    if (!session) {
+        __errno_r(r) = ENOTCONN;
+        return -1;
+    }
 
     struct nfs_stat_64 buf;
-    if (auto rc = ::nfs_stat64(priv->nfs_ctx, internal_path.data(), &buf); rc < 0) {
+    if (auto rc = ::nfs_stat64(session->nfs_ctx, internal_path.data(), &buf); rc < 0) {
+        if (rc == -ENOENT)
+            priv->metadata_cache.insert_negative(internal_path);
         __errno_r(r) = -rc;
         return -1;
     }
 
     nfs_translate_stat(buf, st);
+    priv->metadata_cache.insert_stat(internal_path, *st);
     return 0;
 }
 
@@ -244,10 +533,15 @@ int NfsFs::nfs_lstat(struct _reent *r, const char *file, struct stat *st) {
         return -1;
     }
 
-    auto lk = std::scoped_lock(priv->session_mutex);
+    auto lk = std::unique_lock<IoScheduler::Gate>();
+    auto *session = priv->sessions.lock_primary(lk);
+    if (!session) {
+        __errno_r(r) = ENOTCONN;
+        return -1;
+    }
 
     struct nfs_stat_64 buf;
-    if (auto rc = ::nfs_lstat64(priv->nfs_ctx, internal_path.data(), &buf); rc < 0) {
+    if (auto rc = ::nfs_lstat64(session->nfs_ctx, internal_path.data(), &buf); rc < 0) {
         __errno_r(r) = -rc;
         return -1;
     }
@@ -265,9 +559,14 @@ int NfsFs::nfs_chdir(struct _reent *r, const char *name) {
         return -1;
     }
 
-    auto lk = std::scoped_lock(priv->session_mutex);
+    auto lk = std::unique_lock<IoScheduler::Gate>();
+    auto *session = priv->sessions.lock_primary(lk);
+    if (!session) {
+        __errno_r(r) = ENOTCONN;
+        return -1;
+    }
 
-    if (auto rc = ::nfs_chdir(priv->nfs_ctx, internal_path.data()); rc < 0) {
+    if (auto rc = ::nfs_chdir(session->nfs_ctx, internal_path.data()); rc < 0) {
         __errno_r(r) = -rc;
         return -1;
     }
@@ -277,18 +576,31 @@ int NfsFs::nfs_chdir(struct _reent *r, const char *name) {
 
 DIR_ITER *NfsFs::nfs_diropen(struct _reent *r, DIR_ITER *dirState, const char *path) {
     auto *priv     = static_cast<NfsFs    *>(r->deviceData);
-    auto *priv_dir = static_cast<NfsFsDir *>(dirState->dirStruct);
+    auto *priv_dir = std::construct_at(static_cast<NfsFsDir *>(dirState->dirStruct));
 
     auto internal_path = priv->translate_path(path);
     if (internal_path.empty()) {
+        std::destroy_at(priv_dir);
         __errno_r(r) = EINVAL;
         return nullptr;
     }
 
-    auto lk = std::scoped_lock(priv->session_mutex);
+    if (priv->metadata_cache.open_dir(priv_dir->cache, internal_path)) {
+        priv_dir->handle = nullptr;
+        return dirState;
+    }
+
+    auto lk = std::unique_lock<IoScheduler::Gate>();
+    auto *session = priv->sessions.lock_primary(lk);
+    if (!session) {
+        std::destroy_at(priv_dir);
+        __errno_r(r) = ENOTCONN;
+        return nullptr;
+    }
 
-    auto rc = ::nfs_opendir(priv->nfs_ctx, internal_path.data(), &priv_dir->handle);
+    auto rc = ::nfs_opendir(session->nfs_ctx, internal_path.data(), &priv_dir->handle);
     if (!priv_dir->handle) {
+        std::destroy_at(priv_dir);
         __errno_r(r) = -rc;
         return nullptr;
     }
@@ -300,7 +612,18 @@ int NfsFs::nfs_dirreset(struct _reent *r, DIR_ITER *dirState) {
     auto *priv     = static_cast<NfsFs    *>(r->deviceData);
     auto *priv_dir = static_cast<NfsFsDir *>(dirState->dirStruct);
 
-    ::nfs_rewinddir(priv->nfs_ctx, priv_dir->handle);
+    if (priv_dir->handle) {
+        auto lk = std::unique_lock<IoScheduler::Gate>();
+        auto *session = priv->sessions.lock_primary(lk);
+        if (!session) {
+            __errno_r(r) = ENOTCONN;
+            return -1;
+        }
+
+        ::nfs_rewinddir(session->nfs_ctx, priv_dir->handle);
+    }
+
+    priv->metadata_cache.rewind_dir(priv_dir->cache);
     return 0;
 }
 
@@ -308,10 +631,27 @@ int NfsFs::nfs_dirnext(struct _reent *r, DIR_ITER *dirState, char *filename, str
     auto *priv     = static_cast<NfsFs    *>(r->deviceData);
     auto *priv_dir = static_cast<NfsFsDir *>(dirState->dirStruct);
 
+    if (!priv_dir->handle) {
+        if (!priv->metadata_cache.next_cached(priv_dir->cache, filename, filestat)) {
+            __errno_r(r) = ENOENT;
+            return -1;
+        }
+        return 0;
+    }
+
+    // Directory handles are released along with the session
+    auto lk = std::unique_lock<IoScheduler::Gate>();
+    auto *session = priv->sessions.lock_primary(lk);
+    if (!session) {
+        __errno_r(r) = ENOTCONN;
+        return -1;
+    }
+
     struct nfsdirent *node;
     while (true) {
-        node = ::nfs_readdir(priv->nfs_ctx, priv_dir->handle);
+        node = ::nfs_readdir(session->nfs_ctx, priv_dir->handle);
         if (!node) {
+            priv->metadata_cache.finish_dir(priv_dir->cache);
             __errno_r(r) = ENOENT;
             return -1;
         }
@@ -342,6 +682,7 @@ int NfsFs::nfs_dirnext(struct _reent *r, DIR_ITER *dirState, char *filename, str
         },
     };
 
+    priv->metadata_cache.record(priv_dir->cache, node->name, *filestat);
     return 0;
 }
 
@@ -349,7 +690,13 @@ int NfsFs::nfs_dirclose(struct _reent *r, DIR_ITER *dirState) {
     auto *priv     = static_cast<NfsFs    *>(r->deviceData);
     auto *priv_dir = static_cast<NfsFsDir *>(dirState->dirStruct);
 
-    ::nfs_closedir(priv->nfs_ctx, priv_dir->handle);
+    if (priv_dir->handle) {
+        auto lk = std::unique_lock<IoScheduler::Gate>();
+        if (auto *session = priv->sessions.lock_primary(lk); session)
+            ::nfs_closedir(session->nfs_ctx, priv_dir->handle);
+    }
+
+    std::destroy_at(priv_dir);
     return 0;
 }
 
@@ -362,9 +709,14 @@ int NfsFs::nfs_statvfs(struct _reent *r, const char *path, struct statvfs *buf)
         return -1;
     }
 
-    auto lk = std::scoped_lock(priv->session_mutex);
+    auto lk = std::unique_lock<IoScheduler::Gate>();
+    auto *session = priv->sessions.lock_primary(lk);
+    if (!session) {
+        __errno_r(r) = ENOTCONN;
+        return -1;
+    }
 
-    if (auto rc = ::nfs_statvfs(priv->nfs_ctx, internal_path.data(), buf); rc < 0) {
+    if (auto rc = ::nfs_statvfs(session->nfs_ctx, internal_path.data(), buf); rc < 0) {
         __errno_r(r) = -rc;
         return -1;
     }
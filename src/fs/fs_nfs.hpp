@@ -17,14 +17,21 @@
 
 #pragma once
 
+#include <cerrno>
+#include <cstdio>
+#include <array>
+#include <condition_variable>
 #include <mutex>
 #include <string>
 #include <string_view>
+#include <thread>
 
 #include <nfsc/libnfs.h>
 
 #include "context.hpp"
 #include "fs/fs_common.hpp"
+#include "fs/fs_cache.hpp"
+#include "fs/fs_scheduler.hpp"
 
 namespace sw::fs {
 
@@ -38,9 +45,63 @@ class NfsFs final: public NetworkFilesystem {
             std::string_view username, std::string_view password) override;
         virtual int disconnect() override;
 
+        // Must be called before initialize, 0 selects the default
+        void set_cache_options(std::uint32_t readahead, std::uint32_t pagecache) {
+            this->readahead_size  = readahead ? readahead : NfsFs::DefaultReadahead;
+            this->pagecache_pages = pagecache ? pagecache : NfsFs::DefaultPagecache;
+        }
+
+        // Must be called before initialize, 0 selects NFSv3, other values than 3 and 4 are rejected with EINVAL
+        // With NFSv4, path lookups, opens and listings with attributes are each done in a single compound request
+        int set_version(std::uint32_t version) {
+            if (version && version != 3 && version != 4) {
+                std::printf("Unsupported NFS version %u\n", version);
+                return EINVAL;
+            }
+
+            this->version = version ? version : NfsFs::DefaultVersion;
+            return 0;
+        }
+
     private:
+        constexpr static std::uint32_t DefaultReadahead = 0x100000; // 1MiB
+        constexpr static std::uint32_t DefaultPagecache = 512;      // 4KiB pages, 2MiB
+        constexpr static std::uint32_t DefaultVersion   = 3;
+        constexpr static std::size_t   MaxInflightReads = 8;
+
+        struct ReadRequest;
+        struct ReadChunk;
+
+        struct NfsSession {
+            nfs_context *nfs_ctx = nullptr;
+            std::size_t read_size = 0, num_files = 0;
+            IoScheduler::Gate mutex;
+
+            // Protected by the session mutex
+            std::array<int, std::size_t(IoScheduler::Priority::Max)> pending_reads = {};
+            std::condition_variable_any read_condvar;
+            std::condition_variable_any service_condvar;
+            std::jthread service_thread;
+
+            // Must be called with the mutex held
+            bool connected() const {
+                return this->nfs_ctx;
+            }
+        };
+
         std::string_view translate_path(const char *path);
 
+        int  connect_session(NfsSession &session);
+        void disconnect_session(NfsSession &session);
+
+        // Positional read split in rsize-sized RPCs, completed by the service thread
+        static ssize_t pread_pipelined(NfsSession &session, struct nfsfh *handle,
+            std::uint64_t offset, std::uint8_t *buf, std::size_t len);
+        static void issue_reads(ReadRequest &req);
+        static void pread_cb(int err, struct nfs_context *nfs, void *data, void *private_data);
+
+        static void service_thread_fn(std::stop_token token, NfsSession &session);
+
         static int       nfs_open    (struct _reent *r, void *fileStruct, const char *path, int flags, int mode);
         static int       nfs_close   (struct _reent *r, void *fd);
         static ssize_t   nfs_read    (struct _reent *r, void *fd, char *ptr, size_t len);
@@ -57,20 +118,28 @@ class NfsFs final: public NetworkFilesystem {
 
     private:
         struct NfsFsFile {
+            NfsSession *session;
             struct nfsfh *handle;
             struct nfs_stat_64 stat;
+            bool has_stat; // Whether stat is complete, or only has the mode, size and mtime
+            BlockCache::Stream stream;
         };
 
         struct NfsFsDir {
             struct nfsdir *handle;
+            MetadataCache::DirState cache;
         };
 
     private:
         Context &context;
 
-        nfs_context *nfs_ctx = nullptr;
+        std::uint32_t readahead_size  = NfsFs::DefaultReadahead;
+        std::uint32_t pagecache_pages = NfsFs::DefaultPagecache;
+        std::uint32_t version         = NfsFs::DefaultVersion;
+
+        std::string host, share;
 
-        std::mutex session_mutex;
+        SessionPool<NfsSession> sessions;
 };
 
 } // namespace sw::fs
@@ -0,0 +1,108 @@
+// Copyright (c) 2024 averne <averne381@gmail.com>
+//
+// This file is part of SwitchWave.
+//
+// SwitchWave is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// SwitchWave is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with SwitchWave.  If not, see <http://www.gnu.org/licenses/>.
+
+#include <cstdio>
+#include <algorithm>
+#include <memory>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "utils.hpp"
+#include "fs/fs_scheduler.hpp"
+#include "fs/fs_prefetch.hpp"
+
+namespace sw::fs {
+
+void FilePrefetcher::prefetch(std::string_view path, std::size_t budget) {
+    if (path == this->path)
+        return;
+
+    this->cancel();
+
+    std::erase_if(this->cancelled_jobs, [](const auto &job) { return job->done.load(); });
+
+    this->path = path;
+
+    this->job = std::make_unique<Job>();
+    this->job->path   = path;
+    this->job->budget = budget;
+    this->job->thread = std::jthread(&FilePrefetcher::thread_fn, std::ref(*this->job));
+}
+
+void FilePrefetcher::cancel() {
+    this->path.clear();
+
+    if (!this->job)
+        return;
+
+    this->job->thread.request_stop();
+
+    if (!this->job->done)
+        this->cancelled_jobs.emplace_back(std::move(this->job));
+
+    this->job.reset();
+}
+
+void FilePrefetcher::thread_fn(std::stop_token token, Job &job) {
+    SW_SCOPEGUARD([&job] { job.done = true; });
+
+    auto priority = IoScheduler::ScopedPriority(IoScheduler::Priority::Background);
+
+    auto fd = ::open(job.path.c_str(), O_RDONLY);
+    if (fd < 0) {
+        std::printf("Failed to open %s for prefetching\n", job.path.c_str());
+        return;
+    }
+    SW_SCOPEGUARD([fd] { ::close(fd); });
+
+    struct stat st;
+    if (::fstat(fd, &st) || !S_ISREG(st.st_mode))
+        return;
+
+    auto size = std::uint64_t(st.st_size);
+    auto tail = std::min<std::uint64_t>(job.budget / FilePrefetcher::TailFraction, size);
+    auto head = std::min<std::uint64_t>(job.budget - tail, size - tail);
+
+    auto buf = std::make_unique_for_overwrite<std::uint8_t[]>(FilePrefetcher::ChunkSize);
+
+    // The data itself is discarded, it only needs to go through the block cache
+    auto warm = [&](std::uint64_t offset, std::uint64_t length) {
+        if (::lseek(fd, offset, SEEK_SET) < 0)
+            return false;
+
+        while (length && !token.stop_requested()) {
+            auto rc = ::read(fd, buf.get(), std::min<std::uint64_t>(length, FilePrefetcher::ChunkSize));
+            if (rc <= 0)
+                return false;
+            length -= rc;
+        }
+
+        return !token.stop_requested();
+    };
+
+    if (warm(0, head))
+        warm(size - tail, tail);
+
+    buf.reset();
+
+    // Keep the handle until the file is opened for playback, or another one is requested
+    auto lk = std::unique_lock(job.mutex);
+    job.condvar.wait(lk, token, [] { return false; });
+}
+
+} // namespace sw::fs
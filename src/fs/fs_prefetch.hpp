@@ -0,0 +1,81 @@
+// Copyright (c) 2024 averne <averne381@gmail.com>
+//
+// This file is part of SwitchWave.
+//
+// SwitchWave is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// SwitchWave is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with SwitchWave.  If not, see <http://www.gnu.org/licenses/>.
+
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
+
+namespace sw::fs {
+
+// Warms the caches for a file that is about to be opened: its head (container header and first seconds of data)
+// and its tail (seek index of most containers), with background I/O priority
+// The file is kept open until the next request, so that its protocol handle and session are ready when needed
+// Read-ahead is not done for background reads, so the budget bounds what goes through the block cache
+class FilePrefetcher {
+    public:
+        constexpr static std::size_t ChunkSize    = 0x40000; // 256KiB
+        constexpr static std::size_t TailFraction = 4;       // Part of the budget spent on the end of the file
+
+    public:
+        FilePrefetcher() = default;
+
+        // Waits for cancelled jobs, so the prefetcher should outlive the UI that drives it
+        ~FilePrefetcher() {
+            this->cancel();
+            this->cancelled_jobs.clear();
+        }
+
+        // Does nothing if the same file was already requested
+        void prefetch(std::string_view path, std::size_t budget);
+
+        // Doesn't wait for the job, which may be stuck in a network call
+        void cancel();
+
+        const std::string &target() const {
+            return this->path;
+        }
+
+    private:
+        struct Job {
+            std::string path;
+            std::size_t budget;
+            std::atomic_bool done = false;
+
+            // Holds the file open until the job is cancelled
+            std::mutex mutex;
+            std::condition_variable_any condvar;
+
+            std::jthread thread;
+        };
+
+        static void thread_fn(std::stop_token token, Job &job);
+
+    private:
+        std::string path;
+        std::unique_ptr<Job> job;
+        std::vector<std::unique_ptr<Job>> cancelled_jobs;
+};
+
+} // namespace sw::fs
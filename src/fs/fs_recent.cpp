@@ -15,12 +15,19 @@
 // You should have received a copy of the GNU General Public License
 // along with SwitchWave.  If not, see <http://www.gnu.org/licenses/>.
 
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <algorithm>
+#include <unordered_set>
+#include <sys/stat.h>
 #include <sys/syslimits.h>
 
 #include <switch.h>
 
 #include "utils.hpp"
 #include "fs/fs_common.hpp"
+#include "fs/fs_scheduler.hpp"
 #include "fs/fs_recent.hpp"
 
 namespace sw::fs {
@@ -44,55 +51,222 @@ RecentFs::RecentFs(Context &context, std::string_view name, std::string_view mou
 
     this->history_path = Path(Context::AppDirectory) / Context::HistoryFilename;
 
-    std::string text;
-    utils::read_whole_file(text, this->history_path.c_str(), "r");
-    if (!text.empty()) {
-        auto *start = text.c_str();
-        while (const auto *end = std::strchr(start, '\n')) {
-            if (this->recent_files.size() >= this->context.history_size)
-                break;
-
-            SW_SCOPEGUARD([&] { start = end + 1; });
-            if (start == end)
-                continue;
-
-            this->recent_files.emplace_back(start, end);
-        }
-    }
+    // Fall back to the temporary file of an interrupted write, then to the plain text history of older versions
+    auto tmp_path    = this->history_path.base() + ".tmp";
+    auto legacy_path = Path(Context::AppDirectory) / Context::LegacyHistoryFilename;
+    if (this->read_from_file(this->history_path.c_str()) && this->read_from_file(tmp_path.c_str()))
+        this->read_from_legacy_file(legacy_path.c_str());
 }
 
 RecentFs::~RecentFs() {
     this->unregister_fs();
 }
 
-void RecentFs::add(const std::string &path) {
-    // Remove duplicates
-    auto hash = std::hash<std::string>{}(path);
-    this->recent_files.remove_if([hash](const auto &path) { return std::hash<std::string>{}(path.base()) == hash; });
+int RecentFs::read_from_file(const char *path) {
+    auto *fp = std::fopen(path, "rb");
+    if (!fp)
+        return -errno;
+    SW_SCOPEGUARD([&fp] { std::fclose(fp); });
 
-    this->recent_files.emplace_front(path);
+    FileHeader header;
+    if (std::fread(&header, sizeof(header), 1, fp) != 1 ||
+            header.magic != RecentFs::FileMagic || header.version != RecentFs::FileVersion)
+        return -EINVAL;
+
+    std::vector<Entry> entries;
+    for (std::uint32_t i = 0; i < header.num_entries && entries.size() < this->context.history_size; ++i) {
+        FileRecord record;
+        if (std::fread(&record, sizeof(record), 1, fp) != 1 || !record.path_length || record.path_length > PATH_MAX)
+            return -EINVAL;
+
+        auto path = std::string(record.path_length, '\0');
+        if (std::fread(path.data(), 1, path.length(), fp) != path.length())
+            return -EINVAL;
+
+        entries.emplace_back(Entry{
+            .path     = std::move(path),
+            .size     = record.size,
+            .mtime    = record.mtime,
+            .duration = record.duration,
+            .position = record.position,
+            .stale    = !!(record.flags & FileRecord::Stale),
+        });
+    }
 
-    if (this->recent_files.size() > this->context.history_size)
-        this->recent_files.resize(this->context.history_size);
+    auto lk = std::scoped_lock(this->mutex);
+    this->recent_files = std::move(entries);
+    return 0;
+}
+
+int RecentFs::read_from_legacy_file(const char *path) {
+    std::string text;
+    if (auto rc = utils::read_whole_file(text, path, "r"); rc)
+        return rc;
+
+    // One path per line, attributes are filled in by the next revalidation
+    auto lk = std::scoped_lock(this->mutex);
+
+    auto *start = text.c_str();
+    while (const auto *end = std::strchr(start, '\n')) {
+        if (this->recent_files.size() >= this->context.history_size)
+            break;
+
+        SW_SCOPEGUARD([&] { start = end + 1; });
+        if (start == end)
+            continue;
+
+        this->recent_files.emplace_back(Entry{ .path = std::string(start, end) });
+    }
+
+    return 0;
 }
 
 int RecentFs::write_to_file() const {
-    auto *fp = std::fopen(this->history_path.c_str(), "w");
+    auto tmp_path = this->history_path.base() + ".tmp";
+
+    auto *fp = std::fopen(tmp_path.c_str(), "wb");
     if (!fp)
         return -1;
-    SW_SCOPEGUARD([&fp] { std::fclose(fp); });
 
-    for (auto &path: this->recent_files) {
-        auto &str = path.base();
-        if (std::size_t written = std::fprintf(fp, "%s\n", str.c_str()); written != str.length() + 1)
-            return -1;
+    bool failed = false;
+    {
+        auto lk = std::scoped_lock(this->mutex);
+
+        auto header = FileHeader{
+            .magic       = RecentFs::FileMagic,
+            .version     = RecentFs::FileVersion,
+            .num_entries = std::uint32_t(this->recent_files.size()),
+            .reserved    = 0,
+        };
+        failed |= std::fwrite(&header, sizeof(header), 1, fp) != 1;
+
+        for (auto &entry: this->recent_files) {
+            auto &str = entry.path.base();
+
+            auto record = FileRecord{
+                .size        = entry.size,
+                .mtime       = entry.mtime,
+                .duration    = entry.duration,
+                .position    = entry.position,
+                .path_length = std::uint16_t(str.length()),
+                .flags       = std::uint16_t(entry.stale ? FileRecord::Stale : 0),
+                .reserved    = 0,
+            };
+
+            failed |= std::fwrite(&record, sizeof(record), 1, fp) != 1;
+            failed |= std::fwrite(str.data(), 1, str.length(), fp) != str.length();
+        }
     }
 
+    failed |= std::fclose(fp) != 0;
+    if (failed)
+        return -1;
+
+    // rename does not replace existing files on the sd card
+    std::remove(this->history_path.c_str());
+    if (std::rename(tmp_path.c_str(), this->history_path.c_str()))
+        return -1;
+
     return 0;
 }
 
+void RecentFs::add(const std::string &path, double position, double duration) {
+    auto entry = Entry{
+        .path     = path,
+        .duration = duration,
+        .position = position,
+    };
+
+    // Size and mtime are left for the revalidation, which runs in the background
+    // instead of stalling the UI on a network round-trip, and is forced to run on the next listing
+    this->last_revalidation = {};
+
+    auto lk = std::scoped_lock(this->mutex);
+
+    // Remove duplicates
+    std::erase_if(this->recent_files, [&path](const auto &entry) { return entry.path.base() == path; });
+
+    this->recent_files.insert(this->recent_files.begin(), std::move(entry));
+
+    if (this->recent_files.size() > this->context.history_size)
+        this->recent_files.resize(this->context.history_size);
+}
+
+bool RecentFs::lookup(std::string_view path, Entry &entry) const {
+    auto lk = std::scoped_lock(this->mutex);
+
+    auto it = std::find_if(this->recent_files.begin(), this->recent_files.end(), [&path](const auto &entry) {
+        return entry.path.base() == path;
+    });
+    if (it == this->recent_files.end())
+        return false;
+
+    entry = *it;
+    return true;
+}
+
+void RecentFs::revalidate(std::vector<std::shared_ptr<Filesystem>> filesystems) {
+    auto now = std::chrono::steady_clock::now();
+    if (this->revalidating || (this->last_revalidation.time_since_epoch().count() &&
+            now - this->last_revalidation < RecentFs::RevalidateInterval))
+        return;
+
+    this->last_revalidation = now;
+    this->revalidating      = true;
+
+    this->revalidate_thread = std::jthread(&RecentFs::revalidate_thread_fn, this, std::move(filesystems));
+}
+
+void RecentFs::revalidate_thread_fn(std::stop_token token, std::vector<std::shared_ptr<Filesystem>> filesystems) {
+    SW_SCOPEGUARD([this] { this->revalidating = false; });
+
+    auto priority = IoScheduler::ScopedPriority(IoScheduler::Priority::Background);
+
+    auto mounted = std::unordered_set<std::string_view>();
+    for (auto &fs: filesystems)
+        mounted.insert(fs->mount_name);
+
+    std::vector<std::string> paths;
+    {
+        auto lk = std::scoped_lock(this->mutex);
+        for (auto &entry: this->recent_files) {
+            if (mounted.contains(entry.path.mountpoint()))
+                paths.push_back(entry.path.base());
+        }
+    }
+
+    for (auto &path: paths) {
+        if (token.stop_requested())
+            break;
+
+        struct stat st;
+        int error = ::stat(path.c_str(), &st) ? errno : 0;
+
+        // Other errors (eg. timeouts) don't tell anything about the file
+        if (error && error != ENOENT && error != ENOTDIR)
+            continue;
+
+        auto lk = std::scoped_lock(this->mutex);
+
+        auto it = std::find_if(this->recent_files.begin(), this->recent_files.end(), [&path](const auto &entry) {
+            return entry.path.base() == path;
+        });
+        if (it == this->recent_files.end())
+            continue;
+
+        if (error) {
+            it->stale = true;
+        } else if (!it->size && !it->mtime) {
+            // Imported from the text history, or just played
+            it->size  = st.st_size;
+            it->mtime = st.st_mtime;
+        } else {
+            it->stale = std::uint64_t(st.st_size) != it->size || st.st_mtime != it->mtime;
+        }
+    }
+}
+
 DIR_ITER* RecentFs::recent_diropen(struct _reent *r, DIR_ITER *dirState, const char *path) {
-    auto *priv     = static_cast<RecentFs    *>(r->deviceData);
     auto *priv_dir = static_cast<RecentFsDir *>(dirState->dirStruct);
 
     auto internal_path = Path::internal(path);
@@ -102,16 +276,15 @@ DIR_ITER* RecentFs::recent_diropen(struct _reent *r, DIR_ITER *dirState, const c
     if (internal_path != "/")
         return nullptr;
 
-    priv_dir->it = priv->recent_files.begin();
+    priv_dir->index = 0;
 
     return dirState;
 }
 
 int RecentFs::recent_dirreset(struct _reent *r, DIR_ITER *dirState) {
-    auto *priv     = static_cast<RecentFs    *>(r->deviceData);
     auto *priv_dir = static_cast<RecentFsDir *>(dirState->dirStruct);
 
-    priv_dir->it = priv->recent_files.begin();
+    priv_dir->index = 0;
 
     return -1;
 }
@@ -120,18 +293,23 @@ int RecentFs::recent_dirnext(struct _reent *r, DIR_ITER *dirState, char *filenam
     auto *priv     = static_cast<RecentFs    *>(r->deviceData);
     auto *priv_dir = static_cast<RecentFsDir *>(dirState->dirStruct);
 
-    if (priv_dir->it != priv->recent_files.end()) {
-        auto &path = *priv_dir->it;
-
-        std::strncpy(filename, path.c_str(), path.length());
-        ::stat(path.c_str(), filestat);
+    auto lk = std::scoped_lock(priv->mutex);
 
-        ++priv_dir->it;
-    } else {
+    if (priv_dir->index >= priv->recent_files.size()) {
         __errno_r(r) = ENOENT;
         return -1;
     }
 
+    // Report the recorded attributes, the file itself might be on a share that is slow or gone
+    auto &entry = priv->recent_files[priv_dir->index++];
+
+    std::strncpy(filename, entry.path.c_str(), entry.path.length());
+
+    *filestat = {};
+    filestat->st_mode  = S_IFREG;
+    filestat->st_size  = entry.size;
+    filestat->st_mtime = entry.mtime;
+
     return 0;
 }
 
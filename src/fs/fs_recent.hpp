@@ -17,9 +17,14 @@
 
 #pragma once
 
-#include <list>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <memory>
+#include <mutex>
 #include <string_view>
-#include <unordered_map>
+#include <thread>
+#include <vector>
 
 #include <switch.h>
 
@@ -28,24 +33,75 @@
 
 namespace sw::fs {
 
+// Playback history, exposed as a flat directory of full paths
+// The attributes of each file are recorded when it is played, so that listings never hit the network
 class RecentFs final: public Filesystem {
+    public:
+        constexpr static std::uint32_t FileMagic   = 0x54534857; // "WHST"
+        constexpr static std::uint32_t FileVersion = 1;
+
+        // Minimum time between two revalidations of the entries
+        constexpr static auto RevalidateInterval = std::chrono::minutes(5);
+
+        struct Entry {
+            Path path;
+            std::uint64_t size  = 0;
+            std::int64_t  mtime = 0;
+            double duration = 0, position = 0; // Seconds, 0 if unknown
+            bool stale = false;                // The file was modified or deleted since it was played
+        };
+
     public:
         RecentFs(Context &context, std::string_view name, std::string_view mount_name);
         virtual ~RecentFs() override;
 
-        void add(const std::string &path);
+        void add(const std::string &path, double position = 0, double duration = 0);
         void clear() {
+            auto lk = std::scoped_lock(this->mutex);
             this->recent_files.clear();
         }
 
         int write_to_file() const;
 
+        // Returns false if the file isn't in the history
+        bool lookup(std::string_view path, Entry &entry) const;
+
+        // Checks in the background whether the entries on the given filesystems still match the recorded files
+        // Entries on other filesystems, eg. disconnected shares, are left as is
+        void revalidate(std::vector<std::shared_ptr<Filesystem>> filesystems);
+
     private:
         struct RecentFsDir {
-            std::list<Path>::iterator it;
+            std::size_t index;
+        };
+
+        struct FileHeader {
+            std::uint32_t magic;
+            std::uint32_t version;
+            std::uint32_t num_entries;
+            std::uint32_t reserved;
+        };
+
+        // Followed by the path, without NUL terminator
+        struct FileRecord {
+            enum Flags: std::uint16_t {
+                Stale = 1 << 0,
+            };
+
+            std::uint64_t size;
+            std::int64_t  mtime;
+            double        duration, position;
+            std::uint16_t path_length;
+            std::uint16_t flags;
+            std::uint32_t reserved;
         };
 
     private:
+        int read_from_file(const char *path);
+        int read_from_legacy_file(const char *path);
+
+        void revalidate_thread_fn(std::stop_token token, std::vector<std::shared_ptr<Filesystem>> filesystems);
+
         static DIR_ITER *recent_diropen (struct _reent *r, DIR_ITER *dirState, const char *path);
         static int       recent_dirreset(struct _reent *r, DIR_ITER *dirState);
         static int       recent_dirnext (struct _reent *r, DIR_ITER *dirState, char *filename, struct stat *filestat);
@@ -55,7 +111,13 @@ class RecentFs final: public Filesystem {
         Context &context;
 
         Path history_path;
-        std::list<Path> recent_files;
+
+        mutable std::mutex mutex;
+        std::vector<Entry> recent_files; // Most recent first
+
+        std::atomic_bool revalidating = false;
+        std::chrono::steady_clock::time_point last_revalidation;
+        std::jthread revalidate_thread;
 };
 
 } // namespace sw::fs
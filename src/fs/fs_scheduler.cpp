@@ -0,0 +1,74 @@
+// Copyright (c) 2024 averne <averne381@gmail.com>
+//
+// This file is part of SwitchWave.
+//
+// SwitchWave is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// SwitchWave is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with SwitchWave.  If not, see <http://www.gnu.org/licenses/>.
+
+#include "fs/fs_scheduler.hpp"
+
+namespace sw::fs {
+
+void IoScheduler::Gate::lock() {
+    auto priority = IoScheduler::current_priority();
+    auto &stats   = IoScheduler::queue_stats[static_cast<std::size_t>(priority)];
+    auto start    = Clock::now();
+
+    auto lk = std::unique_lock(this->mutex);
+
+    // Queue behind earlier waiters even if the gate is free, the first of them might not have woken up yet
+    if (this->held || !this->waiters.empty()) {
+        auto waiter = Waiter{ priority, IoScheduler::current_deadline(), this->next_seq++ };
+        this->waiters.insert(waiter);
+
+        ++stats.depth;
+        this->condvar.wait(lk, [this, &waiter] {
+            return !this->held && !(*this->waiters.begin() < waiter) && !(waiter < *this->waiters.begin());
+        });
+        --stats.depth;
+
+        this->waiters.erase(this->waiters.begin());
+    }
+
+    this->held            = true;
+    this->holder_priority = priority;
+
+    auto wait = Clock::now() - start;
+    IoScheduler::cur_accounting.wait_time += wait;
+
+    auto wait_us = std::chrono::duration_cast<std::chrono::microseconds>(wait).count();
+
+    stats.requests      += 1;
+    stats.total_wait_us += wait_us;
+
+    auto max = stats.max_wait_us.load();
+    while (std::uint64_t(wait_us) > max && !stats.max_wait_us.compare_exchange_weak(max, wait_us));
+}
+
+void IoScheduler::Gate::unlock() {
+    {
+        auto lk = std::scoped_lock(this->mutex);
+        this->held = false;
+    }
+
+    this->condvar.notify_all();
+}
+
+bool IoScheduler::Gate::preempt_requested() {
+    auto lk = std::scoped_lock(this->mutex);
+    bool preempt = !this->waiters.empty() && this->waiters.begin()->priority < this->holder_priority;
+    IoScheduler::cur_accounting.preempted |= preempt;
+    return preempt;
+}
+
+} // namespace sw::fs
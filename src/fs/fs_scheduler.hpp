@@ -0,0 +1,138 @@
+// Copyright (c) 2024 averne <averne381@gmail.com>
+//
+// This file is part of SwitchWave.
+//
+// SwitchWave is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// SwitchWave is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with SwitchWave.  If not, see <http://www.gnu.org/licenses/>.
+
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <mutex>
+#include <set>
+#include <tuple>
+#include <utility>
+
+namespace sw::fs {
+
+// Arbitrates access to the protocol sessions of network filesystems
+// Requests are tagged with the priority class of the calling thread, which
+// defaults to playback-critical, since reads coming from mpv are not annotated
+class IoScheduler {
+    public:
+        enum class Priority {
+            PlaybackCritical,
+            PlaybackPrefetch,
+            Interactive,
+            Background,
+            Max,
+        };
+
+        using Clock = std::chrono::steady_clock;
+
+        struct QueueStats {
+            std::atomic_uint32_t depth;
+            std::atomic_uint64_t requests, total_wait_us, max_wait_us;
+        };
+
+        // Scheduling delays met by the current thread, to tell them apart from the time spent on the wire
+        struct ThreadAccounting {
+            Clock::duration wait_time; // Queued on gates
+            bool preempted;            // Asked to yield a gate to a more urgent request
+        };
+
+        // Sets the priority (and optionally a deadline) of I/O issued by the current thread
+        class ScopedPriority {
+            public:
+                ScopedPriority(Priority priority, Clock::time_point deadline = Clock::time_point::max()):
+                        prev_priority(IoScheduler::cur_priority), prev_deadline(IoScheduler::cur_deadline) {
+                    IoScheduler::cur_priority = priority;
+                    IoScheduler::cur_deadline = deadline;
+                }
+
+                ~ScopedPriority() {
+                    IoScheduler::cur_priority = this->prev_priority;
+                    IoScheduler::cur_deadline = this->prev_deadline;
+                }
+
+                ScopedPriority(const ScopedPriority &) = delete;
+                ScopedPriority &operator =(const ScopedPriority &) = delete;
+
+            private:
+                Priority prev_priority;
+                Clock::time_point prev_deadline;
+        };
+
+        // Mutex granted in priority order, then by earliest deadline, then in arrival order
+        // Meets the BasicLockable requirements, so it can be used with std::scoped_lock
+        class Gate {
+            public:
+                void lock();
+                void unlock();
+
+                // Whether a more urgent request is waiting, long low-priority operations should then
+                // release the gate at the next opportunity
+                bool preempt_requested();
+
+            private:
+                struct Waiter {
+                    Priority priority;
+                    Clock::time_point deadline;
+                    std::uint64_t seq;
+
+                    bool operator <(const Waiter &other) const {
+                        return std::tie(this->priority, this->deadline, this->seq) <
+                            std::tie(other.priority, other.deadline, other.seq);
+                    }
+                };
+
+            private:
+                std::mutex mutex;
+                std::condition_variable condvar;
+                std::set<Waiter> waiters;
+                std::uint64_t next_seq = 0;
+                bool held = false;
+                Priority holder_priority = Priority::PlaybackCritical;
+        };
+
+    public:
+        static Priority current_priority() {
+            return IoScheduler::cur_priority;
+        }
+
+        static Clock::time_point current_deadline() {
+            return IoScheduler::cur_deadline;
+        }
+
+        static const QueueStats &stats(Priority priority) {
+            return IoScheduler::queue_stats[static_cast<std::size_t>(priority)];
+        }
+
+        // Returns the accounting since the previous call, and resets it
+        static ThreadAccounting take_accounting() {
+            return std::exchange(IoScheduler::cur_accounting, ThreadAccounting());
+        }
+
+    private:
+        static inline thread_local Priority cur_priority            = Priority::PlaybackCritical;
+        static inline thread_local Clock::time_point cur_deadline   = Clock::time_point::max();
+        static inline thread_local ThreadAccounting cur_accounting = {};
+
+        static inline std::array<QueueStats, static_cast<std::size_t>(Priority::Max)> queue_stats = {};
+};
+
+} // namespace sw::fs
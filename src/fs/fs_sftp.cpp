@@ -15,6 +15,9 @@
 // You should have received a copy of the GNU General Public License
 // along with SwitchWave.  If not, see <http://www.gnu.org/licenses/>.
 
+#include <algorithm>
+#include <chrono>
+#include <memory>
 #include <fcntl.h>
 #include <sys/types.h>
 #include <sys/socket.h>
@@ -184,26 +187,26 @@ SftpFs::SftpFs(Context &context, std::string_view name, std::string_view mount_n
         .name         = this->name.data(),
 
         .structSize   = sizeof(SftpFsFile),
-        .open_r       = SftpFs::sftp_open,
+        .open_r       = Filesystem::instrumented<SftpFs, IoStats::Op::Open, SftpFs::sftp_open>,
         .close_r      = SftpFs::sftp_close,
-        .read_r       = SftpFs::sftp_read,
+        .read_r       = Filesystem::instrumented<SftpFs, IoStats::Op::Read, SftpFs::sftp_read>,
         .seek_r       = SftpFs::sftp_seek,
-        .fstat_r      = SftpFs::sftp_fstat,
+        .fstat_r      = Filesystem::instrumented<SftpFs, IoStats::Op::Stat, SftpFs::sftp_fstat>,
 
-        .stat_r       = SftpFs::sftp_stat,
+        .stat_r       = Filesystem::instrumented<SftpFs, IoStats::Op::Stat, SftpFs::sftp_stat>,
         .chdir_r      = SftpFs::sftp_chdir,
 
         .dirStateSize = sizeof(SftpFsDir),
-        .diropen_r    = SftpFs::sftp_diropen,
+        .diropen_r    = Filesystem::instrumented<SftpFs, IoStats::Op::Readdir, SftpFs::sftp_diropen>,
         .dirreset_r   = SftpFs::sftp_dirreset,
-        .dirnext_r    = SftpFs::sftp_dirnext,
+        .dirnext_r    = Filesystem::instrumented<SftpFs, IoStats::Op::Readdir, SftpFs::sftp_dirnext>,
         .dirclose_r   = SftpFs::sftp_dirclose,
 
         .statvfs_r    = SftpFs::sftp_statvfs,
 
         .deviceData   = this,
 
-        .lstat_r      = SftpFs::sftp_lstat,
+        .lstat_r      = Filesystem::instrumented<SftpFs, IoStats::Op::Stat, SftpFs::sftp_lstat>,
     };
 }
 
@@ -211,61 +214,120 @@ SftpFs::~SftpFs() {
     if (this->is_connected)
         this->disconnect();
 
-    if (this->ssh_session)
-        ::libssh2_session_free(this->ssh_session);
+    this->sessions.for_each([](SftpSession &session) {
+        if (session.ssh_session)
+            ::libssh2_session_free(session.ssh_session);
+    });
 
-    if (--SftpFs::lib_refcount == 0)
-        ::libssh2_exit();
+    {
+        auto lk = std::scoped_lock(SftpFs::lib_mutex);
+        if (--SftpFs::lib_refcount == 0)
+            ::libssh2_exit();
+    }
 
     this->unregister_fs();
 }
 
 int SftpFs::initialize() {
-    if (SftpFs::lib_refcount++ == 0) {
-        if (auto rc = ::libssh2_init(0); rc)
-            return ssh2_translate_error(rc, nullptr);
+    {
+        auto lk = std::scoped_lock(SftpFs::lib_mutex);
+        if (SftpFs::lib_refcount++ == 0) {
+            if (auto rc = ::libssh2_init(0); rc)
+                return ssh2_translate_error(rc, nullptr);
+        }
     }
 
-    this->ssh_session = ::libssh2_session_init();
-    if (!this->ssh_session)
+    auto session = std::make_unique<SftpSession>();
+
+    session->ssh_session = ::libssh2_session_init();
+    if (!session->ssh_session)
         return ENOMEM;
 
+    this->sessions.reset(std::move(session));
+
     return 0;
 }
 
 int SftpFs::connect(std::string_view host, std::uint16_t port, std::string_view share,
         std::string_view username, std::string_view password) {
+    // Kept to establish additional sessions
+    this->host     = host;
+    this->port     = port;
+    this->username = username;
+    this->password = password;
+
+    auto *session = this->sessions.primary();
+    if (!session)
+        return ENOTCONN;
+
+    if (auto rc = this->connect_session(*session); rc)
+        return rc;
+
+    if (!share.empty())
+        this->cwd = share;
+
+    this->is_connected = true;
+
+    return 0;
+}
+
+int SftpFs::disconnect() {
+    int rc = 0;
+
+    this->sessions.for_each([this, &rc](SftpSession &session) {
+        rc |= this->disconnect_session(session);
+    });
+
+    this->sessions.reset();
+    this->metadata_cache.clear();
+
+    this->is_connected = false;
+
+    return rc;
+}
+
+int SftpFs::connect_session(SftpSession &session) {
+    if (!session.ssh_session) {
+        session.ssh_session = ::libssh2_session_init();
+        if (!session.ssh_session)
+            return ENOMEM;
+    }
+
     struct addrinfo *ai = nullptr;
     SW_SCOPEGUARD([&ai] { ::freeaddrinfo(ai); });
 
-    if (auto rc = ::getaddrinfo(host.data(), nullptr, nullptr, &ai); rc)
+    if (auto rc = ::getaddrinfo(this->host.c_str(), nullptr, nullptr, &ai); rc)
         return ssh2_translate_addrinfo_error(rc);
 
-    this->sock = ::socket(AF_INET, SOCK_STREAM, 0);
-    if (this->sock < 0)
+    session.sock = ::socket(AF_INET, SOCK_STREAM, 0);
+    if (session.sock < 0)
         return errno;
 
+    // The receive buffer must be sized before connecting for the window scale to be negotiated
+    tune_socket(session.sock,
+        this->context.block_cache.estimator(this->mount_name).recommended_rcvbuf());
+
     // Set socket to non-blocking to avoid hangs if the host isn't found
-    auto flags = ::fcntl(this->sock, F_GETFL, 0);
-    fcntl(this->sock, F_SETFL, flags | O_NONBLOCK);
+    auto flags = ::fcntl(session.sock, F_GETFL, 0);
+    fcntl(session.sock, F_SETFL, flags | O_NONBLOCK);
 
     sockaddr_in sin = {
         .sin_family = static_cast<sa_family_t>(ai->ai_family),
-        .sin_port   = htons(port),
+        .sin_port   = htons(this->port),
         .sin_addr   = reinterpret_cast<struct sockaddr_in *>(ai->ai_addr)->sin_addr,
     };
 
-    if (auto rc = ::connect(this->sock, reinterpret_cast<sockaddr *>(&sin), sizeof(sin)); rc) {
+    if (auto rc = ::connect(session.sock, reinterpret_cast<sockaddr *>(&sin), sizeof(sin)); rc) {
         if (errno == EAGAIN || errno == EINPROGRESS) {
             pollfd pollfd = {
-                .fd     = this->sock,
+                .fd     = session.sock,
                 .events = POLLOUT,
             };
 
-            rc = ::poll(&pollfd, 1, 3000);
+            rc = ::poll(&pollfd, 1, std::chrono::milliseconds(ConnectTimeout).count());
             if (rc > 0) {
                 socklen_t len = sizeof(rc);
-                ::getsockopt(this->sock, SOL_SOCKET, SO_ERROR, &rc, &len);
+                ::getsockopt(session.sock, SOL_SOCKET, SO_ERROR, &rc, &len);
             } else {
                 rc = ETIMEDOUT;
             }
@@ -275,45 +337,49 @@ int SftpFs::connect(std::string_view host, std::uint16_t port, std::string_view
         }
     }
 
-    ::fcntl(this->sock, F_SETFL, flags);
+    ::fcntl(session.sock, F_SETFL, flags);
 
-    auto lk = std::scoped_lock(this->session_mutex);
+    auto lk = std::scoped_lock(session.mutex);
 
-    if (auto rc = ::libssh2_session_handshake(this->ssh_session, this->sock); rc)
-        return ssh2_translate_error(rc, nullptr);
+    // The handshake and authentication would otherwise block indefinitely on an unresponsive server
+    ::libssh2_session_set_timeout(session.ssh_session, std::chrono::milliseconds(ConnectTimeout).count());
+    SW_SCOPEGUARD([&session] { ::libssh2_session_set_timeout(session.ssh_session, 0); });
 
-    if (auto rc = ::libssh2_userauth_password(this->ssh_session, username.data(), password.data()); rc)
+    if (auto rc = ::libssh2_session_handshake(session.ssh_session, session.sock); rc)
         return ssh2_translate_error(rc, nullptr);
 
-    this->sftp_session = ::libssh2_sftp_init(this->ssh_session);
-    if (!this->sftp_session)
-        return ssh2_translate_error(::libssh2_session_last_errno(this->ssh_session), this->sftp_session);
-
-    ::libssh2_session_set_blocking(this->ssh_session, 1);
+    if (auto rc = ::libssh2_userauth_password(session.ssh_session, this->username.c_str(), this->password.c_str()); rc)
+        return ssh2_translate_error(rc, nullptr);
 
-    if (!share.empty())
-        this->cwd = share;
+    session.sftp_session = ::libssh2_sftp_init(session.ssh_session);
+    if (!session.sftp_session)
+        return ssh2_translate_error(::libssh2_session_last_errno(session.ssh_session), session.sftp_session);
 
-    this->is_connected = true;
+    ::libssh2_session_set_blocking(session.ssh_session, 1);
 
     return 0;
 }
 
-int SftpFs::disconnect() {
+int SftpFs::disconnect_session(SftpSession &session) {
     int rc = 0;
 
-    auto lk = std::scoped_lock(this->session_mutex);
+    auto lk = std::scoped_lock(session.mutex);
 
-    if (this->sftp_session)
-        rc |= ::libssh2_sftp_shutdown(this->sftp_session);
+    if (session.sftp_session)
+        rc |= ::libssh2_sftp_shutdown(session.sftp_session);
 
-    if (this->ssh_session)
-        rc |= ::libssh2_session_disconnect(this->ssh_session, "Normal Shutdown");
+    if (session.ssh_session && session.sock > 0)
+        rc |= ::libssh2_session_disconnect(session.ssh_session, "Normal Shutdown");
 
-    if (this->sock > 0)
-        rc |= ::close(this->sock);
+    if (session.ssh_session)
+        ::libssh2_session_free(session.ssh_session);
 
-    this->is_connected = false;
+    if (session.sock > 0)
+        rc |= ::close(session.sock);
+
+    session.sftp_session = nullptr;
+    session.ssh_session  = nullptr;
+    session.sock         = -1;
 
     return rc;
 }
@@ -322,45 +388,190 @@ std::string SftpFs::translate_path(const char *path) {
     return this->cwd + (path + this->mount_name.length());
 }
 
+ssize_t SftpFs::pread(SftpFsFile &file, std::uint64_t offset, char *buf, std::size_t len) {
+    // libssh2 has no positional read, and seeking drops all outstanding read requests.
+    // Read through small forward gaps instead, so that the pipeline is preserved
+    while (file.offset < offset && offset - file.offset <= SftpFs::MaxSkipDistance) {
+        auto rc = this->read_nonblocking(file, buf, std::min<std::uint64_t>(len, offset - file.offset));
+        if (rc <= 0)
+            return rc;
+    }
+
+    if (file.offset != offset) {
+        auto lk = std::scoped_lock(file.session->mutex);
+        if (!file.session->connected())
+            return -ENOTCONN;
+
+        ::libssh2_sftp_seek64(file.handle, offset);
+        file.offset = offset;
+    }
+
+    return this->read_nonblocking(file, buf, len);
+}
+
+ssize_t SftpFs::read_nonblocking(SftpFsFile &file, char *buf, std::size_t len) {
+    auto &session = *file.session;
+    auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(SftpFs::ReadTimeout);
+
+    while (true) {
+        int directions;
+        {
+            auto lk = std::scoped_lock(session.mutex);
+
+            if (!session.connected()) {
+                file.offset = -1;
+                return -ENOTCONN;
+            }
+
+            // libssh2 keeps several read requests in flight for the handle,
+            // non-blocking mode lets us give up the session while they complete
+            ::libssh2_session_set_blocking(session.ssh_session, 0);
+            auto rc = ::libssh2_sftp_read(file.handle, buf, len);
+            ::libssh2_session_set_blocking(session.ssh_session, 1);
+
+            if (rc >= 0) {
+                file.offset += rc;
+                return rc;
+            }
+
+            if (rc != LIBSSH2_ERROR_EAGAIN) {
+                file.offset = -1;
+                return -ssh2_translate_error(rc, session.sftp_session);
+            }
+
+            directions = ::libssh2_session_block_directions(session.ssh_session);
+        }
+
+        if (std::chrono::steady_clock::now() > deadline) {
+            file.offset = -1;
+            return -ETIMEDOUT;
+        }
+
+        // Wait without holding the session, so that other handles and metadata operations get their share.
+        // Another thread may consume our replies from the socket in the meantime, hence the short timeout
+        auto pfd = pollfd{
+            .fd     = session.sock,
+            .events = short(((directions & LIBSSH2_SESSION_BLOCK_INBOUND)  ? POLLIN  : 0) |
+                            ((directions & LIBSSH2_SESSION_BLOCK_OUTBOUND) ? POLLOUT : 0)),
+        };
+
+        ::poll(&pfd, 1, 10);
+    }
+}
+
 int SftpFs::sftp_open(struct _reent *r, void *fileStruct, const char *path, int flags, int mode) {
-    auto *priv      = static_cast<SftpFs     *>(r->deviceData);
-    auto *priv_file = static_cast<SftpFsFile *>(fileStruct);
+    auto *priv      = static_cast<SftpFs *>(r->deviceData);
+    auto *priv_file = std::construct_at(static_cast<SftpFsFile *>(fileStruct));
 
     auto internal_path = priv->translate_path(path);
     if (internal_path.empty()) {
+        std::destroy_at(priv_file);
         __errno_r(r) = EINVAL;
         return -1;
     }
 
-    auto lk = std::scoped_lock(priv->session_mutex);
+    bool is_readonly = (flags & O_ACCMODE) == O_RDONLY && !(flags & (O_CREAT | O_TRUNC));
+    if (!is_readonly)
+        priv->metadata_cache.invalidate(internal_path);
+
+    // Attributes from a recent listing or stat save a round-trip, the complete set is only fetched by fstat
+    struct stat cached_st;
+    bool is_cached = is_readonly &&
+        priv->metadata_cache.lookup_stat(internal_path, &cached_st) == 0 && S_ISREG(cached_st.st_mode);
 
-    priv_file->handle = ::libssh2_sftp_open_ex(priv->sftp_session, internal_path.c_str(), internal_path.length(),
-        ssh2_translate_open_flags(flags), 0, LIBSSH2_SFTP_OPENFILE);
-    if (!priv_file->handle) {
-        __errno_r(r) = ssh2_translate_error(::libssh2_session_last_errno(priv->ssh_session), priv->sftp_session);
+    auto *session = priv->sessions.acquire([priv]() -> std::unique_ptr<SftpSession> {
+        auto session = std::make_unique<SftpSession>();
+        if (priv->connect_session(*session)) {
+            priv->disconnect_session(*session);
+            return nullptr;
+        }
+        return session;
+    }, [priv](SftpSession &session) {
+        priv->disconnect_session(session);
+    });
+
+    if (!session) {
+        std::destroy_at(priv_file);
+        __errno_r(r) = ENOTCONN;
         return -1;
     }
 
-    auto rc = ::libssh2_sftp_fstat(priv_file->handle, &priv_file->attrs);
-    if (rc) {
-        __errno_r(r) = ssh2_translate_error(rc, priv->sftp_session);
-        return -1;
+    priv_file->session = session;
+
+    {
+        auto lk = std::scoped_lock(session->mutex);
+
+        if (!session->connected()) {
+            priv->sessions.release(*session);
+            std::destroy_at(priv_file);
+            __errno_r(r) = ENOTCONN;
+            return -1;
+        }
+
+        priv_file->handle = ::libssh2_sftp_open_ex(session->sftp_session, internal_path.c_str(), internal_path.length(),
+            ssh2_translate_open_flags(flags), 0, LIBSSH2_SFTP_OPENFILE);
+        if (!priv_file->handle) {
+            auto error = ssh2_translate_error(::libssh2_session_last_errno(session->ssh_session), session->sftp_session);
+            priv->sessions.release(*session);
+            std::destroy_at(priv_file);
+            __errno_r(r) = error;
+            return -1;
+        }
+
+        if (is_cached) {
+            priv_file->attrs = {};
+            priv_file->attrs.flags       = LIBSSH2_SFTP_ATTR_SIZE | LIBSSH2_SFTP_ATTR_PERMISSIONS | LIBSSH2_SFTP_ATTR_ACMODTIME;
+            priv_file->attrs.filesize    = cached_st.st_size;
+            priv_file->attrs.permissions = cached_st.st_mode;
+            priv_file->attrs.atime       = cached_st.st_atim.tv_sec;
+            priv_file->attrs.mtime       = cached_st.st_mtim.tv_sec;
+            priv_file->has_attrs         = false;
+        } else {
+            auto rc = ::libssh2_sftp_fstat(priv_file->handle, &priv_file->attrs);
+            if (rc) {
+                ::libssh2_sftp_close(priv_file->handle);
+                auto error = ssh2_translate_error(rc, session->sftp_session);
+                priv->sessions.release(*session);
+                std::destroy_at(priv_file);
+                __errno_r(r) = error;
+                return -1;
+            }
+            priv_file->has_attrs = true;
+        }
     }
 
     priv_file->offset = 0;
 
+    priv_file->stream.open(priv->context.block_cache, priv->stats, priv->mount_name, internal_path,
+        priv_file->attrs.filesize, priv_file->attrs.mtime,
+        [priv, priv_file](std::uint64_t offset, void *buf, std::size_t len) -> ssize_t {
+            auto lk = std::scoped_lock(priv_file->read_mutex);
+            return priv->pread(*priv_file, offset, static_cast<char *>(buf), len);
+        });
+
     return 0;
 }
 
 int SftpFs::sftp_close(struct _reent *r, void *fd) {
     auto *priv      = static_cast<SftpFs     *>(r->deviceData);
     auto *priv_file = static_cast<SftpFsFile *>(fd);
+    auto &session   = *priv_file->session;
+    SW_SCOPEGUARD([&] {
+        priv->sessions.release(session);
+        std::destroy_at(priv_file);
+    });
+
+    priv_file->stream.close();
 
-    auto lk = std::scoped_lock(priv->session_mutex);
+    auto lk = std::scoped_lock(session.mutex);
+
+    // The handle went away with the session
+    if (!session.connected())
+        return 0;
 
     auto rc = ::libssh2_sftp_close(priv_file->handle);
     if (rc) {
-        __errno_r(r) = ssh2_translate_error(rc, priv->sftp_session);
+        __errno_r(r) = ssh2_translate_error(rc, session.sftp_session);
         return -1;
     }
 
@@ -368,51 +579,40 @@ int SftpFs::sftp_close(struct _reent *r, void *fd) {
 }
 
 ssize_t SftpFs::sftp_read(struct _reent *r, void *fd, char *ptr, size_t len) {
-    auto *priv      = static_cast<SftpFs     *>(r->deviceData);
     auto *priv_file = static_cast<SftpFsFile *>(fd);
 
-    auto lk = std::scoped_lock(priv->session_mutex);
-
-    auto rc = ::libssh2_sftp_read(priv_file->handle, ptr, len);
-    if (rc < 0) {
-        __errno_r(r) = ssh2_translate_error(rc, priv->sftp_session);
+    if (auto rc = priv_file->stream.read(ptr, len); rc < 0) {
+        __errno_r(r) = -rc;
         return -1;
+    } else {
+        return rc;
     }
-
-    priv_file->offset += rc;
-
-    return rc;
 }
 
 off_t SftpFs::sftp_seek(struct _reent *r, void *fd, off_t pos, int dir) {
-    auto *priv      = static_cast<SftpFs     *>(r->deviceData);
     auto *priv_file = static_cast<SftpFsFile *>(fd);
 
-    off_t offset;
-    switch (dir) {
-        default:
-        case SEEK_SET:
-            offset = 0;
-            break;
-        case SEEK_CUR:
-            offset = priv_file->offset;
-            break;
-        case SEEK_END:
-            offset = priv_file->attrs.filesize;
-            break;
+    if (auto rc = priv_file->stream.seek(pos, dir); rc < 0) {
+        __errno_r(r) = -rc;
+        return -1;
+    } else {
+        return rc;
     }
-
-    priv_file->offset = offset + pos;
-
-    auto lk = std::scoped_lock(priv->session_mutex);
-
-    ::libssh2_sftp_seek64(priv_file->handle, priv_file->offset);
-    return priv_file->offset;
 }
 
 int SftpFs::sftp_fstat(struct _reent *r, void *fd, struct stat *st) {
     auto *priv_file = static_cast<SftpFsFile *>(fd);
 
+    if (!priv_file->has_attrs) {
+        auto read_lk    = std::scoped_lock(priv_file->read_mutex);
+        auto session_lk = std::scoped_lock(priv_file->session->mutex);
+
+        // Keep the partial attributes on failure
+        LIBSSH2_SFTP_ATTRIBUTES attrs;
+        if (priv_file->session->connected() && ::libssh2_sftp_fstat(priv_file->handle, &attrs) == 0)
+            priv_file->attrs = attrs, priv_file->has_attrs = true;
+    }
+
     ssh2_translate_stat(priv_file->attrs, st);
     return 0;
 }
@@ -426,16 +626,33 @@ int SftpFs::sftp_stat(struct _reent *r, const char *file, struct stat *st) {
         return -1;
     }
 
-    auto lk = std::scoped_lock(priv->session_mutex);
+    if (auto rc = priv->metadata_cache.lookup_stat(internal_path, st); rc) {
+        if (*rc) {
+            __errno_r(r) = *rc;
+            return -1;
+        }
+        return 0;
+    }
+
+    auto lk = std::unique_lock<IoScheduler::Gate>();
+    auto *session = priv->sessions.lock_primary(lk);
+    if (!session) {
+        __errno_r(r) = ENOTCONN;
+        return -1;
+    }
 
     LIBSSH2_SFTP_ATTRIBUTES attrs;
-    auto rc = ::libssh2_sftp_stat(priv->sftp_session, internal_path.c_str(), &attrs);
+    auto rc = ::libssh2_sftp_stat(session->sftp_session, internal_path.c_str(), &attrs);
     if (rc) {
-        __errno_r(r) = ssh2_translate_error(rc, priv->sftp_session);
+        auto error = ssh2_translate_error(rc, session->sftp_session);
+        if (error == ENOENT)
+            priv->metadata_cache.insert_negative(internal_path);
+        __errno_r(r) = error;
         return -1;
     }
 
     ssh2_translate_stat(attrs, st);
+    priv->metadata_cache.insert_stat(internal_path, *st);
     return 0;
 }
 
@@ -448,12 +665,17 @@ int SftpFs::sftp_lstat(struct _reent *r, const char *file, struct stat *st) {
         return -1;
     }
 
-    auto lk = std::scoped_lock(priv->session_mutex);
+    auto lk = std::unique_lock<IoScheduler::Gate>();
+    auto *session = priv->sessions.lock_primary(lk);
+    if (!session) {
+        __errno_r(r) = ENOTCONN;
+        return -1;
+    }
 
     LIBSSH2_SFTP_ATTRIBUTES attrs;
-    auto rc = ::libssh2_sftp_lstat(priv->sftp_session, internal_path.c_str(), &attrs);
+    auto rc = ::libssh2_sftp_lstat(session->sftp_session, internal_path.c_str(), &attrs);
     if (rc) {
-        __errno_r(r) = ssh2_translate_error(rc, priv->sftp_session);
+        __errno_r(r) = ssh2_translate_error(rc, session->sftp_session);
         return -1;
     }
 
@@ -476,20 +698,33 @@ int SftpFs::sftp_chdir(struct _reent *r, const char *name) {
 
 DIR_ITER *SftpFs::sftp_diropen(struct _reent *r, DIR_ITER *dirState, const char *path) {
     auto *priv     = static_cast<SftpFs    *>(r->deviceData);
-    auto *priv_dir = static_cast<SftpFsDir *>(dirState->dirStruct);
+    auto *priv_dir = std::construct_at(static_cast<SftpFsDir *>(dirState->dirStruct));
 
     auto internal_path = priv->translate_path(path);
     if (internal_path.empty()) {
+        std::destroy_at(priv_dir);
         __errno_r(r) = EINVAL;
         return nullptr;
     }
 
-    auto lk = std::scoped_lock(priv->session_mutex);
+    if (priv->metadata_cache.open_dir(priv_dir->cache, internal_path)) {
+        priv_dir->handle = nullptr;
+        return dirState;
+    }
+
+    auto lk = std::unique_lock<IoScheduler::Gate>();
+    auto *session = priv->sessions.lock_primary(lk);
+    if (!session) {
+        std::destroy_at(priv_dir);
+        __errno_r(r) = ENOTCONN;
+        return nullptr;
+    }
 
-    priv_dir->handle = ::libssh2_sftp_open_ex(priv->sftp_session, internal_path.c_str(), internal_path.length(),
+    priv_dir->handle = ::libssh2_sftp_open_ex(session->sftp_session, internal_path.c_str(), internal_path.length(),
         0, 0, LIBSSH2_SFTP_OPENDIR);
     if (!priv_dir->handle) {
-        __errno_r(r) = ssh2_translate_error(::libssh2_session_last_errno(priv->ssh_session), priv->sftp_session);
+        std::destroy_at(priv_dir);
+        __errno_r(r) = ssh2_translate_error(::libssh2_session_last_errno(session->ssh_session), session->sftp_session);
         return nullptr;
     }
 
@@ -497,24 +732,47 @@ DIR_ITER *SftpFs::sftp_diropen(struct _reent *r, DIR_ITER *dirState, const char
 }
 
 int SftpFs::sftp_dirreset(struct _reent *r, DIR_ITER *dirState) {
-    __errno_r(r) = ENOSYS;
-    return -1;
+    auto *priv     = static_cast<SftpFs    *>(r->deviceData);
+    auto *priv_dir = static_cast<SftpFsDir *>(dirState->dirStruct);
+
+    // Only listings replayed from the cache can be rewound
+    if (priv_dir->handle) {
+        __errno_r(r) = ENOSYS;
+        return -1;
+    }
+
+    priv->metadata_cache.rewind_dir(priv_dir->cache);
+    return 0;
 }
 
 int SftpFs::sftp_dirnext(struct _reent *r, DIR_ITER *dirState, char *filename, struct stat *filestat) {
     auto *priv     = static_cast<SftpFs    *>(r->deviceData);
     auto *priv_dir = static_cast<SftpFsDir *>(dirState->dirStruct);
 
-    auto lk = std::scoped_lock(priv->session_mutex);
+    if (!priv_dir->handle) {
+        if (!priv->metadata_cache.next_cached(priv_dir->cache, filename, filestat)) {
+            __errno_r(r) = ENOENT;
+            return -1;
+        }
+        return 0;
+    }
+
+    auto lk = std::unique_lock<IoScheduler::Gate>();
+    auto *session = priv->sessions.lock_primary(lk);
+    if (!session) {
+        __errno_r(r) = ENOTCONN;
+        return -1;
+    }
 
     LIBSSH2_SFTP_ATTRIBUTES attrs;
     while (true) {
         auto rc = ::libssh2_sftp_readdir(priv_dir->handle, filename, NAME_MAX, &attrs);
         if (rc == 0) {
+            priv->metadata_cache.finish_dir(priv_dir->cache);
             __errno_r(r) = ENOENT;
             return -1;
         } else if (rc < 0) {
-            __errno_r(r) = ssh2_translate_error(rc, priv->sftp_session);
+            __errno_r(r) = ssh2_translate_error(rc, session->sftp_session);
             return -1;
         }
 
@@ -524,6 +782,7 @@ int SftpFs::sftp_dirnext(struct _reent *r, DIR_ITER *dirState, char *filename, s
     }
 
     ssh2_translate_stat(attrs, filestat);
+    priv->metadata_cache.record(priv_dir->cache, filename, *filestat);
     return 0;
 }
 
@@ -531,9 +790,18 @@ int SftpFs::sftp_dirclose(struct _reent *r, DIR_ITER *dirState) {
     auto *priv     = static_cast<SftpFs    *>(r->deviceData);
     auto *priv_dir = static_cast<SftpFsDir *>(dirState->dirStruct);
 
-    auto lk = std::scoped_lock(priv->session_mutex);
+    SW_SCOPEGUARD([&priv_dir] { std::destroy_at(priv_dir); });
 
-    return ssh2_translate_error(::libssh2_sftp_closedir(priv_dir->handle), priv->sftp_session);
+    if (!priv_dir->handle)
+        return 0;
+
+    // The handle went away with the session
+    auto lk = std::unique_lock<IoScheduler::Gate>();
+    auto *session = priv->sessions.lock_primary(lk);
+    if (!session)
+        return 0;
+
+    return ssh2_translate_error(::libssh2_sftp_closedir(priv_dir->handle), session->sftp_session);
 }
 
 int SftpFs::sftp_statvfs(struct _reent *r, const char *path, struct statvfs *buf) {
@@ -545,12 +813,17 @@ int SftpFs::sftp_statvfs(struct _reent *r, const char *path, struct statvfs *buf
         return -1;
     }
 
-    auto lk = std::scoped_lock(priv->session_mutex);
+    auto lk = std::unique_lock<IoScheduler::Gate>();
+    auto *session = priv->sessions.lock_primary(lk);
+    if (!session) {
+        __errno_r(r) = ENOTCONN;
+        return -1;
+    }
 
     LIBSSH2_SFTP_STATVFS st;
-    auto rc = ::libssh2_sftp_statvfs(priv->sftp_session, internal_path.c_str(), internal_path.length(), &st);
+    auto rc = ::libssh2_sftp_statvfs(session->sftp_session, internal_path.c_str(), internal_path.length(), &st);
     if (rc) {
-        __errno_r(r) = ssh2_translate_error(rc, priv->sftp_session);
+        __errno_r(r) = ssh2_translate_error(rc, session->sftp_session);
         return -1;
     }
 
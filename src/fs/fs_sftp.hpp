@@ -17,7 +17,6 @@
 
 #pragma once
 
-#include <atomic>
 #include <mutex>
 #include <string>
 #include <string_view>
@@ -27,6 +26,8 @@
 
 #include "context.hpp"
 #include "fs/fs_common.hpp"
+#include "fs/fs_cache.hpp"
+#include "fs/fs_scheduler.hpp"
 
 namespace sw::fs {
 
@@ -41,8 +42,33 @@ class SftpFs final: public NetworkFilesystem {
         virtual int disconnect() override;
 
     private:
+        constexpr static std::uint64_t MaxSkipDistance = 0x200000; // 2MiB
+        constexpr static int           ReadTimeout     = 3000;     // ms
+
+        struct SftpFsFile;
+
+        struct SftpSession {
+            int sock = -1;
+            LIBSSH2_SESSION *ssh_session  = nullptr;
+            LIBSSH2_SFTP    *sftp_session = nullptr;
+            std::size_t num_files = 0;
+            IoScheduler::Gate mutex;
+
+            // Must be called with the mutex held
+            bool connected() const {
+                return this->sftp_session;
+            }
+        };
+
         std::string translate_path(const char *path);
 
+        int connect_session(SftpSession &session);
+        int disconnect_session(SftpSession &session);
+
+        // Positional read, must be called with the file read mutex held
+        ssize_t pread(SftpFsFile &file, std::uint64_t offset, char *buf, std::size_t len);
+        ssize_t read_nonblocking(SftpFsFile &file, char *buf, std::size_t len);
+
         static int       sftp_open    (struct _reent *r, void *fileStruct, const char *path, int flags, int mode);
         static int       sftp_close   (struct _reent *r, void *fd);
         static ssize_t   sftp_read    (struct _reent *r, void *fd, char *ptr, size_t len);
@@ -59,26 +85,32 @@ class SftpFs final: public NetworkFilesystem {
 
     private:
         struct SftpFsFile {
+            SftpSession *session;
             LIBSSH2_SFTP_HANDLE *handle;
             LIBSSH2_SFTP_ATTRIBUTES attrs;
-            off_t offset;
+            bool has_attrs; // Whether attrs is complete, or only has the permissions, size and times
+            std::uint64_t offset; // Position of the libssh2 handle
+            std::mutex read_mutex;
+            BlockCache::Stream stream;
         };
 
         struct SftpFsDir {
             LIBSSH2_SFTP_HANDLE *handle;
+            MetadataCache::DirState cache;
         };
 
     private:
-        static inline std::atomic_int lib_refcount = 0;
+        // Shares are mounted concurrently, and library setup and teardown are not thread-safe
+        static inline std::mutex lib_mutex;
+        static inline int lib_refcount = 0;
 
         Context &context;
 
-        int sock;
-        LIBSSH2_SESSION *ssh_session  = nullptr;
-        LIBSSH2_SFTP    *sftp_session = nullptr;
-        std::mutex session_mutex;
-
+        std::string host, username, password;
+        std::uint16_t port;
         std::string cwd = "";
+
+        SessionPool<SftpSession> sessions;
 };
 
 } // namespace sw::fs
@@ -15,6 +15,10 @@
 // You should have received a copy of the GNU General Public License
 // along with SwitchWave.  If not, see <http://www.gnu.org/licenses/>.
 
+#include <algorithm>
+#include <iterator>
+#include <memory>
+#include <vector>
 #include <fcntl.h>
 #include <sys/socket.h>
 #include <arpa/inet.h>
@@ -71,26 +75,26 @@ SmbFs::SmbFs(Context &context, std::string_view name, std::string_view mount_nam
         .name         = this->name.data(),
 
         .structSize   = sizeof(SmbFsFile),
-        .open_r       = SmbFs::smb_open,
+        .open_r       = Filesystem::instrumented<SmbFs, IoStats::Op::Open, SmbFs::smb_open>,
         .close_r      = SmbFs::smb_close,
-        .read_r       = SmbFs::smb_read,
+        .read_r       = Filesystem::instrumented<SmbFs, IoStats::Op::Read, SmbFs::smb_read>,
         .seek_r       = SmbFs::smb_seek,
-        .fstat_r      = SmbFs::smb_fstat,
+        .fstat_r      = Filesystem::instrumented<SmbFs, IoStats::Op::Stat, SmbFs::smb_fstat>,
 
-        .stat_r       = SmbFs::smb_stat,
+        .stat_r       = Filesystem::instrumented<SmbFs, IoStats::Op::Stat, SmbFs::smb_stat>,
         .chdir_r      = SmbFs::smb_chdir,
 
         .dirStateSize = sizeof(SmbFsDir),
-        .diropen_r    = SmbFs::smb_diropen,
+        .diropen_r    = Filesystem::instrumented<SmbFs, IoStats::Op::Readdir, SmbFs::smb_diropen>,
         .dirreset_r   = SmbFs::smb_dirreset,
-        .dirnext_r    = SmbFs::smb_dirnext,
+        .dirnext_r    = Filesystem::instrumented<SmbFs, IoStats::Op::Readdir, SmbFs::smb_dirnext>,
         .dirclose_r   = SmbFs::smb_dirclose,
 
         .statvfs_r    = SmbFs::smb_statvfs,
 
         .deviceData   = this,
 
-        .lstat_r      = SmbFs::smb_lstat,
+        .lstat_r      = Filesystem::instrumented<SmbFs, IoStats::Op::Stat, SmbFs::smb_lstat>,
     };
 }
 
@@ -102,29 +106,33 @@ SmbFs::~SmbFs() {
 }
 
 int SmbFs::initialize() {
-    this->smb_ctx = ::smb2_init_context();
-    if (!this->smb_ctx)
+    auto session = std::make_unique<SmbSession>();
+
+    session->ctx = ::smb2_init_context();
+    if (!session->ctx)
         return ENOMEM;
 
-    ::smb2_set_timeout(this->smb_ctx, 3);
+    this->sessions.reset(std::move(session));
 
     return 0;
 }
 
 int SmbFs::connect(std::string_view host, std::uint16_t port, std::string_view share,
         std::string_view username, std::string_view password) {
-    if (!username.empty())
-        ::smb2_set_user    (this->smb_ctx, username.data());
-
-    if (!password.empty())
-        ::smb2_set_password(this->smb_ctx, password.data());
+    // Kept to establish additional sessions
+    this->host     = host;
+    this->share    = share;
+    this->username = username;
+    this->password = password;
 
-    ::smb2_set_security_mode(this->smb_ctx, SMB2_NEGOTIATE_SIGNING_ENABLED);
+    auto *session = this->sessions.primary();
+    if (!session)
+        return ENOTCONN;
 
-    auto lk = std::scoped_lock(this->session_mutex);
+    auto lk = std::scoped_lock(session->mutex);
 
-    if (auto rc = ::smb2_connect_share(this->smb_ctx, host.data(), share.data(), nullptr); rc < 0)
-        return -rc;
+    if (auto rc = this->connect_session(*session); rc)
+        return rc;
 
     this->is_connected = true;
 
@@ -134,55 +142,407 @@ int SmbFs::connect(std::string_view host, std::uint16_t port, std::string_view s
 int SmbFs::disconnect() {
     int rc = 0;
 
-    auto lk = std::scoped_lock(this->session_mutex);
-
-    if (this->smb_ctx) {
-        ::smb2_disconnect_share(this->smb_ctx);
-        ::smb2_destroy_context(this->smb_ctx);
+    if (this->lingering_thread.joinable()) {
+        this->lingering_thread.request_stop();
+        this->lingering_thread.join();
     }
 
+    this->expire_lingering_handles(true);
+
+    this->sessions.for_each([this](SmbSession &session) {
+        auto lk = std::scoped_lock(session.mutex);
+        this->disconnect_session(session);
+    });
+
+    this->sessions.reset();
+    this->metadata_cache.clear();
+
     this->is_connected = false;
 
     return rc;
 }
 
+int SmbFs::connect_session(SmbSession &session) {
+    if (!session.ctx) {
+        session.ctx = ::smb2_init_context();
+        if (!session.ctx)
+            return ENOMEM;
+    }
+
+    ::smb2_set_timeout(session.ctx, ConnectTimeout.count());
+
+    if (!this->username.empty())
+        ::smb2_set_user    (session.ctx, this->username.c_str());
+
+    if (!this->password.empty())
+        ::smb2_set_password(session.ctx, this->password.c_str());
+
+    ::smb2_set_security_mode(session.ctx, SMB2_NEGOTIATE_SIGNING_ENABLED);
+
+    if (auto rc = ::smb2_connect_share(session.ctx, this->host.c_str(), this->share.c_str(), nullptr); rc < 0)
+        return -rc;
+
+    // libsmb2 creates the socket and connects in the same call, too late to size the receive buffer
+    tune_socket(::smb2_get_fd(session.ctx));
+
+    // Negotiated during the connection, libsmb2 picks the largest size the server allows
+    session.max_read_size = std::max(::smb2_get_max_read_size(session.ctx), std::uint32_t(MinReadSize));
+
+    return 0;
+}
+
+void SmbFs::disconnect_session(SmbSession &session) {
+    if (session.ctx) {
+        ::smb2_disconnect_share(session.ctx);
+        ::smb2_destroy_context(session.ctx);
+        session.ctx = nullptr;
+    }
+}
+
+bool SmbFs::take_lingering_handle(SmbFsFile &file) {
+    auto lk = std::scoped_lock(this->lingering_mutex);
+
+    auto it = std::find_if(this->lingering_handles.begin(), this->lingering_handles.end(), [&file](const auto &h) {
+        return h.path == file.path;
+    });
+
+    if (it == this->lingering_handles.end())
+        return false;
+
+    file.session  = it->session;
+    file.handle   = it->handle;
+    file.stat     = it->stat;
+    file.has_stat = it->has_stat;
+
+    this->lingering_handles.erase(it);
+    return true;
+}
+
+void SmbFs::linger_handle(SmbFsFile &file) {
+    std::vector<LingeringHandle> evicted;
+
+    {
+        auto lk = std::scoped_lock(this->lingering_mutex);
+
+        this->lingering_handles.push_back({
+            .path     = std::move(file.path),
+            .session  = file.session,
+            .handle   = file.handle,
+            .stat     = file.stat,
+            .has_stat = file.has_stat,
+            .expiry   = std::chrono::steady_clock::now() + SmbFs::HandleLinger,
+        });
+
+        // Oldest handles are at the front
+        if (this->lingering_handles.size() > SmbFs::MaxLingeringHandles) {
+            auto it = this->lingering_handles.begin() + (this->lingering_handles.size() - SmbFs::MaxLingeringHandles);
+            std::move(this->lingering_handles.begin(), it, std::back_inserter(evicted));
+            this->lingering_handles.erase(this->lingering_handles.begin(), it);
+        }
+
+        if (!this->lingering_thread.joinable())
+            this->lingering_thread = std::jthread(&SmbFs::linger_thread_fn, this);
+    }
+
+    this->lingering_condvar.notify_one();
+
+    for (auto &handle: evicted)
+        this->close_lingering_handle(handle);
+}
+
+void SmbFs::close_lingering_handle(LingeringHandle &handle) {
+    {
+        auto lk = std::scoped_lock(handle.session->mutex);
+        if (handle.session->connected())
+            ::smb2_close(handle.session->ctx, handle.handle);
+    }
+
+    this->sessions.release(*handle.session);
+}
+
+void SmbFs::expire_lingering_handles(bool all, std::string_view path) {
+    std::vector<LingeringHandle> expired;
+
+    {
+        auto lk = std::scoped_lock(this->lingering_mutex);
+
+        auto now = std::chrono::steady_clock::now();
+        auto it = std::stable_partition(this->lingering_handles.begin(), this->lingering_handles.end(),
+            [all, path, now](const auto &h) {
+                return !(all || (!path.empty() ? h.path == path : h.expiry <= now));
+            });
+
+        std::move(it, this->lingering_handles.end(), std::back_inserter(expired));
+        this->lingering_handles.erase(it, this->lingering_handles.end());
+    }
+
+    for (auto &handle: expired)
+        this->close_lingering_handle(handle);
+}
+
+void SmbFs::linger_thread_fn(std::stop_token token) {
+    auto lk = std::unique_lock(this->lingering_mutex);
+
+    while (!token.stop_requested()) {
+        // All handles linger for the same duration, so the oldest one expires first
+        if (this->lingering_handles.empty())
+            this->lingering_condvar.wait(lk, token, [this] { return !this->lingering_handles.empty(); });
+        else
+            this->lingering_condvar.wait_until(lk, token, this->lingering_handles.front().expiry, [] { return false; });
+
+        if (token.stop_requested())
+            break;
+
+        lk.unlock();
+        this->expire_lingering_handles();
+        lk.lock();
+    }
+}
+
 std::string SmbFs::translate_path(const char *path) {
     return this->cwd + (path + this->mount_name.length());
 }
 
+namespace {
+
+// Requests write into a buffer owned by the pipeline, so that completions arriving after the reader
+// gave up (on a later service of the session) don't land in memory the caller has since released
+struct SmbReadPipeline {
+    std::unique_ptr<std::uint8_t[]> data;
+    std::vector<int> results;
+    int  inflight  = 0;
+    bool abandoned = false;
+};
+
+struct SmbReadRequest {
+    SmbReadPipeline *pipeline;
+    std::size_t idx;
+};
+
+void smb2_read_cb(struct smb2_context *smb2, int status, void *command_data, void *cb_data) {
+    auto *req      = static_cast<SmbReadRequest *>(cb_data);
+    auto *pipeline = req->pipeline;
+
+    pipeline->results[req->idx] = status;
+
+    // The reader gave up after a fatal error, whoever completes last frees the state
+    if (--pipeline->inflight == 0 && pipeline->abandoned)
+        delete pipeline;
+
+    delete req;
+}
+
+} // namespace
+
+ssize_t SmbFs::pread_pipelined(SmbSession &session, struct smb2fh *handle,
+        std::uint64_t offset, std::uint8_t *buf, std::size_t len) {
+    if (!session.connected())
+        return -ENOTCONN;
+
+    // Split the read so that several requests are in flight, which hides the round-trip latency.
+    // libsmb2 defers requests exceeding the credits granted by the server
+    auto chunk_size = utils::align_up(std::max(len / MaxInflightReads, MinReadSize), MinReadSize);
+    chunk_size = std::min(chunk_size, std::size_t(session.max_read_size));
+
+    auto num_chunks = (len + chunk_size - 1) / chunk_size;
+
+    auto *pipeline = new SmbReadPipeline{
+        .data    = std::make_unique_for_overwrite<std::uint8_t[]>(len),
+        .results = std::vector<int>(num_chunks, 0),
+    };
+
+    std::size_t next = 0;
+    int error = 0;
+    while (next < num_chunks || pipeline->inflight > 0) {
+        while (!error && next < num_chunks && pipeline->inflight < int(MaxInflightReads)) {
+            // Cut the read short if a more urgent request is waiting for the session,
+            // the caller will come back for the rest
+            if (next > 0 && session.mutex.preempt_requested()) {
+                num_chunks = next;
+                break;
+            }
+
+            auto chunk_off = next * chunk_size, chunk_len = std::min(chunk_size, len - chunk_off);
+
+            auto *req = new SmbReadRequest{ pipeline, next };
+            if (auto rc = ::smb2_pread_async(session.ctx, handle, pipeline->data.get() + chunk_off, chunk_len,
+                    offset + chunk_off, smb2_read_cb, req); rc < 0) {
+                delete req;
+                error = -rc;
+                break;
+            }
+
+            ++pipeline->inflight, ++next;
+        }
+
+        if (error && !pipeline->inflight)
+            break;
+
+        if (error)
+            next = num_chunks;
+
+        auto pfd = pollfd{
+            .fd     = ::smb2_get_fd(session.ctx),
+            .events = short(::smb2_which_events(session.ctx)),
+        };
+
+        if (auto rc = ::poll(&pfd, 1, 1000); rc < 0) {
+            error = errno;
+            break;
+        }
+
+        // Also called on poll timeouts, to let libsmb2 expire stale requests
+        if (::smb2_service(session.ctx, pfd.revents) < 0) {
+            error = EIO;
+            break;
+        }
+    }
+
+    if (pipeline->inflight) {
+        // The connection is broken, outstanding requests complete or time out on a later service of the session
+        pipeline->abandoned = true;
+        return -error;
+    }
+
+    SW_SCOPEGUARD([&pipeline] { delete pipeline; });
+
+    // Reassemble in order, stopping at the first short or failed read
+    std::size_t done = 0;
+    for (std::size_t i = 0; i < num_chunks; ++i) {
+        auto res = pipeline->results[i];
+        if (res < 0) {
+            error = done ? 0 : -res;
+            break;
+        }
+
+        done += res;
+        if (std::size_t(res) < std::min(chunk_size, len - i * chunk_size))
+            break;
+    }
+
+    std::copy_n(pipeline->data.get(), done, buf);
+
+    return error && !done ? -error : done;
+}
+
 int SmbFs::smb_open(struct _reent *r, void *fileStruct, const char *path, int flags, int mode) {
-    auto *priv      = static_cast<SmbFs     *>(r->deviceData);
-    auto *priv_file = static_cast<SmbFsFile *>(fileStruct);
+    auto *priv      = static_cast<SmbFs *>(r->deviceData);
+    auto *priv_file = std::construct_at(static_cast<SmbFsFile *>(fileStruct));
 
     auto internal_path = priv->translate_path(path);
     if (internal_path.empty()) {
+        std::destroy_at(priv_file);
         __errno_r(r) = EINVAL;
         return -1;
     }
 
-    auto lk = std::scoped_lock(priv->session_mutex);
+    priv_file->path        = internal_path;
+    priv_file->is_readonly = (flags & O_ACCMODE) == O_RDONLY && !(flags & (O_CREAT | O_TRUNC));
 
-    priv_file->handle = ::smb2_open(priv->smb_ctx, internal_path.c_str() + 1, flags);
-    if (!priv_file->handle) {
-        __errno_r(r) = ENOENT;
-        return -1;
+    if (!priv_file->is_readonly) {
+        priv->metadata_cache.invalidate(internal_path);
+        priv->expire_lingering_handles(false, internal_path);
+    } else {
+        priv->expire_lingering_handles();
     }
 
-    if (auto rc = ::smb2_fstat(priv->smb_ctx, priv_file->handle, &priv_file->stat); rc < 0) {
-        __errno_r(r) = -rc;
-        return -1;
+    if (!priv_file->is_readonly || !priv->take_lingering_handle(*priv_file)) {
+        // Attributes from a recent listing or stat save a round-trip, the complete set is only fetched by fstat
+        struct stat cached_st;
+        bool is_cached = priv_file->is_readonly &&
+            priv->metadata_cache.lookup_stat(internal_path, &cached_st) == 0 && S_ISREG(cached_st.st_mode);
+
+        auto *session = priv->sessions.acquire([priv]() -> std::unique_ptr<SmbSession> {
+            auto session = std::make_unique<SmbSession>();
+            if (priv->connect_session(*session)) {
+                priv->disconnect_session(*session);
+                return nullptr;
+            }
+            return session;
+        }, [priv](SmbSession &session) {
+            priv->disconnect_session(session);
+        });
+
+        if (!session) {
+            std::destroy_at(priv_file);
+            __errno_r(r) = ENOTCONN;
+            return -1;
+        }
+
+        priv_file->session = session;
+
+        auto lk = std::scoped_lock(session->mutex);
+
+        if (!session->connected()) {
+            priv->sessions.release(*session);
+            std::destroy_at(priv_file);
+            __errno_r(r) = ENOTCONN;
+            return -1;
+        }
+
+        priv_file->handle = ::smb2_open(session->ctx, internal_path.c_str() + 1, flags);
+        if (!priv_file->handle) {
+            priv->sessions.release(*session);
+            std::destroy_at(priv_file);
+            __errno_r(r) = ENOENT;
+            return -1;
+        }
+
+        if (is_cached) {
+            priv_file->stat = {};
+            priv_file->stat.smb2_type       = SMB2_TYPE_FILE;
+            priv_file->stat.smb2_size       = cached_st.st_size;
+            priv_file->stat.smb2_mtime      = cached_st.st_mtim.tv_sec;
+            priv_file->stat.smb2_mtime_nsec = cached_st.st_mtim.tv_nsec;
+            priv_file->has_stat             = false;
+        } else {
+            if (auto rc = ::smb2_fstat(session->ctx, priv_file->handle, &priv_file->stat); rc < 0) {
+                ::smb2_close(session->ctx, priv_file->handle);
+                priv->sessions.release(*session);
+                std::destroy_at(priv_file);
+                __errno_r(r) = -rc;
+                return -1;
+            }
+            priv_file->has_stat = true;
+        }
     }
 
+    auto &session = *priv_file->session;
+    priv_file->stream.open(priv->context.block_cache, priv->stats, priv->mount_name, internal_path,
+        priv_file->stat.smb2_size, priv_file->stat.smb2_mtime,
+        [priv, &session, handle = priv_file->handle](std::uint64_t offset, void *buf, std::size_t len) -> ssize_t {
+            auto lk = std::scoped_lock(session.mutex);
+            return priv->pread_pipelined(session, handle, offset, static_cast<std::uint8_t *>(buf), len);
+        });
+
     return 0;
 }
 
 int SmbFs::smb_close(struct _reent *r, void *fd) {
     auto *priv      = static_cast<SmbFs     *>(r->deviceData);
     auto *priv_file = static_cast<SmbFsFile *>(fd);
+    auto &session   = *priv_file->session;
+
+    priv_file->stream.close();
+
+    if (priv_file->is_readonly && priv->is_connected) {
+        priv->linger_handle(*priv_file);
+        std::destroy_at(priv_file);
+        return 0;
+    }
+
+    SW_SCOPEGUARD([&] {
+        priv->sessions.release(session);
+        std::destroy_at(priv_file);
+    });
 
-    auto lk = std::scoped_lock(priv->session_mutex);
+    auto lk = std::scoped_lock(session.mutex);
 
-    if (auto rc = ::smb2_close(priv->smb_ctx, priv_file->handle); rc < 0) {
+    // The handle went away with the session
+    if (!session.connected())
+        return 0;
+
+    if (auto rc = ::smb2_close(session.ctx, priv_file->handle); rc < 0) {
         __errno_r(r) = -rc;
         return -1;
     }
@@ -191,13 +551,9 @@ int SmbFs::smb_close(struct _reent *r, void *fd) {
 }
 
 ssize_t SmbFs::smb_read(struct _reent *r, void *fd, char *ptr, size_t len) {
-    auto *priv      = static_cast<SmbFs     *>(r->deviceData);
     auto *priv_file = static_cast<SmbFsFile *>(fd);
 
-    auto lk = std::scoped_lock(priv->session_mutex);
-
-    if (auto rc = ::smb2_read(priv->smb_ctx, priv_file->handle,
-            reinterpret_cast<std::uint8_t *>(ptr), len); rc < 0) {
+    if (auto rc = priv_file->stream.read(ptr, len); rc < 0) {
         __errno_r(r) = -rc;
         return -1;
     } else {
@@ -206,23 +562,29 @@ ssize_t SmbFs::smb_read(struct _reent *r, void *fd, char *ptr, size_t len) {
 }
 
 off_t SmbFs::smb_seek(struct _reent *r, void *fd, off_t pos, int dir) {
-    auto *priv      = static_cast<SmbFs     *>(r->deviceData);
     auto *priv_file = static_cast<SmbFsFile *>(fd);
 
-    auto lk = std::scoped_lock(priv->session_mutex);
-
-    std::uint64_t absolute;
-    if (auto rc = ::smb2_lseek(priv->smb_ctx, priv_file->handle, pos, dir, &absolute); rc < 0) {
+    if (auto rc = priv_file->stream.seek(pos, dir); rc < 0) {
         __errno_r(r) = -rc;
         return -1;
     } else {
-        return absolute;
+        return rc;
     }
 }
 
 int SmbFs::smb_fstat(struct _reent *r, void *fd, struct stat *st) {
     auto *priv_file = static_cast<SmbFsFile *>(fd);
 
+    if (!priv_file->has_stat) {
+        auto &session = *priv_file->session;
+        auto lk = std::scoped_lock(session.mutex);
+
+        // Keep the partial attributes on failure
+        struct smb2_stat_64 buf;
+        if (session.connected() && ::smb2_fstat(session.ctx, priv_file->handle, &buf) == 0)
+            priv_file->stat = buf, priv_file->has_stat = true;
+    }
+
     smb2_translate_stat(priv_file->stat, st);
     return 0;
 }
@@ -236,15 +598,31 @@ int SmbFs::smb_stat(struct _reent *r, const char *file, struct stat *st) {
         return -1;
     }
 
-    auto lk = std::scoped_lock(priv->session_mutex);
+    if (auto rc = priv->metadata_cache.lookup_stat(internal_path, st); rc) {
+        if (*rc) {
+            __errno_r(r) = *rc;
+            return -1;
+        }
+        return 0;
+    }
+
+    auto lk = std::unique_lock<IoScheduler::Gate>();
+    auto *session = priv->sessions.lock_primary(lk);
+    if (!session) {
+        __errno_r(r) = ENOTCONN;
+        return -1;
+    }
 
     struct smb2_stat_64 buf;
-    if (auto rc = ::smb2_stat(priv->smb_ctx, internal_path.c_str() + 1, &buf); rc < 0) {
+    if (auto rc = ::smb2_stat(session->ctx, internal_path.c_str() + 1, &buf); rc < 0) {
+        if (rc == -ENOENT)
+            priv->metadata_cache.insert_negative(internal_path);
         __errno_r(r) = -rc;
         return -1;
     }
 
     smb2_translate_stat(buf, st);
+    priv->metadata_cache.insert_stat(internal_path, *st);
     return 0;
 }
 
@@ -257,17 +635,22 @@ int SmbFs::smb_lstat(struct _reent *r, const char *file, struct stat *st) {
         return -1;
     }
 
-    auto lk = std::scoped_lock(priv->session_mutex);
+    auto lk = std::unique_lock<IoScheduler::Gate>();
+    auto *session = priv->sessions.lock_primary(lk);
+    if (!session) {
+        __errno_r(r) = ENOTCONN;
+        return -1;
+    }
 
     std::array<char, PATH_MAX> target;
-    if (auto rc = ::smb2_readlink(priv->smb_ctx, internal_path.c_str() + 1,
+    if (auto rc = ::smb2_readlink(session->ctx, internal_path.c_str() + 1,
             target.data(), target.size()); rc < 0) {
         __errno_r(r) = -rc;
         return -1;
     }
 
     struct smb2_stat_64 buf;
-    if (auto rc = ::smb2_stat(priv->smb_ctx, target.data(), &buf); rc < 0) {
+    if (auto rc = ::smb2_stat(session->ctx, target.data(), &buf); rc < 0) {
         __errno_r(r) = -rc;
         return -1;
     }
@@ -282,18 +665,31 @@ int SmbFs::smb_chdir(struct _reent *r, const char *name) {
 
 DIR_ITER *SmbFs::smb_diropen(struct _reent *r, DIR_ITER *dirState, const char *path) {
     auto *priv     = static_cast<SmbFs    *>(r->deviceData);
-    auto *priv_dir = static_cast<SmbFsDir *>(dirState->dirStruct);
+    auto *priv_dir = std::construct_at(static_cast<SmbFsDir *>(dirState->dirStruct));
 
     auto internal_path = priv->translate_path(path);
     if (internal_path.empty()) {
+        std::destroy_at(priv_dir);
         __errno_r(r) = EINVAL;
         return nullptr;
     }
 
-    auto lk = std::scoped_lock(priv->session_mutex);
+    if (priv->metadata_cache.open_dir(priv_dir->cache, internal_path)) {
+        priv_dir->handle = nullptr;
+        return dirState;
+    }
+
+    auto lk = std::unique_lock<IoScheduler::Gate>();
+    auto *session = priv->sessions.lock_primary(lk);
+    if (!session) {
+        std::destroy_at(priv_dir);
+        __errno_r(r) = ENOTCONN;
+        return nullptr;
+    }
 
-    priv_dir->handle = ::smb2_opendir(priv->smb_ctx, internal_path.c_str() + 1);
+    priv_dir->handle = ::smb2_opendir(session->ctx, internal_path.c_str() + 1);
     if (!priv_dir->handle) {
+        std::destroy_at(priv_dir);
         __errno_r(r) = ENOENT;
         return nullptr;
     }
@@ -305,7 +701,18 @@ int SmbFs::smb_dirreset(struct _reent *r, DIR_ITER *dirState) {
     auto *priv     = static_cast<SmbFs    *>(r->deviceData);
     auto *priv_dir = static_cast<SmbFsDir *>(dirState->dirStruct);
 
-    ::smb2_rewinddir(priv->smb_ctx, priv_dir->handle);
+    if (priv_dir->handle) {
+        auto lk = std::unique_lock<IoScheduler::Gate>();
+        auto *session = priv->sessions.lock_primary(lk);
+        if (!session) {
+            __errno_r(r) = ENOTCONN;
+            return -1;
+        }
+
+        ::smb2_rewinddir(session->ctx, priv_dir->handle);
+    }
+
+    priv->metadata_cache.rewind_dir(priv_dir->cache);
     return 0;
 }
 
@@ -313,10 +720,27 @@ int SmbFs::smb_dirnext(struct _reent *r, DIR_ITER *dirState, char *filename, str
     auto *priv     = static_cast<SmbFs    *>(r->deviceData);
     auto *priv_dir = static_cast<SmbFsDir *>(dirState->dirStruct);
 
+    if (!priv_dir->handle) {
+        if (!priv->metadata_cache.next_cached(priv_dir->cache, filename, filestat)) {
+            __errno_r(r) = ENOENT;
+            return -1;
+        }
+        return 0;
+    }
+
+    // Directory handles are released along with the session
+    auto lk = std::unique_lock<IoScheduler::Gate>();
+    auto *session = priv->sessions.lock_primary(lk);
+    if (!session) {
+        __errno_r(r) = ENOTCONN;
+        return -1;
+    }
+
     struct smb2dirent *node;
     while (true) {
-        node = ::smb2_readdir(priv->smb_ctx, priv_dir->handle);
+        node = ::smb2_readdir(session->ctx, priv_dir->handle);
         if (!node) {
+            priv->metadata_cache.finish_dir(priv_dir->cache);
             __errno_r(r) = ENOENT;
             return -1;
         }
@@ -329,6 +753,7 @@ int SmbFs::smb_dirnext(struct _reent *r, DIR_ITER *dirState, char *filename, str
     std::strncpy(filename, node->name, NAME_MAX);
 
     smb2_translate_stat(node->st, filestat);
+    priv->metadata_cache.record(priv_dir->cache, node->name, *filestat);
     return 0;
 }
 
@@ -336,7 +761,13 @@ int SmbFs::smb_dirclose(struct _reent *r, DIR_ITER *dirState) {
     auto *priv     = static_cast<SmbFs    *>(r->deviceData);
     auto *priv_dir = static_cast<SmbFsDir *>(dirState->dirStruct);
 
-    ::smb2_closedir(priv->smb_ctx, priv_dir->handle);
+    if (priv_dir->handle) {
+        auto lk = std::unique_lock<IoScheduler::Gate>();
+        if (auto *session = priv->sessions.lock_primary(lk); session)
+            ::smb2_closedir(session->ctx, priv_dir->handle);
+    }
+
+    std::destroy_at(priv_dir);
     return 0;
 }
 
@@ -349,10 +780,15 @@ int SmbFs::smb_statvfs(struct _reent *r, const char *path, struct statvfs *buf)
         return -1;
     }
 
-    auto lk = std::scoped_lock(priv->session_mutex);
+    auto lk = std::unique_lock<IoScheduler::Gate>();
+    auto *session = priv->sessions.lock_primary(lk);
+    if (!session) {
+        __errno_r(r) = ENOTCONN;
+        return -1;
+    }
 
     struct smb2_statvfs st;
-    if (auto rc = ::smb2_statvfs(priv->smb_ctx, internal_path.c_str() + 1, &st); rc < 0) {
+    if (auto rc = ::smb2_statvfs(session->ctx, internal_path.c_str() + 1, &st); rc < 0) {
         __errno_r(r) = -rc;
         return -1;
     }
@@ -17,15 +17,21 @@
 
 #pragma once
 
+#include <chrono>
+#include <condition_variable>
 #include <mutex>
 #include <string>
 #include <string_view>
+#include <thread>
+#include <vector>
 
 #include <smb2/smb2.h>
 #include <smb2/libsmb2.h>
 
 #include "context.hpp"
 #include "fs/fs_common.hpp"
+#include "fs/fs_cache.hpp"
+#include "fs/fs_scheduler.hpp"
 
 namespace sw::fs {
 
@@ -40,8 +46,55 @@ class SmbFs final: public NetworkFilesystem {
         virtual int disconnect() override;
 
     private:
+        constexpr static std::size_t MaxInflightReads    = 8;
+        constexpr static std::size_t MinReadSize         = 0x10000; // 64KiB, one credit
+        constexpr static std::size_t MaxLingeringHandles = 4;
+        constexpr static auto        HandleLinger        = std::chrono::seconds(5);
+
+        struct SmbSession {
+            smb2_context *ctx = nullptr;
+            std::uint32_t max_read_size = MinReadSize;
+            std::size_t num_files = 0;
+            IoScheduler::Gate mutex;
+
+            // Must be called with the mutex held
+            bool connected() const {
+                return this->ctx;
+            }
+        };
+
+        struct SmbFsFile;
+
+        // Handle of a closed read-only file, kept open for a short while since mpv commonly reopens files
+        // Its session stays acquired
+        struct LingeringHandle {
+            std::string path;
+            SmbSession *session;
+            struct smb2fh *handle;
+            struct smb2_stat_64 stat;
+            bool has_stat;
+            std::chrono::steady_clock::time_point expiry;
+        };
+
         std::string translate_path(const char *path);
 
+        bool take_lingering_handle(SmbFsFile &file);
+        void linger_handle(SmbFsFile &file);
+        void close_lingering_handle(LingeringHandle &handle);
+
+        // Closes handles past their expiry, or all of them, or those of a given path
+        void expire_lingering_handles(bool all = false, std::string_view path = {});
+
+        // Closes lingering handles as they expire, even if the filesystem is not used again
+        void linger_thread_fn(std::stop_token token);
+
+        int  connect_session(SmbSession &session);
+        void disconnect_session(SmbSession &session);
+
+        // Positional read split in several concurrent requests, must be called with the session mutex held
+        ssize_t pread_pipelined(SmbSession &session, struct smb2fh *handle,
+            std::uint64_t offset, std::uint8_t *buf, std::size_t len);
+
         static int       smb_open    (struct _reent *r, void *fileStruct, const char *path, int flags, int mode);
         static int       smb_close   (struct _reent *r, void *fd);
         static ssize_t   smb_read    (struct _reent *r, void *fd, char *ptr, size_t len);
@@ -58,22 +111,32 @@ class SmbFs final: public NetworkFilesystem {
 
     private:
         struct SmbFsFile {
+            SmbSession *session;
             struct smb2fh *handle;
             struct smb2_stat_64 stat;
+            bool has_stat; // Whether stat is complete, or only has the type, size and mtime
+            std::string path;
+            bool is_readonly;
+            BlockCache::Stream stream;
         };
 
         struct SmbFsDir {
             struct smb2dir *handle;
+            MetadataCache::DirState cache;
         };
 
     private:
         Context &context;
 
-        smb2_context *smb_ctx = nullptr;
-
+        std::string host, share, username, password;
         std::string cwd = "";
 
-        std::mutex session_mutex;
+        SessionPool<SmbSession> sessions;
+
+        std::mutex lingering_mutex;
+        std::condition_variable_any lingering_condvar;
+        std::vector<LingeringHandle> lingering_handles;
+        std::jthread lingering_thread;
 };
 
 } // namespace sw::fs
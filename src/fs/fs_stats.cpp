@@ -0,0 +1,85 @@
+// Copyright (c) 2024 averne <averne381@gmail.com>
+//
+// This file is part of SwitchWave.
+//
+// SwitchWave is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// SwitchWave is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with SwitchWave.  If not, see <http://www.gnu.org/licenses/>.
+
+#include <algorithm>
+#include <cmath>
+
+#include "fs/fs_stats.hpp"
+
+namespace sw::fs {
+
+std::uint64_t IoStats::Histogram::count() const {
+    std::uint64_t count = 0;
+    for (auto &bucket: this->buckets)
+        count += bucket.load(std::memory_order_relaxed);
+    return count;
+}
+
+std::uint64_t IoStats::Histogram::mean() const {
+    auto count = this->count();
+    return count ? this->total_us.load(std::memory_order_relaxed) / count : 0;
+}
+
+std::uint64_t IoStats::Histogram::percentile(double q) const {
+    auto count = this->count();
+    if (!count)
+        return 0;
+
+    auto target = std::max<std::uint64_t>(std::ceil(std::clamp(q, 0.0, 1.0) * count), 1);
+
+    std::uint64_t seen = 0;
+    for (std::size_t i = 0; i < this->buckets.size(); ++i) {
+        seen += this->buckets[i].load(std::memory_order_relaxed);
+        if (seen >= target)
+            return std::min(Histogram::bucket_upper_bound(i), this->max());
+    }
+
+    return this->max();
+}
+
+int IoStats::dump(std::FILE *fp, std::string_view name) const {
+    int rc;
+
+#define TRY_WRITE(...) ({                                   \
+    if (rc = std::fprintf(fp, __VA_ARGS__); rc < 0)         \
+        return rc;                                          \
+})
+
+    TRY_WRITE("[%.*s]\n", int(name.length()), name.data());
+    TRY_WRITE("bytes-read = %lu\n",      IoStats::get(this->bytes_read));
+    TRY_WRITE("bytes-fetched = %lu\n",   IoStats::get(this->bytes_fetched));
+    TRY_WRITE("seeks = %lu\n",           IoStats::get(this->seeks));
+    TRY_WRITE("cache-hits = %lu\n",      IoStats::get(this->cache_hits));
+    TRY_WRITE("cache-misses = %lu\n",    IoStats::get(this->cache_misses));
+    TRY_WRITE("disk-cache-hits = %lu\n", IoStats::get(this->disk_cache_hits));
+    TRY_WRITE("errors = %lu\n",          IoStats::get(this->errors));
+
+    for (std::size_t i = 0; i < static_cast<std::size_t>(Op::Max); ++i) {
+        auto op     = static_cast<Op>(i);
+        auto &hist  = this->latency(op);
+        auto opname = IoStats::op_name(op);
+        TRY_WRITE("%.*s = %lu ops, mean %luus, p50 %luus, p90 %luus, p99 %luus, max %luus\n",
+            int(opname.length()), opname.data(), hist.count(), hist.mean(),
+            hist.percentile(0.5), hist.percentile(0.9), hist.percentile(0.99), hist.max());
+    }
+
+#undef TRY_WRITE
+
+    return 0;
+}
+
+} // namespace sw::fs
@@ -0,0 +1,173 @@
+// Copyright (c) 2024 averne <averne381@gmail.com>
+//
+// This file is part of SwitchWave.
+//
+// SwitchWave is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// SwitchWave is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with SwitchWave.  If not, see <http://www.gnu.org/licenses/>.
+
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <bit>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <string_view>
+
+namespace sw::fs {
+
+// Lock-free I/O counters of a filesystem, cheap enough to be always enabled
+// All updates are relaxed atomic increments, readers get an approximately consistent view
+class IoStats {
+    public:
+        using Clock = std::chrono::steady_clock;
+
+        enum class Op {
+            Open,
+            Read,
+            Stat,
+            Readdir,
+            Max,
+        };
+
+        // Latency histogram in microseconds, with logarithmic buckets each split in 4 linear sub-buckets
+        // (as in HDR histograms), so that percentiles are accurate to 25%
+        class Histogram {
+            public:
+                constexpr static std::size_t SubBucketBits = 2, SubBuckets = 1 << SubBucketBits;
+                constexpr static std::size_t NumBuckets = 32 * SubBuckets; // Up to ~2h
+
+                void record(std::uint64_t us) {
+                    this->buckets[Histogram::bucket_index(us)].fetch_add(1, std::memory_order_relaxed);
+                    this->total_us.fetch_add(us, std::memory_order_relaxed);
+
+                    auto max = this->max_us.load(std::memory_order_relaxed);
+                    while (us > max && !this->max_us.compare_exchange_weak(max, us, std::memory_order_relaxed));
+                }
+
+                std::uint64_t count() const;
+                std::uint64_t mean() const;
+
+                std::uint64_t max() const {
+                    return this->max_us.load(std::memory_order_relaxed);
+                }
+
+                // Upper bound of the bucket containing the given quantile, in [0, 1]
+                std::uint64_t percentile(double q) const;
+
+            private:
+                static constexpr std::size_t bucket_index(std::uint64_t v) {
+                    if (v < SubBuckets)
+                        return v;
+
+                    std::size_t exp = std::bit_width(v) - 1, sub = (v >> (exp - SubBucketBits)) & (SubBuckets - 1);
+                    return std::min((exp - SubBucketBits + 1) * SubBuckets + sub, NumBuckets - 1);
+                }
+
+                static constexpr std::uint64_t bucket_upper_bound(std::size_t idx) {
+                    if (idx < SubBuckets)
+                        return idx;
+
+                    std::size_t exp = idx / SubBuckets + SubBucketBits - 1, sub = idx % SubBuckets;
+                    return ((SubBuckets + sub + 1) << (exp - SubBucketBits)) - 1;
+                }
+
+            private:
+                std::array<std::atomic_uint64_t, NumBuckets> buckets = {};
+                std::atomic_uint64_t total_us = 0, max_us = 0;
+        };
+
+        // Times an operation from construction to destruction
+        class Timer {
+            public:
+                Timer(IoStats &stats, Op op): stats(stats), op(op), start(Clock::now()) { }
+
+                ~Timer() {
+                    this->stats.record(this->op, Clock::now() - this->start, this->failed);
+                }
+
+                Timer(const Timer &) = delete;
+                Timer &operator =(const Timer &) = delete;
+
+                void fail() {
+                    this->failed = true;
+                }
+
+            private:
+                IoStats &stats;
+                Op op;
+                Clock::time_point start;
+                bool failed = false;
+        };
+
+    public:
+        static constexpr std::string_view op_name(Op op) {
+            switch (op) {
+                case Op::Open:
+                default:
+                    return "open";
+                case Op::Read:
+                    return "read";
+                case Op::Stat:
+                    return "stat";
+                case Op::Readdir:
+                    return "readdir";
+            }
+        }
+
+        void record(Op op, Clock::duration duration, bool failed = false) {
+            auto us = std::chrono::duration_cast<std::chrono::microseconds>(duration).count();
+            this->latency(op).record(std::max<std::int64_t>(us, 0));
+
+            if (failed)
+                IoStats::add(this->errors);
+        }
+
+        static void add(std::atomic_uint64_t &counter, std::uint64_t value = 1) {
+            counter.fetch_add(value, std::memory_order_relaxed);
+        }
+
+        static std::uint64_t get(const std::atomic_uint64_t &counter) {
+            return counter.load(std::memory_order_relaxed);
+        }
+
+        Histogram &latency(Op op) {
+            return this->histograms[static_cast<std::size_t>(op)];
+        }
+
+        const Histogram &latency(Op op) const {
+            return this->histograms[static_cast<std::size_t>(op)];
+        }
+
+        std::uint64_t ops(Op op) const {
+            return this->latency(op).count();
+        }
+
+        // Human-readable report, returns a negative value on write failure
+        int dump(std::FILE *fp, std::string_view name) const;
+
+    public:
+        std::atomic_uint64_t bytes_read      = 0, // Returned to the caller
+                             bytes_fetched   = 0, // Transferred from the network
+                             seeks           = 0,
+                             cache_hits      = 0,
+                             cache_misses    = 0,
+                             disk_cache_hits = 0,
+                             errors          = 0;
+
+    private:
+        std::array<Histogram, static_cast<std::size_t>(Op::Max)> histograms = {};
+};
+
+} // namespace sw::fs
@@ -0,0 +1,452 @@
+// Copyright (c) 2024 averne <averne381@gmail.com>
+//
+// This file is part of SwitchWave.
+//
+// SwitchWave is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// SwitchWave is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with SwitchWave.  If not, see <http://www.gnu.org/licenses/>.
+
+#include <cctype>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <algorithm>
+#include <unordered_map>
+#include <unordered_set>
+#include <dirent.h>
+
+#include "utils.hpp"
+#include "media_probe.hpp"
+#include "fs/fs_scheduler.hpp"
+
+#include "library.hpp"
+
+namespace sw {
+
+namespace {
+
+bool contains_nocase(std::string_view haystack, std::string_view needle) {
+    return std::search(haystack.begin(), haystack.end(), needle.begin(), needle.end(), [](char x, char y) {
+        return std::tolower(static_cast<unsigned char>(x)) == std::tolower(static_cast<unsigned char>(y));
+    }) != haystack.end();
+}
+
+} // namespace
+
+std::shared_ptr<const Library::Index> Library::Index::from_buffer(std::unique_ptr<std::uint8_t[]> data, std::size_t size) {
+    if (size < sizeof(Header))
+        return nullptr;
+
+    auto *header = reinterpret_cast<const Header *>(data.get());
+    if (header->magic != IndexMagic || header->version != IndexVersion)
+        return nullptr;
+
+    auto strings_pos = sizeof(Header) + std::size_t(header->num_records) * sizeof(Record);
+    if (strings_pos + header->strings_size != size ||
+            (header->strings_size && data[size - 1] != '\0'))
+        return nullptr;
+
+    auto index = std::make_shared<Index>();
+    index->records_ = { reinterpret_cast<const Record *>(data.get() + sizeof(Header)), header->num_records };
+    index->strings  = reinterpret_cast<const char *>(data.get() + strings_pos);
+
+    auto valid_string = [&header](std::uint32_t offset) {
+        return offset == NoString || offset < header->strings_size;
+    };
+
+    for (auto &record: index->records_) {
+        if (std::uint64_t(record.path_offset) + record.path_length >= header->strings_size ||
+                !valid_string(record.video_codec_offset) || !valid_string(record.audio_codec_offset))
+            return nullptr;
+    }
+
+    index->data = std::move(data);
+    index->size = size;
+    return index;
+}
+
+const Library::Record *Library::Index::find(std::string_view path) const {
+    auto it = std::lower_bound(this->records_.begin(), this->records_.end(), path, [this](const auto &record, auto path) {
+        return this->path(record) < path;
+    });
+
+    if (it == this->records_.end() || this->path(*it) != path)
+        return nullptr;
+    return &*it;
+}
+
+std::span<const Library::Record> Library::Index::range(std::string_view prefix) const {
+    auto first = std::lower_bound(this->records_.begin(), this->records_.end(), prefix, [this](const auto &record, auto prefix) {
+        return this->path(record) < prefix;
+    });
+
+    auto last = std::find_if_not(first, this->records_.end(), [this, &prefix](const auto &record) {
+        return this->path(record).starts_with(prefix);
+    });
+
+    return { first, last };
+}
+
+std::vector<const Library::Record *> Library::Index::search(std::string_view query, std::size_t max_results) const {
+    std::vector<std::string_view> terms;
+    for (std::size_t pos = 0; pos < query.length();) {
+        auto start = query.find_first_not_of(' ', pos);
+        if (start == std::string_view::npos)
+            break;
+
+        auto end = std::min(query.find(' ', start), query.length());
+        terms.push_back(query.substr(start, end - start));
+        pos = end;
+    }
+
+    std::vector<const Record *> results;
+    for (auto &record: this->records_) {
+        if (results.size() >= max_results)
+            break;
+
+        auto path = this->path(record);
+        if (std::all_of(terms.begin(), terms.end(), [&path](auto term) { return contains_nocase(path, term); }))
+            results.push_back(&record);
+    }
+
+    return results;
+}
+
+int Library::load(std::string_view path) {
+    this->path = path;
+
+    // Fall back to the temporary file, in case we were interrupted between the removal and the rename
+    auto *fp = std::fopen(this->path.c_str(), "rb");
+    if (!fp)
+        fp = std::fopen((this->path + ".tmp").c_str(), "rb");
+    if (!fp)
+        return -errno;
+    SW_SCOPEGUARD([&fp] { std::fclose(fp); });
+
+    std::fseek(fp, 0, SEEK_END);
+    std::size_t size = std::ftell(fp);
+    std::rewind(fp);
+
+    auto data = std::make_unique_for_overwrite<std::uint8_t[]>(size);
+    if (std::fread(data.get(), 1, size, fp) != size)
+        return -EIO;
+
+    auto index = Index::from_buffer(std::move(data), size);
+    if (!index) {
+        std::printf("Library index %s is invalid, ignoring\n", this->path.c_str());
+        return -EINVAL;
+    }
+
+    std::printf("Loaded library index with %zu records\n", index->records().size());
+
+    auto lk = std::scoped_lock(this->mutex);
+    this->index = std::move(index);
+    return 0;
+}
+
+int Library::save(const Index &index) {
+    if (this->path.empty())
+        return -EINVAL;
+
+    auto tmp_path = this->path + ".tmp";
+
+    auto *fp = std::fopen(tmp_path.c_str(), "wb");
+    if (!fp)
+        return -errno;
+
+    auto buffer = index.buffer();
+    bool failed = std::fwrite(buffer.data(), 1, buffer.size(), fp) != buffer.size();
+    failed |= std::fclose(fp) != 0;
+    if (failed)
+        return -EIO;
+
+    // rename does not replace existing files on the sd card
+    std::remove(this->path.c_str());
+    if (std::rename(tmp_path.c_str(), this->path.c_str()))
+        return -errno;
+
+    return 0;
+}
+
+Library::Entry Library::entry_from_record(const Index &index, const Record &record) {
+    auto string = [&index](std::uint32_t offset) {
+        auto *str = index.string(offset);
+        return str ? std::string(str) : std::string();
+    };
+
+    return Entry{
+        .path        = std::string(index.path(record)),
+        .size        = record.size,
+        .mtime       = record.mtime,
+        .duration    = record.duration,
+        .width       = record.width,
+        .height      = record.height,
+        .video_codec = string(record.video_codec_offset),
+        .audio_codec = string(record.audio_codec_offset),
+        .flags       = record.flags,
+    };
+}
+
+std::pair<std::unique_ptr<std::uint8_t[]>, std::size_t> Library::serialize(std::vector<Entry> &entries) {
+    std::sort(entries.begin(), entries.end(), [](const auto &a, const auto &b) { return a.path < b.path; });
+    entries.erase(std::unique(entries.begin(), entries.end(), [](const auto &a, const auto &b) {
+        return a.path == b.path;
+    }), entries.end());
+
+    // Codec names are shared by most records
+    std::string strings;
+    std::unordered_map<std::string, std::uint32_t> interned;
+    auto intern = [&](const std::string &str) -> std::uint32_t {
+        if (str.empty())
+            return NoString;
+
+        auto [it, inserted] = interned.try_emplace(str, strings.size());
+        if (inserted)
+            strings.append(str).push_back('\0');
+        return it->second;
+    };
+
+    std::vector<Record> records;
+    records.reserve(entries.size());
+    for (auto &entry: entries) {
+        auto &record = records.emplace_back(Record{
+            .path_offset        = std::uint32_t(strings.size()),
+            .path_length        = std::uint32_t(entry.path.length()),
+            .video_codec_offset = NoString,
+            .audio_codec_offset = NoString,
+            .size               = entry.size,
+            .mtime              = entry.mtime,
+            .duration           = entry.duration,
+            .width              = entry.width,
+            .height             = entry.height,
+            .flags              = entry.flags,
+            .reserved           = 0,
+        });
+
+        strings.append(entry.path).push_back('\0');
+
+        record.video_codec_offset = intern(entry.video_codec);
+        record.audio_codec_offset = intern(entry.audio_codec);
+    }
+
+    auto header = Header{
+        .magic        = IndexMagic,
+        .version      = IndexVersion,
+        .num_records  = std::uint32_t(records.size()),
+        .strings_size = std::uint32_t(strings.size()),
+    };
+
+    auto size = sizeof(Header) + records.size() * sizeof(Record) + strings.size();
+    auto data = std::make_unique_for_overwrite<std::uint8_t[]>(size);
+
+    auto *ptr = data.get();
+    std::memcpy(ptr, &header, sizeof(Header));
+    ptr += sizeof(Header);
+    std::memcpy(ptr, records.data(), records.size() * sizeof(Record));
+    ptr += records.size() * sizeof(Record);
+    std::memcpy(ptr, strings.data(), strings.size());
+
+    return { std::move(data), size };
+}
+
+void Library::update(std::vector<std::shared_ptr<fs::Filesystem>> filesystems, MediaInfoCache &media_cache) {
+    if (this->is_updating())
+        return;
+
+    this->progress_.num_dirs   = 0;
+    this->progress_.num_files  = 0;
+    this->progress_.num_probed = 0;
+    this->update_done          = false;
+
+    this->update_thread = std::jthread(&Library::update_thread_fn, this, std::move(filesystems), std::ref(media_cache));
+}
+
+void Library::update_thread_fn(std::stop_token token, std::vector<std::shared_ptr<fs::Filesystem>> filesystems,
+        MediaInfoCache &media_cache) {
+    SW_SCOPEGUARD([this] { this->update_done = true; });
+
+    auto old_index = this->snapshot();
+
+    std::erase_if(filesystems, [](const auto &fs) { return fs->type == fs::Filesystem::Type::Recent; });
+
+    auto crawls = std::vector<std::unique_ptr<Crawl>>(filesystems.size());
+    std::vector<std::jthread> threads;
+
+    for (std::size_t i = 0; i < filesystems.size(); ++i) {
+        crawls[i] = std::make_unique<Crawl>();
+        crawls[i]->old_index   = old_index.get();
+        crawls[i]->media_cache = &media_cache;
+        crawls[i]->directories.emplace_back(std::string(filesystems[i]->mount_name) + "/");
+
+        // The crawlers share the stop token of the update
+        for (std::size_t j = 0; j < ThreadsPerShare; ++j)
+            threads.emplace_back([this, token, &crawl = *crawls[i]] { this->crawl_thread_fn(token, crawl); });
+    }
+
+    for (auto &thread: threads)
+        thread.join();
+
+    if (token.stop_requested())
+        return;
+
+    std::vector<Entry> entries;
+    for (auto &crawl: crawls)
+        std::move(crawl->entries.begin(), crawl->entries.end(), std::back_inserter(entries));
+
+    // Keep the records of filesystems that weren't mounted during this update
+    if (old_index) {
+        auto crawled = std::unordered_set<std::string_view>();
+        for (auto &fs: filesystems)
+            crawled.insert(fs->mount_name);
+
+        for (auto &record: old_index->records()) {
+            if (!crawled.contains(fs::Path::mountpoint(old_index->path(record))))
+                entries.push_back(Library::entry_from_record(*old_index, record));
+        }
+    }
+
+    auto [data, size] = Library::serialize(entries);
+    auto index = Index::from_buffer(std::move(data), size);
+    if (!index)
+        return;
+
+    std::printf("Library update done: %zu records, %u probed\n", index->records().size(),
+        this->progress_.num_probed.load());
+
+    if (auto rc = this->save(*index); rc)
+        std::printf("Failed to save library index: %d\n", rc);
+
+    auto lk = std::scoped_lock(this->mutex);
+    this->index = std::move(index);
+}
+
+void Library::crawl_thread_fn(std::stop_token token, Crawl &crawl) {
+    // Crawling must not delay playback or browsing on the same share
+    auto priority = fs::IoScheduler::ScopedPriority(fs::IoScheduler::Priority::Background);
+
+    while (true) {
+        std::string directory;
+        {
+            auto lk = std::unique_lock(crawl.mutex);
+            if (!crawl.condvar.wait(lk, token, [&crawl] { return !crawl.directories.empty() || !crawl.num_busy; }))
+                return;
+
+            // Queue drained and no other thread may add to it
+            if (crawl.directories.empty())
+                return;
+
+            directory = std::move(crawl.directories.front());
+            crawl.directories.pop_front();
+            ++crawl.num_busy;
+        }
+
+        this->crawl_directory(token, crawl, directory);
+
+        {
+            auto lk = std::scoped_lock(crawl.mutex);
+            --crawl.num_busy;
+        }
+        crawl.condvar.notify_all();
+    }
+}
+
+void Library::crawl_directory(std::stop_token token, Crawl &crawl, fs::Path path) {
+    std::vector<Entry> entries;
+    std::vector<std::string> subdirs;
+
+    SW_SCOPEGUARD([&] {
+        auto lk = std::scoped_lock(crawl.mutex);
+        std::move(entries.begin(), entries.end(), std::back_inserter(crawl.entries));
+        std::move(subdirs.begin(), subdirs.end(), std::back_inserter(crawl.directories));
+    });
+
+    auto *dir = opendir(path.c_str());
+    if (!dir) {
+        auto error = errno;
+        std::printf("Failed to open directory %s: %s (%d)\n", path.c_str(), std::strerror(error), error);
+
+        // Keep what was previously known about this part of the tree
+        if (crawl.old_index) {
+            for (auto &record: crawl.old_index->range((path / "").base()))
+                entries.push_back(Library::entry_from_record(*crawl.old_index, record));
+        }
+        return;
+    }
+    SW_SCOPEGUARD([dir] { closedir(dir); });
+
+    this->progress_.num_dirs += 1;
+
+    // Read attributes along with the listing, like the explorer
+    auto *reent    = __syscall_getreent();
+    auto *devoptab = devoptab_list[dir->dirData->device];
+
+    char fname[NAME_MAX + 1];
+    struct stat st;
+    while (!token.stop_requested()) {
+        std::memset(fname, 0, sizeof(fname));
+
+        reent->deviceData = devoptab->deviceData;
+        if (devoptab->dirnext_r(reent, dir->dirData, fname, &st))
+            break;
+
+        // Skip hidden files and directories, and self/parent links
+        if (fname[0] == '.')
+            continue;
+
+        auto entry_path = path / fname;
+        if (entry_path.length() >= PATH_MAX)
+            continue;
+
+        if (S_ISDIR(st.st_mode)) {
+            subdirs.emplace_back(entry_path.base());
+            continue;
+        }
+
+        if (!is_media_file(fname))
+            continue;
+
+        this->progress_.num_files += 1;
+
+        std::int64_t mtime = st.st_mtime;
+        if (auto *record = crawl.old_index ? crawl.old_index->find(entry_path.base()) : nullptr;
+                record && record->size == std::uint64_t(st.st_size) && record->mtime == mtime &&
+                (record->flags & (Record::Probed | Record::ProbeFailed))) {
+            entries.push_back(Library::entry_from_record(*crawl.old_index, *record));
+            continue;
+        }
+
+        auto &entry = entries.emplace_back(Entry{
+            .path  = entry_path.base(),
+            .size  = std::uint64_t(st.st_size),
+            .mtime = mtime,
+        });
+
+        MediaInfo info;
+        if (auto rc = crawl.media_cache->probe(entry.path, entry.size, entry.mtime, info, token); rc) {
+            // Transient failures leave the entry unflagged, so it gets probed again on the next crawl
+            if (is_permanent_probe_error(rc))
+                entry.flags |= Record::ProbeFailed;
+            continue;
+        }
+
+        this->progress_.num_probed += 1;
+
+        entry.duration    = std::uint32_t(info.duration);
+        entry.width       = std::uint16_t(info.video_width);
+        entry.height      = std::uint16_t(info.video_height);
+        entry.video_codec = info.video_codec_name ? info.video_codec_name : "";
+        entry.audio_codec = info.audio_codec_name ? info.audio_codec_name : "";
+        entry.flags      |= Record::Probed;
+    }
+}
+
+} // namespace sw
@@ -0,0 +1,184 @@
+// Copyright (c) 2024 averne <averne381@gmail.com>
+//
+// This file is part of SwitchWave.
+//
+// SwitchWave is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// SwitchWave is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with SwitchWave.  If not, see <http://www.gnu.org/licenses/>.
+
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <span>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
+
+#include "media_cache.hpp"
+#include "fs/fs_common.hpp"
+
+namespace sw {
+
+// Index of the media files found on every mounted filesystem, kept on local storage
+// The file image is also the in-memory layout: a header, fixed-size records sorted by path, and a pool of
+// NUL-terminated strings referenced by offset, so loading is a single read and queries never touch the network.
+// Updates crawl the filesystems in the background, and only probe files whose size or mtime changed.
+class Library {
+    public:
+        constexpr static std::uint32_t IndexMagic   = 0x42494c57; // "WLIB"
+        constexpr static std::uint32_t IndexVersion = 1;
+        constexpr static std::uint32_t NoString     = UINT32_MAX;
+
+        // Crawler threads per filesystem, network sessions serialize requests anyway
+        constexpr static std::size_t ThreadsPerShare = 2;
+
+        struct Header {
+            std::uint32_t magic, version;
+            std::uint32_t num_records, strings_size;
+        };
+
+        struct Record {
+            enum Flags: std::uint32_t {
+                Probed      = 1 << 0,
+                ProbeFailed = 1 << 1, // Unreadable contents, not worth retrying until the file changes
+            };
+
+            std::uint32_t path_offset, path_length;
+            std::uint32_t video_codec_offset, audio_codec_offset; // NoString if absent
+            std::uint64_t size;
+            std::int64_t  mtime;
+            std::uint32_t duration;                               // Seconds
+            std::uint16_t width, height;
+            std::uint32_t flags, reserved;
+        };
+
+        static_assert(sizeof(Header) == 0x10 && sizeof(Record) == 0x30);
+
+        class Index {
+            public:
+                // Validates and takes ownership of a serialized index
+                static std::shared_ptr<const Index> from_buffer(std::unique_ptr<std::uint8_t[]> data, std::size_t size);
+
+                std::span<const std::uint8_t> buffer() const {
+                    return { this->data.get(), this->size };
+                }
+
+                std::span<const Record> records() const {
+                    return this->records_;
+                }
+
+                std::string_view path(const Record &record) const {
+                    return { this->strings + record.path_offset, record.path_length };
+                }
+
+                const char *string(std::uint32_t offset) const {
+                    return (offset != NoString) ? this->strings + offset : nullptr;
+                }
+
+                const Record *find(std::string_view path) const;
+
+                // Records whose path starts with prefix
+                std::span<const Record> range(std::string_view prefix) const;
+
+                // Case-insensitive match of every whitespace-separated term of the query against the path
+                std::vector<const Record *> search(std::string_view query, std::size_t max_results) const;
+
+            private:
+                std::unique_ptr<std::uint8_t[]> data;
+                std::size_t size = 0;
+
+                std::span<const Record> records_;
+                const char *strings = nullptr;
+        };
+
+        struct Progress {
+            std::atomic_uint32_t num_dirs, num_files, num_probed;
+        };
+
+    public:
+        int load(std::string_view path);
+
+        std::shared_ptr<const Index> snapshot() {
+            auto lk = std::scoped_lock(this->mutex);
+            return this->index;
+        }
+
+        // Crawls the given filesystems, and replaces the index once all of them are done
+        // Records of filesystems that are absent or unreachable are kept
+        void update(std::vector<std::shared_ptr<fs::Filesystem>> filesystems, MediaInfoCache &media_cache);
+
+        // Doesn't wait for the current network call, the update is abandoned before the next one
+        void cancel_update() {
+            this->update_thread.request_stop();
+        }
+
+        bool is_updating() const {
+            return this->update_thread.joinable() && !this->update_done;
+        }
+
+        const Progress &progress() const {
+            return this->progress_;
+        }
+
+    private:
+        // Record under construction
+        struct Entry {
+            std::string path;
+            std::uint64_t size;
+            std::int64_t  mtime;
+            std::uint32_t duration = 0;
+            std::uint16_t width = 0, height = 0;
+            std::string video_codec, audio_codec;
+            std::uint32_t flags = 0;
+        };
+
+        struct Crawl {
+            const Index *old_index;
+            MediaInfoCache *media_cache;
+
+            std::mutex mutex;
+            std::condition_variable_any condvar;
+            std::deque<std::string> directories;
+            int num_busy = 0;
+
+            std::vector<Entry> entries;
+        };
+
+    private:
+        static Entry entry_from_record(const Index &index, const Record &record);
+        static std::pair<std::unique_ptr<std::uint8_t[]>, std::size_t> serialize(std::vector<Entry> &entries);
+
+        int save(const Index &index);
+
+        void update_thread_fn(std::stop_token token, std::vector<std::shared_ptr<fs::Filesystem>> filesystems,
+            MediaInfoCache &media_cache);
+        void crawl_thread_fn(std::stop_token token, Crawl &crawl);
+        void crawl_directory(std::stop_token token, Crawl &crawl, fs::Path path);
+
+    private:
+        std::string path;
+
+        std::mutex mutex;
+        std::shared_ptr<const Index> index;
+
+        Progress progress_ = {};
+        std::atomic_bool update_done = false;
+        std::jthread update_thread;
+};
+
+} // namespace sw
@@ -20,6 +20,7 @@
 #include <filesystem>
 #include <string_view>
 #include <thread>
+#include <vector>
 
 #include <switch.h>
 
@@ -36,7 +37,6 @@
 #include "fs/fs_common.hpp"
 #include "fs/fs_ums.hpp"
 #include "fs/fs_recent.hpp"
-#include "fs/fs_http.hpp"
 
 using namespace std::chrono_literals;
 
@@ -140,20 +140,20 @@ void mpv_presetup() {
 void ums_devices_changed_cb(const std::vector<sw::fs::UmsController::Device> &devices, void *user) {
     auto &context = *static_cast<sw::Context *>(user);
 
+    auto lk = std::scoped_lock(context.filesystems_mutex);
+
     // Remove unmounted devices
-    for (auto &fs: context.filesystems) {
+    auto num_removed = std::erase_if(context.filesystems, [&devices](const auto &fs) {
         if (fs->type != sw::fs::Filesystem::Type::Usb)
-            continue;
+            return false;
 
-        auto it = std::find_if(devices.begin(), devices.end(), [&fs](const auto &dev) {
+        return std::find_if(devices.begin(), devices.end(), [&fs](const auto &dev) {
             return fs->mount_name == dev.mount_name;
-        });
+        }) == devices.end();
+    });
 
-        if (it == devices.end()) {
-            std::erase(context.filesystems, fs);
-            context.cur_fs = context.filesystems.front();
-        }
-    }
+    if (num_removed)
+        context.cur_fs = context.filesystems.front();
 
     // Add new devices
     for (auto &dev: devices) {
@@ -241,25 +241,7 @@ int video_loop(sw::Renderer &renderer, sw::Context &context) {
 
     auto lk = std::scoped_lock(g_setup_mtx);
 
-    // For HTTP filesystems, pass the full HTTP URL directly to mpv
-    std::string loadfile_path = context.cur_file;
-    bool use_http_basic_preemptive_auth = false;
-    if (auto *fs = context.get_filesystem(sw::fs::Path::mountpoint(context.cur_file));
-            fs && fs->type == sw::fs::Filesystem::Type::Network) {
-        auto *net_fs = static_cast<const sw::fs::NetworkFilesystem *>(fs);
-        if (net_fs->protocol == sw::fs::NetworkFilesystem::Protocol::Http ||
-                net_fs->protocol == sw::fs::NetworkFilesystem::Protocol::Https) {
-            loadfile_path = static_cast<const sw::fs::HttpFs *>(net_fs)->make_url(context.cur_file);
-            use_http_basic_preemptive_auth = true;
-        }
-    }
-
-    if (use_http_basic_preemptive_auth) {
-        lmpv.command("loadfile", loadfile_path.c_str(), "replace",
-            "demuxer-lavf-o-add=auth_type=basic,stream-lavf-o-add=auth_type=basic");
-    } else {
-        lmpv.command("loadfile", loadfile_path.c_str());
-    }
+    lmpv.command("loadfile", context.cur_file.c_str());
 
     auto player_ui = std::make_unique<sw::ui::PlayerGui>(renderer, context, lmpv);
 
@@ -316,6 +298,10 @@ int video_loop(sw::Renderer &renderer, sw::Context &context) {
         }
     }
 
+    context.cur_file_played   = player_ui->path().empty() ? context.cur_file : player_ui->path();
+    context.cur_file_position = player_ui->time_pos();
+    context.cur_file_duration = player_ui->duration();
+
     renderer.wait_idle();
     renderer.destroy_mpv_render_context();
 
@@ -365,6 +351,28 @@ int main(int argc, const char **argv) {
         context.filesystems.emplace_back(user_fs);
     }
 
+    if (context.disk_cache_size) {
+        if (auto rc = context.block_cache.open_disk_cache(context.disk_cache_path,
+                std::uint64_t(context.disk_cache_size) << 20); rc)
+            std::printf("Failed to open disk cache: %d\n", rc);
+    }
+
+    auto media_cache_path = sw::fs::Path(sw::Context::AppDirectory) / sw::Context::MediaInfoFilename;
+    if (auto rc = context.media_cache.open(media_cache_path.base()); rc)
+        std::printf("Failed to open media info cache: %d\n", rc);
+
+    auto library_path = sw::fs::Path(sw::Context::AppDirectory) / sw::Context::LibraryFilename;
+    if (auto rc = context.library.load(library_path.base()); rc && rc != -ENOENT)
+        std::printf("Failed to load library index: %d\n", rc);
+
+    auto thumbnails_path = sw::fs::Path(sw::Context::AppDirectory) / sw::Context::ThumbnailsDirectory;
+    if (auto rc = context.thumbnails.open(thumbnails_path.base()); rc)
+        std::printf("Failed to open thumbnail cache: %d\n", rc);
+
+    auto trickplay_path = sw::fs::Path(sw::Context::AppDirectory) / sw::Context::TrickplayDirectory;
+    if (auto rc = context.trickplay.open(trickplay_path.base()); rc)
+        std::printf("Failed to open seek preview cache: %d\n", rc);
+
     auto recent = std::make_shared<sw::fs::RecentFs>(context, "recent", "recent:");
     if (auto rc = recent->register_fs(); !rc)
         context.filesystems.emplace_back(recent);
@@ -377,14 +385,21 @@ int main(int argc, const char **argv) {
         std::printf("Failed to initialize ums controller: %#x\n", rc);
     SW_SCOPEGUARD([] { context.ums.finalize(); });
 
-    auto network_setup_thread = std::jthread([] {
-        for (auto &info: context.network_infos) {
-            if (info->want_connect) {
-                if (auto rc = context.register_network_fs(*info); rc)
-                    context.set_error(rc, sw::Context::ErrorType::Network);
-            }
-        }
-    });
+    // Shares are mounted concurrently, so that an unreachable host doesn't hold back the others,
+    // and each of them is listed in the explorer as soon as it is online
+    auto network_setup_threads = std::vector<std::jthread>();
+    for (auto &info: context.network_infos) {
+        if (!info->want_connect)
+            continue;
+
+        info->connecting = true;
+        network_setup_threads.emplace_back([&info = *info, params = sw::Context::NetworkFsParams(*info)] {
+            SW_SCOPEGUARD([&info] { info.connecting = false; });
+
+            if (auto rc = context.register_network_fs(info, params); rc)
+                context.set_error(rc, sw::Context::ErrorType::Network);
+        });
+    }
 
     if (argc > 1)
         context.cur_file = argv[1], context.cli_mode = true;
@@ -395,7 +410,10 @@ int main(int argc, const char **argv) {
                 std::printf("Failed to run player: %d (%s)\n", rc, mpv_error_string(rc));
                 context.set_error(rc, sw::Context::ErrorType::Mpv);
             } else {
-                recent->add(context.cur_file);
+                // The playlist may have moved on from the file that was loaded, which was then played through
+                if (context.cur_file_played != context.cur_file)
+                    recent->add(context.cur_file);
+                recent->add(context.cur_file_played, context.cur_file_position, context.cur_file_duration);
             }
         }
 
@@ -406,6 +424,9 @@ int main(int argc, const char **argv) {
             std::printf("Failed to run menu: %d\n", rc);
     }
 
+    // Finish pending connections before the configuration is saved
+    network_setup_threads.clear();
+
     // Clear the screen before quitting
     ImGui::NewFrame();
     renderer.begin_frame();
@@ -0,0 +1,344 @@
+// Copyright (c) 2024 averne <averne381@gmail.com>
+//
+// This file is part of SwitchWave.
+//
+// SwitchWave is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// SwitchWave is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with SwitchWave.  If not, see <http://www.gnu.org/licenses/>.
+
+#include <cerrno>
+#include <cstring>
+#include <algorithm>
+#include <vector>
+
+#include "utils.hpp"
+
+#include "media_cache.hpp"
+
+namespace sw {
+
+namespace {
+
+struct FileHeader {
+    std::uint32_t magic, version;
+};
+
+} // namespace
+
+int MediaInfoCache::open(std::string_view path) {
+    auto lk = std::scoped_lock(this->mutex);
+
+    this->path = path;
+
+    std::vector<std::uint8_t> data;
+    if (auto *fp = std::fopen(this->path.c_str(), "rb"); fp) {
+        SW_SCOPEGUARD([&fp] { std::fclose(fp); });
+
+        std::fseek(fp, 0, SEEK_END);
+        data.resize(std::ftell(fp));
+        std::rewind(fp);
+
+        if (std::fread(data.data(), 1, data.size(), fp) != data.size())
+            data.clear();
+    }
+
+    // Replay the log, stopping at the first torn or invalid chunk
+    bool is_valid = false;
+    if (FileHeader header; data.size() >= sizeof(header)) {
+        std::memcpy(&header, data.data(), sizeof(header));
+        is_valid = header.magic == FileMagic && header.version == FileVersion;
+    }
+
+    std::vector<const char *> file_strings;
+    std::size_t pos = sizeof(FileHeader);
+    while (is_valid && pos < data.size()) {
+        ChunkHeader chunk;
+        if (pos + sizeof(chunk) > data.size()) {
+            is_valid = false;
+            break;
+        }
+
+        std::memcpy(&chunk, data.data() + pos, sizeof(chunk));
+        pos += sizeof(chunk);
+
+        if (pos + chunk.length > data.size()) {
+            is_valid = false;
+            break;
+        }
+
+        if (chunk.type == ChunkType::String) {
+            auto *str = this->intern(std::string(reinterpret_cast<const char *>(data.data() + pos), chunk.length).c_str());
+            this->file_string_ids.try_emplace(str, std::uint16_t(file_strings.size()));
+            file_strings.push_back(str);
+        } else if (chunk.type == ChunkType::Record && chunk.length == sizeof(Record)) {
+            Record record;
+            std::memcpy(&record, data.data() + pos, sizeof(record));
+
+            if (std::any_of(record.strings.begin(), record.strings.end(), [&file_strings](auto id) {
+                    return id != NoString && id >= file_strings.size();
+                })) {
+                is_valid = false;
+                break;
+            }
+
+            auto string = [&file_strings](std::uint16_t id) {
+                return (id != NoString) ? file_strings[id] : nullptr;
+            };
+
+            this->entries.insert_or_assign(record.path_hash, Entry{
+                .size  = record.size,
+                .mtime = record.mtime,
+                .seq   = this->next_seq++,
+                .info  = {
+                    .container_name      = string(record.strings[0]),
+                    .num_streams         = record.num_streams,
+                    .num_vstreams        = record.num_vstreams,
+                    .num_astreams        = record.num_astreams,
+                    .num_sstreams        = record.num_sstreams,
+                    .duration            = record.duration,
+                    .video_codec_name    = string(record.strings[1]),
+                    .video_profile_name  = string(record.strings[2]),
+                    .video_width         = record.video_width,
+                    .video_height        = record.video_height,
+                    .video_framerate     = record.video_framerate,
+                    .video_pix_format    = string(record.strings[3]),
+                    .audio_codec_name    = string(record.strings[4]),
+                    .audio_profile_name  = string(record.strings[5]),
+                    .num_audio_channels  = record.num_audio_channels,
+                    .audio_sample_rate   = int(record.audio_sample_rate),
+                    .audio_sample_format = string(record.strings[6]),
+                },
+            });
+
+            ++this->num_file_records;
+        } else {
+            is_valid = false;
+            break;
+        }
+
+        pos += chunk.length;
+    }
+
+    // Rewrite the file if it is new, damaged or mostly made of superseded records
+    if (!is_valid || this->num_file_records > 2 * this->entries.size() + 64)
+        return this->compact();
+
+    this->fp = std::fopen(this->path.c_str(), "ab");
+    if (!this->fp)
+        return -errno;
+
+    return 0;
+}
+
+void MediaInfoCache::close() {
+    auto lk = std::scoped_lock(this->mutex);
+
+    if (this->fp)
+        std::fclose(this->fp);
+    this->fp = nullptr;
+}
+
+bool MediaInfoCache::lookup(std::string_view path, std::uint64_t size, std::int64_t mtime, MediaInfo &info) {
+    auto lk = std::scoped_lock(this->mutex);
+
+    auto it = this->entries.find(utils::stable_hash(path));
+    if (it == this->entries.end() || it->second.size != size || it->second.mtime != mtime)
+        return false;
+
+    info = it->second.info;
+    return true;
+}
+
+void MediaInfoCache::insert(std::string_view path, std::uint64_t size, std::int64_t mtime, const MediaInfo &info) {
+    auto lk = std::scoped_lock(this->mutex);
+
+    auto entry = Entry{
+        .size  = size,
+        .mtime = mtime,
+        .seq   = this->next_seq++,
+        .info  = info,
+    };
+
+    for (auto *str: { &entry.info.container_name, &entry.info.video_codec_name, &entry.info.video_profile_name,
+            &entry.info.video_pix_format, &entry.info.audio_codec_name, &entry.info.audio_profile_name,
+            &entry.info.audio_sample_format })
+        *str = this->intern(*str);
+
+    auto hash = utils::stable_hash(path);
+    auto &inserted = this->entries.insert_or_assign(hash, std::move(entry)).first->second;
+
+    // Drop the oldest quarter of the entries
+    if (this->entries.size() > MaxEntries) {
+        std::vector<std::uint64_t> seqs;
+        seqs.reserve(this->entries.size());
+        for (auto &[hash, entry]: this->entries)
+            seqs.push_back(entry.seq);
+
+        auto threshold = seqs.begin() + seqs.size() / 4;
+        std::nth_element(seqs.begin(), threshold, seqs.end());
+        std::erase_if(this->entries, [threshold = *threshold](const auto &it) { return it.second.seq < threshold; });
+
+        if (this->fp)
+            this->compact();
+        return;
+    }
+
+    if (!this->fp)
+        return;
+
+    auto rc = this->append_record(hash, inserted);
+    if (!rc && std::fflush(this->fp))
+        rc = -errno;
+
+    if (rc) {
+        std::printf("Failed to write media info cache: %d\n", rc);
+        std::fclose(this->fp);
+        this->fp = nullptr;
+        return;
+    }
+
+    if (++this->num_file_records > 2 * this->entries.size() + 64)
+        this->compact();
+}
+
+int MediaInfoCache::probe(std::string_view path, std::uint64_t size, std::int64_t mtime, MediaInfo &info,
+        std::stop_token token) {
+    if (this->lookup(path, size, mtime, info))
+        return 0;
+
+    if (auto rc = probe_media(path, info, token); rc)
+        return rc;
+
+    this->insert(path, size, mtime, info);
+    return 0;
+}
+
+const char *MediaInfoCache::intern(const char *str) {
+    if (!str)
+        return nullptr;
+
+    if (auto it = this->interned.find(str); it != this->interned.end())
+        return it->second;
+
+    auto &stored = this->strings.emplace_back(str);
+    this->interned.emplace(stored, stored.c_str());
+    return stored.c_str();
+}
+
+int MediaInfoCache::append_string(const char *str, std::uint16_t &id) {
+    id = NoString;
+    if (!str)
+        return 0;
+
+    if (auto it = this->file_string_ids.find(str); it != this->file_string_ids.end()) {
+        id = it->second;
+        return 0;
+    }
+
+    if (this->file_string_ids.size() >= NoString)
+        return 0;
+
+    auto chunk = ChunkHeader{ ChunkType::String, std::uint16_t(std::min<std::size_t>(std::strlen(str), UINT16_MAX)) };
+    if (std::fwrite(&chunk, sizeof(chunk), 1, this->fp) != 1 || std::fwrite(str, 1, chunk.length, this->fp) != chunk.length)
+        return -EIO;
+
+    id = std::uint16_t(this->file_string_ids.size());
+    this->file_string_ids.emplace(str, id);
+    return 0;
+}
+
+int MediaInfoCache::append_record(std::uint64_t hash, const Entry &entry) {
+    auto &info = entry.info;
+
+    auto record = Record{
+        .path_hash          = hash,
+        .size               = entry.size,
+        .mtime              = entry.mtime,
+        .duration           = info.duration,
+        .video_framerate    = info.video_framerate,
+        .audio_sample_rate  = std::uint32_t(info.audio_sample_rate),
+        .num_streams        = std::uint16_t(info.num_streams),
+        .num_vstreams       = std::uint16_t(info.num_vstreams),
+        .num_astreams       = std::uint16_t(info.num_astreams),
+        .num_sstreams       = std::uint16_t(info.num_sstreams),
+        .video_width        = std::uint16_t(info.video_width),
+        .video_height       = std::uint16_t(info.video_height),
+        .num_audio_channels = std::uint16_t(info.num_audio_channels),
+        .strings            = {},
+    };
+
+    const char *strings[] = {
+        info.container_name, info.video_codec_name, info.video_profile_name, info.video_pix_format,
+        info.audio_codec_name, info.audio_profile_name, info.audio_sample_format,
+    };
+
+    for (std::size_t i = 0; i < record.strings.size(); ++i) {
+        if (auto rc = this->append_string(strings[i], record.strings[i]); rc)
+            return rc;
+    }
+
+    auto chunk = ChunkHeader{ ChunkType::Record, sizeof(Record) };
+    if (std::fwrite(&chunk, sizeof(chunk), 1, this->fp) != 1 || std::fwrite(&record, sizeof(record), 1, this->fp) != 1)
+        return -EIO;
+
+    return 0;
+}
+
+int MediaInfoCache::compact() {
+    if (this->fp)
+        std::fclose(this->fp);
+
+    auto tmp_path = this->path + ".tmp";
+
+    this->fp = std::fopen(tmp_path.c_str(), "wb");
+    if (!this->fp)
+        return -errno;
+
+    this->file_string_ids.clear();
+    this->num_file_records = 0;
+
+    // Keep the age order, for eviction after the next load
+    std::vector<std::pair<std::uint64_t, const Entry *>> sorted;
+    sorted.reserve(this->entries.size());
+    for (auto &[hash, entry]: this->entries)
+        sorted.emplace_back(hash, &entry);
+    std::sort(sorted.begin(), sorted.end(), [](const auto &a, const auto &b) { return a.second->seq < b.second->seq; });
+
+    auto header = FileHeader{ FileMagic, FileVersion };
+    int rc = (std::fwrite(&header, sizeof(header), 1, this->fp) == 1) ? 0 : -EIO;
+
+    for (auto &[hash, entry]: sorted) {
+        if (rc)
+            break;
+        rc = this->append_record(hash, *entry);
+        ++this->num_file_records;
+    }
+
+    std::fclose(this->fp);
+    this->fp = nullptr;
+
+    if (rc)
+        return rc;
+
+    // rename does not replace existing files on the sd card
+    std::remove(this->path.c_str());
+    if (std::rename(tmp_path.c_str(), this->path.c_str()))
+        return -errno;
+
+    this->fp = std::fopen(this->path.c_str(), "ab");
+    if (!this->fp)
+        return -errno;
+
+    return 0;
+}
+
+} // namespace sw
@@ -0,0 +1,119 @@
+// Copyright (c) 2024 averne <averne381@gmail.com>
+//
+// This file is part of SwitchWave.
+//
+// SwitchWave is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// SwitchWave is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with SwitchWave.  If not, see <http://www.gnu.org/licenses/>.
+
+#pragma once
+
+#include <array>
+#include <cstdint>
+#include <cstdio>
+#include <deque>
+#include <mutex>
+#include <stop_token>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+
+#include "media_probe.hpp"
+
+namespace sw {
+
+// Probe results kept on local storage, keyed by path, size and mtime
+// The file is a log of records, and of the strings they reference by index in order of appearance: names from
+// libav tables are few and shared by most files. It is rewritten once superseded records make up most of it.
+// Names in returned infos are owned by the cache.
+class MediaInfoCache {
+    public:
+        constexpr static std::uint32_t FileMagic   = 0x43494d57; // "WMIC"
+        constexpr static std::uint32_t FileVersion = 1;
+        constexpr static std::size_t   MaxEntries  = 8192;
+        constexpr static std::uint16_t NoString    = UINT16_MAX;
+
+    public:
+        MediaInfoCache() = default;
+        ~MediaInfoCache() {
+            this->close();
+        }
+
+        int open(std::string_view path);
+        void close();
+
+        bool lookup(std::string_view path, std::uint64_t size, std::int64_t mtime, MediaInfo &info);
+        void insert(std::string_view path, std::uint64_t size, std::int64_t mtime, const MediaInfo &info);
+
+        // Returns the cached info, or probes the file and caches the result
+        // Returns 0, or a negative AVERROR code
+        int probe(std::string_view path, std::uint64_t size, std::int64_t mtime, MediaInfo &info,
+            std::stop_token token = {});
+
+    private:
+        enum class ChunkType: std::uint16_t {
+            String,
+            Record,
+        };
+
+        struct ChunkHeader {
+            ChunkType type;
+            std::uint16_t length;
+        };
+
+        struct Record {
+            std::uint64_t path_hash, size;
+            std::int64_t  mtime, duration;
+            double        video_framerate;
+            std::uint32_t audio_sample_rate;
+            std::uint16_t num_streams, num_vstreams, num_astreams, num_sstreams;
+            std::uint16_t video_width, video_height, num_audio_channels;
+
+            // Container, video codec, profile and pixel format, audio codec, profile and sample format
+            std::array<std::uint16_t, 7> strings;
+        };
+
+        static_assert(sizeof(ChunkHeader) == 4 && sizeof(Record) == 0x48);
+
+        struct Entry {
+            std::uint64_t size;
+            std::int64_t  mtime;
+            std::uint64_t seq;
+            MediaInfo info;
+        };
+
+    private:
+        const char *intern(const char *str);
+
+        int append_string(const char *str, std::uint16_t &id);
+        int append_record(std::uint64_t hash, const Entry &entry);
+        int compact();
+
+    private:
+        std::mutex mutex;
+
+        std::string path;
+        std::FILE *fp = nullptr;
+
+        std::unordered_map<std::uint64_t, Entry> entries;
+        std::uint64_t next_seq = 0;
+        std::size_t num_file_records = 0;
+
+        // Storage of the names, which are never released
+        std::deque<std::string> strings;
+        std::unordered_map<std::string_view, const char *> interned;
+
+        // Indices of the names written to the current file
+        std::unordered_map<const char *, std::uint16_t> file_string_ids;
+};
+
+} // namespace sw
@@ -0,0 +1,234 @@
+// Copyright (c) 2024 averne <averne381@gmail.com>
+//
+// This file is part of SwitchWave.
+//
+// SwitchWave is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// SwitchWave is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with SwitchWave.  If not, see <http://www.gnu.org/licenses/>.
+
+#include <cctype>
+#include <cstdio>
+#include <algorithm>
+#include <array>
+#include <chrono>
+#include <string>
+
+extern "C" {
+#include <libavcodec/codec_desc.h>
+#include <libavformat/avformat.h>
+#include <libavutil/pixdesc.h>
+#include <libavutil/samplefmt.h>
+}
+
+#include "utils.hpp"
+
+#include "media_probe.hpp"
+
+namespace sw {
+
+namespace {
+
+constexpr std::array media_extensions = {
+    "3gp", "avi", "flv", "m2ts", "m4v", "mkv", "mov", "mp4", "mpeg", "mpg", "mts", "ogv", "ts", "vob", "webm", "wmv",
+    "aac", "ac3", "dts", "flac", "m4a", "mka", "mp3", "ogg", "opus", "wav", "wma",
+};
+
+// Limits of the bounded probe, enough to parse the first packets of each stream in most files
+constexpr std::int64_t FastProbeSize       = 0x100000;     // 1MiB
+constexpr std::int64_t FastAnalyzeDuration = AV_TIME_BASE; // 1s
+
+enum class ProbeStage {
+    Header,
+    Bounded,
+    Full,
+};
+
+// Containers whose header describes every track along with the duration (Matroska/WebM, MP4/MOV),
+// the streams can then be described without reading any packet
+bool has_descriptive_header(const AVInputFormat *iformat) {
+    auto name = std::string_view(iformat->name);
+    return name.starts_with("matroska") || name.starts_with("mov");
+}
+
+bool has_complete_parameters(const AVFormatContext *ctx) {
+    if (!ctx->nb_streams)
+        return false;
+
+    for (std::size_t i = 0; i < ctx->nb_streams; ++i) {
+        auto *par = ctx->streams[i]->codecpar;
+        switch (par->codec_type) {
+            case AVMEDIA_TYPE_VIDEO:
+                if (par->codec_id == AV_CODEC_ID_NONE || !par->width || !par->height)
+                    return false;
+                break;
+            case AVMEDIA_TYPE_AUDIO:
+                if (par->codec_id == AV_CODEC_ID_NONE || !par->sample_rate || !par->ch_layout.nb_channels)
+                    return false;
+                break;
+            default:
+                break;
+        }
+    }
+
+    return true;
+}
+
+int open_input(AVFormatContext *&ctx, const std::string &url, std::stop_token &token) {
+    ctx = avformat_alloc_context();
+    if (!ctx)
+        return AVERROR(ENOMEM);
+
+    ctx->interrupt_callback = {
+        .callback = +[](void *opaque) -> int {
+            return static_cast<std::stop_token *>(opaque)->stop_requested();
+        },
+        .opaque = &token,
+    };
+
+    // Frees the context on failure
+    if (auto rc = avformat_open_input(&ctx, url.c_str(), nullptr, nullptr); rc) {
+        char buf[AV_ERROR_MAX_STRING_SIZE];
+        std::printf("Failed to open input %s: %s\n", url.c_str(), av_make_error_string(buf, sizeof(buf), rc));
+        return rc;
+    }
+
+    return 0;
+}
+
+int find_stream_info(AVFormatContext *ctx, const std::string &url) {
+    if (auto rc = avformat_find_stream_info(ctx, nullptr); rc < 0) {
+        char buf[AV_ERROR_MAX_STRING_SIZE];
+        std::printf("Failed to match format for %s: %s\n", url.c_str(), av_make_error_string(buf, sizeof(buf), rc));
+        return rc;
+    }
+
+    return 0;
+}
+
+} // namespace
+
+bool is_media_file(std::string_view name) {
+    auto pos = name.rfind('.');
+    if (pos == std::string_view::npos)
+        return false;
+
+    auto ext = name.substr(pos + 1);
+    return std::any_of(media_extensions.begin(), media_extensions.end(), [&ext](std::string_view e) {
+        return std::equal(ext.begin(), ext.end(), e.begin(), e.end(), [](char x, char y) {
+            return std::tolower(static_cast<unsigned char>(x)) == y;
+        });
+    });
+}
+
+bool is_permanent_probe_error(int rc) {
+    return rc == AVERROR_INVALIDDATA || rc == AVERROR_DEMUXER_NOT_FOUND ||
+        rc == AVERROR_STREAM_NOT_FOUND || rc == AVERROR_DECODER_NOT_FOUND;
+}
+
+int probe_media(std::string_view path, MediaInfo &info, std::stop_token token) {
+    info = {};
+
+    // Add explicit protocol prefix, otherwise ffmpeg confuses the mountpoint for a protocol
+    auto url = std::string("file:") + std::string(path);
+
+    auto start = std::chrono::steady_clock::now();
+    std::int64_t bytes_read = 0;
+
+    AVFormatContext *avformat_ctx = nullptr;
+    SW_SCOPEGUARD([&avformat_ctx] { avformat_close_input(&avformat_ctx); });
+
+    if (auto rc = open_input(avformat_ctx, url, token); rc)
+        return rc;
+
+    info.container_name = avformat_ctx->iformat->long_name;
+
+    // Escalate from the container header, to a bounded read of the first packets, to the default libav limits
+    auto stage = ProbeStage::Header;
+    if (!has_descriptive_header(avformat_ctx->iformat) || !has_complete_parameters(avformat_ctx)) {
+        stage = ProbeStage::Bounded;
+        avformat_ctx->probesize            = FastProbeSize;
+        avformat_ctx->max_analyze_duration = FastAnalyzeDuration;
+
+        if (auto rc = find_stream_info(avformat_ctx, url); rc)
+            return rc;
+    }
+
+    if (!has_complete_parameters(avformat_ctx)) {
+        // Start over, the data read so far is still in the block cache
+        stage = ProbeStage::Full;
+        bytes_read += avformat_ctx->pb ? avformat_ctx->pb->bytes_read : 0;
+        avformat_close_input(&avformat_ctx);
+
+        if (auto rc = open_input(avformat_ctx, url, token); rc)
+            return rc;
+
+        if (auto rc = find_stream_info(avformat_ctx, url); rc)
+            return rc;
+    }
+
+    bytes_read += avformat_ctx->pb ? avformat_ctx->pb->bytes_read : 0;
+
+    info.duration    = (avformat_ctx->duration > 0) ? avformat_ctx->duration / AV_TIME_BASE : 0;
+    info.num_streams = avformat_ctx->nb_streams;
+
+    for (std::size_t i = 0; i < avformat_ctx->nb_streams; ++i) {
+        auto *s    = avformat_ctx->streams[i];
+        auto *desc = avcodec_descriptor_get(s->codecpar->codec_id);
+
+        // The overall duration is only computed when reading packets
+        if (avformat_ctx->duration <= 0 && s->duration > 0)
+            info.duration = std::max(info.duration, std::int64_t(s->duration * av_q2d(s->time_base)));
+
+        switch (s->codecpar->codec_type) {
+            case AVMEDIA_TYPE_VIDEO:
+                if (!info.video_codec_name && desc) {
+                    info.video_codec_name    = desc->long_name;
+                    info.video_profile_name  = desc->profiles ? desc->profiles[0].name : nullptr;
+                    info.video_width         = s->codecpar->width;
+                    info.video_height        = s->codecpar->height;
+                    info.video_framerate     = av_q2d(s->r_frame_rate.num ? s->r_frame_rate : s->avg_frame_rate);
+                    info.video_pix_format    = av_get_pix_fmt_name(AVPixelFormat(s->codecpar->format));
+                }
+                ++info.num_vstreams;
+                break;
+            case AVMEDIA_TYPE_AUDIO:
+                if (!info.audio_codec_name && desc) {
+                    info.audio_codec_name    = desc->long_name;
+                    info.audio_profile_name  = desc->profiles ? desc->profiles[0].name : nullptr;
+                    info.num_audio_channels  = s->codecpar->ch_layout.nb_channels;
+                    info.audio_sample_rate   = s->codecpar->sample_rate;
+                    info.audio_sample_format = av_get_sample_fmt_name(AVSampleFormat(s->codecpar->format));
+                }
+                ++info.num_astreams;
+                break;
+            case AVMEDIA_TYPE_SUBTITLE:
+                ++info.num_sstreams;
+                break;
+            default:
+                break;
+        }
+    }
+
+    static constexpr const char *stage_names[] = {
+        [int(ProbeStage::Header)]  = "header",
+        [int(ProbeStage::Bounded)] = "bounded",
+        [int(ProbeStage::Full)]    = "full",
+    };
+
+    std::printf("Probed %s (%s) in %ldms, %ld bytes read\n", url.c_str(), stage_names[int(stage)],
+        std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - start).count(),
+        bytes_read);
+
+    return 0;
+}
+
+} // namespace sw
@@ -0,0 +1,53 @@
+// Copyright (c) 2024 averne <averne381@gmail.com>
+//
+// This file is part of SwitchWave.
+//
+// SwitchWave is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// SwitchWave is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with SwitchWave.  If not, see <http://www.gnu.org/licenses/>.
+
+#pragma once
+
+#include <cstdint>
+#include <stop_token>
+#include <string_view>
+
+namespace sw {
+
+// Container and stream parameters of a media file
+// Names point into static libav tables
+struct MediaInfo {
+    const char *container_name = nullptr;
+    std::uint32_t num_streams, num_vstreams, num_astreams, num_sstreams;
+    std::int64_t duration;
+    const char *video_codec_name, *video_profile_name;
+    int video_width, video_height;
+    double video_framerate;
+    const char *video_pix_format;
+    const char *audio_codec_name, *audio_profile_name;
+    int num_audio_channels;
+    int audio_sample_rate;
+    const char *audio_sample_format;
+};
+
+// Whether the name has the extension of a common audio or video format
+bool is_media_file(std::string_view name);
+
+// Opens the file with libavformat and reads its stream parameters
+// The probe is aborted once a stop is requested on token
+// Returns 0, or a negative AVERROR code
+int probe_media(std::string_view path, MediaInfo &info, std::stop_token token = {});
+
+// Whether a probe error comes from the file contents, rather than from i/o or cancellation
+bool is_permanent_probe_error(int rc);
+
+} // namespace sw
@@ -16,6 +16,7 @@
 // along with SwitchWave.  If not, see <http://www.gnu.org/licenses/>.
 
 #include <cstdio>
+#include <cstring>
 #include <vector>
 #include <utility>
 
@@ -354,6 +355,25 @@ Renderer::Texture Renderer::load_texture(std::string_view path, int width, int h
     return Texture(texture.image, std::move(texture.memblock), texture.handle);
 }
 
+int Renderer::upload_texture(const Texture &texture, const void *data, std::size_t size, int width, int height) {
+    dk::UniqueMemBlock transfer = dk::MemBlockMaker(this->dk, utils::align_up(size, DK_MEMBLOCK_ALIGNMENT))
+        .setFlags(DkMemBlockFlags_CpuUncached | DkMemBlockFlags_GpuCached)
+        .create();
+    if (!transfer) {
+        std::printf("Failed to allocate memblock for texture upload\n");
+        return -1;
+    }
+
+    std::memcpy(transfer.getCpuAddr(), data, size);
+
+    this->cmdbuf.copyBufferToImage(DkCopyBuf{transfer.getGpuAddr()}, dk::ImageView(texture.image),
+        DkImageRect{0, 0, 0, std::uint32_t(width), std::uint32_t(height), 1});
+    this->queue.submitCommands(this->cmdbuf.finishList());
+    this->queue.waitIdle();
+
+    return 0;
+}
+
 void Renderer::begin_frame() {
     if (this->need_swapchain_rebuild) {
         {
@@ -67,6 +67,9 @@ class Renderer {
         Texture load_texture(std::string_view path, int width, int height,
             DkImageFormat format, std::uint32_t flags = 0);
 
+        // Replaces the contents of a texture, must not be called between begin_frame and end_frame
+        int upload_texture(const Texture &texture, const void *data, std::size_t size, int width, int height);
+
         void begin_frame();
         void end_frame();
 
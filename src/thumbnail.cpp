@@ -0,0 +1,464 @@
+// Copyright (c) 2024 averne <averne381@gmail.com>
+//
+// This file is part of SwitchWave.
+//
+// SwitchWave is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// SwitchWave is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with SwitchWave.  If not, see <http://www.gnu.org/licenses/>.
+
+#include <cstdio>
+#include <cstring>
+#include <algorithm>
+#include <array>
+#include <filesystem>
+#include <system_error>
+
+extern "C" {
+#include <libavcodec/avcodec.h>
+#include <libavformat/avformat.h>
+#include <libswscale/swscale.h>
+}
+
+#include "utils.hpp"
+#include "fs/fs_common.hpp"
+#include "fs/fs_scheduler.hpp"
+
+#include "thumbnail.hpp"
+
+namespace sw {
+
+namespace {
+
+// Limits of the stream probe and of the search for a keyframe after seeking
+constexpr std::int64_t ProbeSize  = 0x100000; // 1MiB
+constexpr int          MaxPackets = 256;
+
+} // namespace
+
+int ThumbnailGenerator::open(std::string_view directory) {
+    this->close();
+
+    this->directory = directory;
+
+    std::error_code ec;
+    std::filesystem::create_directories(this->directory, ec);
+    if (ec)
+        return -ec.value();
+
+    this->thread = std::jthread(&ThumbnailGenerator::thread_fn, this);
+    return 0;
+}
+
+void ThumbnailGenerator::close() {
+    if (!this->thread.joinable())
+        return;
+
+    this->thread.request_stop();
+    this->thread.join();
+
+    auto lk = std::scoped_lock(this->mutex);
+    this->pending.clear();
+}
+
+std::shared_ptr<const ThumbnailGenerator::Thumbnail> ThumbnailGenerator::get(std::string_view path,
+        std::uint64_t size, std::int64_t mtime) {
+    if (!this->thread.joinable())
+        return nullptr;
+
+    auto key = utils::stable_hash(std::string(path) + '\0' + std::to_string(size) + ':' + std::to_string(mtime));
+
+    auto lk = std::scoped_lock(this->mutex);
+
+    if (auto it = this->results.find(key); it != this->results.end())
+        return it->second;
+
+    if (key == this->current_key)
+        return nullptr;
+
+    // Move the request to the front of the queue, dropping the oldest ones
+    auto it = std::find_if(this->pending.begin(), this->pending.end(), [key](const auto &r) { return r.key == key; });
+    if (it != this->pending.end()) {
+        if (it != this->pending.begin()) {
+            auto request = std::move(*it);
+            this->pending.erase(it);
+            this->pending.push_front(std::move(request));
+        }
+        return nullptr;
+    }
+
+    this->pending.push_front(Request{ key, std::string(path) });
+    if (this->pending.size() > MaxPending)
+        this->pending.pop_back();
+
+    this->condvar.notify_one();
+    return nullptr;
+}
+
+int FrameGrabber::open(std::string_view path, const std::stop_token &token) {
+    this->close();
+
+    // Add explicit protocol prefix, otherwise ffmpeg confuses the mountpoint for a protocol
+    auto url = std::string("file:") + std::string(path);
+
+    this->format_ctx = avformat_alloc_context();
+    if (!this->format_ctx)
+        return AVERROR(ENOMEM);
+
+    this->format_ctx->interrupt_callback = {
+        .callback = +[](void *opaque) -> int {
+            return static_cast<const std::stop_token *>(opaque)->stop_requested();
+        },
+        .opaque = const_cast<std::stop_token *>(&token),
+    };
+
+    if (auto rc = avformat_open_input(&this->format_ctx, url.c_str(), nullptr, nullptr); rc)
+        return rc;
+
+    this->format_ctx->probesize            = ProbeSize;
+    this->format_ctx->max_analyze_duration = AV_TIME_BASE;
+
+    if (auto rc = avformat_find_stream_info(this->format_ctx, nullptr); rc < 0)
+        return rc;
+
+    const AVCodec *codec = nullptr;
+    this->stream_idx = av_find_best_stream(this->format_ctx, AVMEDIA_TYPE_VIDEO, -1, -1, &codec, 0);
+    if (this->stream_idx < 0)
+        return this->stream_idx;
+
+    this->codec_ctx = avcodec_alloc_context3(codec);
+    this->packet    = av_packet_alloc();
+    if (!this->codec_ctx || !this->packet)
+        return AVERROR(ENOMEM);
+
+    if (auto rc = avcodec_parameters_to_context(this->codec_ctx,
+            this->format_ctx->streams[this->stream_idx]->codecpar); rc < 0)
+        return rc;
+
+    // Keyframes decode without references, skip everything else
+    this->codec_ctx->skip_frame = AVDISCARD_NONKEY;
+
+    return avcodec_open2(this->codec_ctx, codec, nullptr);
+}
+
+void FrameGrabber::close() {
+    av_packet_free(&this->packet);
+    avcodec_free_context(&this->codec_ctx);
+    avformat_close_input(&this->format_ctx);
+    this->stream_idx = -1;
+}
+
+std::int64_t FrameGrabber::duration() const {
+    return std::max(this->format_ctx->duration, std::int64_t(0));
+}
+
+bool FrameGrabber::is_still_picture() const {
+    return this->format_ctx->streams[this->stream_idx]->disposition & AV_DISPOSITION_ATTACHED_PIC;
+}
+
+int FrameGrabber::grab(std::int64_t timestamp, AVFrame *frame) {
+    auto *stream = this->format_ctx->streams[this->stream_idx];
+
+    avcodec_flush_buffers(this->codec_ctx);
+
+    if (this->is_still_picture()) {
+        auto rc = avcodec_send_packet(this->codec_ctx, &stream->attached_pic);
+        if (rc >= 0)
+            rc = avcodec_send_packet(this->codec_ctx, nullptr);
+        if (rc >= 0)
+            rc = avcodec_receive_frame(this->codec_ctx, frame);
+        return rc;
+    }
+
+    if (this->format_ctx->start_time != AV_NOPTS_VALUE)
+        timestamp += this->format_ctx->start_time;
+
+    if (auto rc = av_seek_frame(this->format_ctx, -1, timestamp, AVSEEK_FLAG_BACKWARD); rc < 0 && timestamp)
+        return rc;
+
+    int rc = AVERROR(EAGAIN);
+    for (int i = 0; rc == AVERROR(EAGAIN) && i < MaxPackets;) {
+        if (auto read = av_read_frame(this->format_ctx, this->packet); read < 0) {
+            if (read != AVERROR_EOF)
+                return read;
+
+            // Drain the decoder at the end of the file
+            avcodec_send_packet(this->codec_ctx, nullptr);
+            return avcodec_receive_frame(this->codec_ctx, frame);
+        }
+        SW_SCOPEGUARD([this] { av_packet_unref(this->packet); });
+
+        if (this->packet->stream_index != this->stream_idx)
+            continue;
+        ++i;
+
+        if (auto sent = avcodec_send_packet(this->codec_ctx, this->packet); sent < 0 && sent != AVERROR(EAGAIN))
+            return sent;
+
+        rc = avcodec_receive_frame(this->codec_ctx, frame);
+    }
+
+    return rc;
+}
+
+int FrameGrabber::letterbox(const AVFrame *frame, std::span<std::uint8_t> rgba, int width, int height) {
+    if (rgba.size() < std::size_t(width * height * 4))
+        return AVERROR(EINVAL);
+
+    // Account for anamorphic video
+    auto sar    = (frame->sample_aspect_ratio.num > 0) ? av_q2d(frame->sample_aspect_ratio) : 1.0;
+    auto aspect = frame->width * sar / frame->height;
+
+    int scaled_width = width, scaled_height = height;
+    if (aspect > double(width) / height)
+        scaled_height = std::clamp(int(width / aspect) & ~1, 2, height);
+    else
+        scaled_width  = std::clamp(int(height * aspect) & ~1, 2, width);
+
+    auto *sws_ctx = sws_getContext(frame->width, frame->height, AVPixelFormat(frame->format),
+        scaled_width, scaled_height, AV_PIX_FMT_RGBA, SWS_BILINEAR, nullptr, nullptr, nullptr);
+    SW_SCOPEGUARD([&sws_ctx] { sws_freeContext(sws_ctx); });
+    if (!sws_ctx)
+        return AVERROR(EINVAL);
+
+    for (std::size_t i = 0; i < std::size_t(width * height); ++i)
+        std::memcpy(rgba.data() + i * 4, "\0\0\0\xff", 4);
+
+    std::uint8_t *dst_data[4] = {
+        rgba.data() + (((height - scaled_height) / 2) * width + (width - scaled_width) / 2) * 4,
+    };
+    int dst_linesize[4] = { width * 4 };
+
+    return sws_scale(sws_ctx, frame->data, frame->linesize, 0, frame->height, dst_data, dst_linesize);
+}
+
+int ThumbnailGenerator::decode(std::string_view path, std::span<std::uint8_t> rgba, std::stop_token token) {
+    FrameGrabber grabber;
+    if (auto rc = grabber.open(path, token); rc < 0)
+        return rc;
+
+    auto *frame = av_frame_alloc();
+    SW_SCOPEGUARD([&frame] { av_frame_free(&frame); });
+    if (!frame)
+        return AVERROR(ENOMEM);
+
+    // Fall back to the first keyframe for files that can't be seeked
+    auto timestamp = std::int64_t(grabber.duration() * SeekFraction);
+    auto rc = grabber.grab(timestamp, frame);
+    if (rc < 0 && timestamp && !token.stop_requested())
+        rc = grabber.grab(0, frame);
+    if (rc < 0)
+        return rc;
+
+    rc = FrameGrabber::letterbox(frame, rgba, Width, Height);
+    return (rc < 0) ? rc : 0;
+}
+
+void ThumbnailGenerator::compress_bc1(std::span<const std::uint8_t> rgba, int width, int height,
+        std::span<std::uint8_t> out) {
+    auto to_565 = [](const std::array<int, 3> &c) -> std::uint16_t {
+        return ((c[0] * 31 + 127) / 255) << 11 | ((c[1] * 63 + 127) / 255) << 5 | ((c[2] * 31 + 127) / 255);
+    };
+
+    auto from_565 = [](std::uint16_t c) -> std::array<int, 3> {
+        int r = (c >> 11) & 0x1f, g = (c >> 5) & 0x3f, b = c & 0x1f;
+        return { (r << 3) | (r >> 2), (g << 2) | (g >> 4), (b << 3) | (b >> 2) };
+    };
+
+    auto *dst = out.data();
+    for (int by = 0; by < height; by += 4) {
+        for (int bx = 0; bx < width; bx += 4) {
+            std::array<std::array<int, 3>, 16> pixels;
+            std::array<int, 3> min = { 255, 255, 255 }, max = { 0, 0, 0 }, mean = {};
+
+            for (int i = 0; i < 16; ++i) {
+                auto *p = rgba.data() + ((by + i / 4) * width + bx + i % 4) * 4;
+                for (int c = 0; c < 3; ++c) {
+                    pixels[i][c] = p[c];
+                    min[c]   = std::min(min[c], int(p[c]));
+                    max[c]   = std::max(max[c], int(p[c]));
+                    mean[c] += p[c];
+                }
+            }
+
+            for (auto &m: mean)
+                m /= 16;
+
+            // Take the diagonal of the bounding box which follows the correlation of red and blue with green
+            int cov_rg = 0, cov_bg = 0;
+            for (auto &p: pixels) {
+                cov_rg += (p[0] - mean[0]) * (p[1] - mean[1]);
+                cov_bg += (p[2] - mean[2]) * (p[1] - mean[1]);
+            }
+
+            if (cov_rg < 0)
+                std::swap(min[0], max[0]);
+            if (cov_bg < 0)
+                std::swap(min[2], max[2]);
+
+            // Inset the endpoints, extreme values are rare and would otherwise waste precision
+            for (int c = 0; c < 3; ++c) {
+                auto inset = (max[c] - min[c]) / 16;
+                max[c] -= inset;
+                min[c] += inset;
+            }
+
+            auto c0 = to_565(max), c1 = to_565(min);
+            std::uint32_t indices = 0;
+
+            // Equal endpoints select the three-color mode, where index 0 still maps to the first color
+            if (c0 != c1) {
+                if (c0 < c1)
+                    std::swap(c0, c1);
+
+                auto e0 = from_565(c0), e1 = from_565(c1);
+                std::array<std::array<int, 3>, 4> palette = { e0, e1 };
+                for (int c = 0; c < 3; ++c) {
+                    palette[2][c] = (2 * e0[c] + e1[c]) / 3;
+                    palette[3][c] = (e0[c] + 2 * e1[c]) / 3;
+                }
+
+                for (int i = 0; i < 16; ++i) {
+                    int best = 0, best_dist = INT32_MAX;
+                    for (int j = 0; j < 4; ++j) {
+                        int dist = 0;
+                        for (int c = 0; c < 3; ++c)
+                            dist += (pixels[i][c] - palette[j][c]) * (pixels[i][c] - palette[j][c]);
+                        if (dist < best_dist)
+                            best = j, best_dist = dist;
+                    }
+                    indices |= std::uint32_t(best) << (2 * i);
+                }
+            }
+
+            std::memcpy(dst + 0, &c0, sizeof(c0));
+            std::memcpy(dst + 2, &c1, sizeof(c1));
+            std::memcpy(dst + 4, &indices, sizeof(indices));
+            dst += 8;
+        }
+    }
+}
+
+std::string ThumbnailGenerator::cache_path(std::uint64_t key) const {
+    char name[0x20];
+    std::snprintf(name, sizeof(name), "/%016lx.thm", key);
+    return this->directory + name;
+}
+
+std::shared_ptr<const ThumbnailGenerator::Thumbnail> ThumbnailGenerator::load(std::uint64_t key) {
+    auto *fp = std::fopen(this->cache_path(key).c_str(), "rb");
+    if (!fp)
+        return nullptr;
+    SW_SCOPEGUARD([&fp] { std::fclose(fp); });
+
+    FileHeader header;
+    if (std::fread(&header, sizeof(header), 1, fp) != 1 || header.magic != FileMagic)
+        return nullptr;
+
+    auto thumbnail = std::make_shared<Thumbnail>();
+
+    // Files without a picture are recorded with empty dimensions
+    if (!header.width && !header.height)
+        return thumbnail;
+
+    if (header.width != Width || header.height != Height)
+        return nullptr;
+
+    thumbnail->data.resize(DataSize);
+    if (std::fread(thumbnail->data.data(), 1, DataSize, fp) != DataSize)
+        return nullptr;
+
+    return thumbnail;
+}
+
+std::shared_ptr<const ThumbnailGenerator::Thumbnail> ThumbnailGenerator::generate(std::stop_token token,
+        const Request &request) {
+    auto rgba = std::vector<std::uint8_t>(Width * Height * 4);
+    auto rc   = ThumbnailGenerator::decode(request.path, rgba, token);
+
+    if (token.stop_requested())
+        return nullptr;
+
+    auto thumbnail = std::make_shared<Thumbnail>();
+    if (!rc) {
+        thumbnail->data.resize(DataSize);
+        ThumbnailGenerator::compress_bc1(rgba, Width, Height, thumbnail->data);
+    } else {
+        char buf[AV_ERROR_MAX_STRING_SIZE];
+        std::printf("Failed to generate thumbnail for %s: %s\n", request.path.c_str(),
+            av_make_error_string(buf, sizeof(buf), rc));
+
+        // Only remember files that can't have a thumbnail, transient errors are not persisted
+        if (rc != AVERROR_STREAM_NOT_FOUND && rc != AVERROR_DECODER_NOT_FOUND && rc != AVERROR_INVALIDDATA)
+            return thumbnail;
+    }
+
+    auto header = FileHeader{
+        .magic  = FileMagic,
+        .width  = std::uint16_t(rc ? 0 : Width),
+        .height = std::uint16_t(rc ? 0 : Height),
+    };
+
+    auto path = this->cache_path(request.key);
+    if (auto *fp = std::fopen(path.c_str(), "wb"); fp) {
+        bool failed = std::fwrite(&header, sizeof(header), 1, fp) != 1;
+        if (!thumbnail->data.empty())
+            failed |= std::fwrite(thumbnail->data.data(), 1, thumbnail->data.size(), fp) != thumbnail->data.size();
+        failed |= std::fclose(fp) != 0;
+
+        if (failed)
+            std::remove(path.c_str());
+        else if (++this->num_saved % TrimInterval == 0)
+            fs::trim_directory(this->directory, ".thm", MaxCacheSize);
+    }
+
+    return thumbnail;
+}
+
+void ThumbnailGenerator::thread_fn(std::stop_token token) {
+    // Thumbnails must not delay playback or browsing on the same share
+    auto priority = fs::IoScheduler::ScopedPriority(fs::IoScheduler::Priority::Background);
+
+    fs::trim_directory(this->directory, ".thm", MaxCacheSize);
+
+    while (true) {
+        Request request;
+        {
+            auto lk = std::unique_lock(this->mutex);
+            if (!this->condvar.wait(lk, token, [this] { return !this->pending.empty(); }))
+                return;
+
+            request = std::move(this->pending.front());
+            this->pending.pop_front();
+            this->current_key = request.key;
+        }
+
+        auto thumbnail = this->load(request.key);
+        if (!thumbnail)
+            thumbnail = this->generate(token, request);
+
+        if (!thumbnail)
+            return;
+
+        auto lk = std::scoped_lock(this->mutex);
+        this->current_key = 0;
+
+        if (this->results.emplace(request.key, std::move(thumbnail)).second)
+            this->results_order.push_back(request.key);
+
+        if (this->results.size() > MaxResults) {
+            this->results.erase(this->results_order.front());
+            this->results_order.pop_front();
+        }
+    }
+}
+
+} // namespace sw
@@ -0,0 +1,151 @@
+// Copyright (c) 2024 averne <averne381@gmail.com>
+//
+// This file is part of SwitchWave.
+//
+// SwitchWave is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// SwitchWave is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with SwitchWave.  If not, see <http://www.gnu.org/licenses/>.
+
+#pragma once
+
+#include <cstdint>
+#include <condition_variable>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <span>
+#include <stop_token>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+struct AVCodecContext;
+struct AVFormatContext;
+struct AVFrame;
+struct AVPacket;
+
+namespace sw {
+
+// Decodes keyframes from the best video stream of a file, independently of the player
+class FrameGrabber {
+    public:
+        FrameGrabber() = default;
+        ~FrameGrabber() {
+            this->close();
+        }
+
+        FrameGrabber(const FrameGrabber &) = delete;
+        FrameGrabber &operator =(const FrameGrabber &) = delete;
+
+        // Blocking I/O is aborted once a stop is requested on token, which must outlive the grabber
+        // Returns 0, or a negative AVERROR code
+        int open(std::string_view path, const std::stop_token &token);
+        void close();
+
+        // In microseconds, 0 if unknown
+        std::int64_t duration() const;
+
+        // Whether the stream is the cover art of an audio file
+        bool is_still_picture() const;
+
+        // Decodes the last keyframe at or before timestamp (in microseconds, relative to the start of the file)
+        int grab(std::int64_t timestamp, AVFrame *frame);
+
+        // Scales a frame to the center of a width x height RGBA picture with black borders, keeping its aspect ratio
+        static int letterbox(const AVFrame *frame, std::span<std::uint8_t> rgba, int width, int height);
+
+    private:
+        AVFormatContext *format_ctx = nullptr;
+        AVCodecContext  *codec_ctx  = nullptr;
+        AVPacket        *packet     = nullptr;
+        int stream_idx = -1;
+};
+
+// Previews of media files, extracted from a keyframe (or the cover art of audio files) by a background job
+// Pictures are letterboxed, compressed to BC1 so they can be copied to a texture as-is, and cached on local storage
+class ThumbnailGenerator {
+    public:
+        constexpr static int Width  = 192;
+        constexpr static int Height = 108;
+        constexpr static std::size_t DataSize = (Width / 4) * (Height / 4) * 8;
+
+        constexpr static std::uint32_t FileMagic  = 0x4d485457; // "WTHM"
+        constexpr static std::size_t   MaxResults = 256;
+        constexpr static std::size_t   MaxPending = 32;
+
+        // Size limit of the saved thumbnails, checked on startup then every TrimInterval saves
+        constexpr static std::uint64_t MaxCacheSize = 0x2000000; // 32MiB
+        constexpr static std::size_t   TrimInterval = 256;
+
+        // Position of the representative frame, as a fraction of the duration
+        constexpr static double SeekFraction = 0.25;
+
+        struct Thumbnail {
+            std::vector<std::uint8_t> data; // Empty if the file has no picture
+        };
+
+    public:
+        ThumbnailGenerator() = default;
+        ~ThumbnailGenerator() {
+            this->close();
+        }
+
+        int open(std::string_view directory);
+        void close();
+
+        // Returns the thumbnail if it is ready, otherwise queues its generation
+        // Recent requests are served first, so callers should ask for visible entries every frame
+        std::shared_ptr<const Thumbnail> get(std::string_view path, std::uint64_t size, std::int64_t mtime);
+
+        // Decodes a representative picture, scaled to Width x Height RGBA
+        // Returns 0, or a negative AVERROR code
+        static int decode(std::string_view path, std::span<std::uint8_t> rgba, std::stop_token token = {});
+
+        // Compresses RGBA pixels to BC1 blocks, dimensions must be multiples of 4
+        static void compress_bc1(std::span<const std::uint8_t> rgba, int width, int height, std::span<std::uint8_t> out);
+
+    private:
+        struct Request {
+            std::uint64_t key;
+            std::string path;
+        };
+
+        struct FileHeader {
+            std::uint32_t magic;
+            std::uint16_t width, height;
+        };
+
+    private:
+        std::string cache_path(std::uint64_t key) const;
+
+        std::shared_ptr<const Thumbnail> load(std::uint64_t key);
+        std::shared_ptr<const Thumbnail> generate(std::stop_token token, const Request &request);
+
+        void thread_fn(std::stop_token token);
+
+    private:
+        std::string directory;
+
+        std::mutex mutex;
+        std::condition_variable_any condvar;
+        std::deque<Request> pending;
+        std::uint64_t current_key = 0; // Request being processed
+        std::size_t num_saved = 0;     // Only accessed by the worker thread
+        std::unordered_map<std::uint64_t, std::shared_ptr<const Thumbnail>> results;
+        std::deque<std::uint64_t> results_order;
+
+        std::jthread thread;
+};
+
+} // namespace sw
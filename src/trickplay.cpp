@@ -0,0 +1,280 @@
+// Copyright (c) 2024 averne <averne381@gmail.com>
+//
+// This file is part of SwitchWave.
+//
+// SwitchWave is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// SwitchWave is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with SwitchWave.  If not, see <http://www.gnu.org/licenses/>.
+
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <algorithm>
+#include <filesystem>
+#include <system_error>
+#include <sys/stat.h>
+
+#include <switch.h>
+
+extern "C" {
+#include <libavcodec/avcodec.h>
+#include <libavformat/avformat.h>
+}
+
+#include "utils.hpp"
+#include "thumbnail.hpp"
+#include "fs/fs_common.hpp"
+#include "fs/fs_scheduler.hpp"
+
+#include "trickplay.hpp"
+
+namespace sw {
+
+namespace {
+
+// Tiles decoded in a row before giving up on the file, eg. when it can't be seeked
+constexpr int MaxFailures = 4;
+
+} // namespace
+
+int TrickplayGenerator::Atlas::find_tile(double timestamp) const {
+    if (this->num_tiles <= 0 || this->interval <= 0)
+        return -1;
+
+    auto closest = std::clamp(int(std::lround(timestamp / this->interval)), 0, this->num_tiles - 1);
+    for (int d = 0; d < this->num_tiles; ++d) {
+        if (closest - d >= 0 && this->ready[closest - d])
+            return closest - d;
+        if (closest + d < this->num_tiles && this->ready[closest + d])
+            return closest + d;
+    }
+
+    return -1;
+}
+
+int TrickplayGenerator::open(std::string_view directory) {
+    this->close();
+
+    this->directory = directory;
+
+    std::error_code ec;
+    std::filesystem::create_directories(this->directory, ec);
+    return ec ? -ec.value() : 0;
+}
+
+void TrickplayGenerator::close() {
+    this->stop();
+    this->cancelled_jobs.clear();
+}
+
+void TrickplayGenerator::start(std::string_view path) {
+    this->stop();
+
+    std::erase_if(this->cancelled_jobs, [](const auto &job) { return job->done.load(); });
+
+    this->job = std::make_unique<Job>();
+    this->job->path   = path;
+    this->job->thread = std::jthread(&TrickplayGenerator::thread_fn, this, std::ref(*this->job));
+}
+
+void TrickplayGenerator::stop() {
+    if (!this->job)
+        return;
+
+    this->job->thread.request_stop();
+
+    {
+        auto lk = std::scoped_lock(this->mutex);
+        this->atlas.reset();
+    }
+
+    // Don't block the UI on a job stuck in a network call
+    if (!this->job->done)
+        this->cancelled_jobs.emplace_back(std::move(this->job));
+
+    this->job.reset();
+}
+
+std::string TrickplayGenerator::cache_path(std::uint64_t key) const {
+    char name[0x20];
+    std::snprintf(name, sizeof(name), "/%016lx.trp", key);
+    return this->directory + name;
+}
+
+bool TrickplayGenerator::load(std::uint64_t key, Atlas &atlas) {
+    if (this->directory.empty())
+        return false;
+
+    auto *fp = std::fopen(this->cache_path(key).c_str(), "rb");
+    if (!fp)
+        return false;
+    SW_SCOPEGUARD([&fp] { std::fclose(fp); });
+
+    FileHeader header;
+    if (std::fread(&header, sizeof(header), 1, fp) != 1 || header.magic != FileMagic)
+        return false;
+
+    if (header.tile_width != TileWidth || header.tile_height != TileHeight ||
+            header.columns != Columns || header.rows != Rows ||
+            !header.num_tiles || header.num_tiles > MaxTiles || !(header.interval > 0))
+        return false;
+
+    atlas.interval  = header.interval;
+    atlas.num_tiles = header.num_tiles;
+    for (int i = 0; i < MaxTiles; ++i)
+        atlas.ready[i] = header.ready[i / 64] & (1ull << (i % 64));
+
+    atlas.data.resize(AtlasDataSize);
+    return std::fread(atlas.data.data(), 1, AtlasDataSize, fp) == AtlasDataSize;
+}
+
+void TrickplayGenerator::save(std::uint64_t key, const Atlas &atlas) {
+    if (this->directory.empty())
+        return;
+
+    auto header = FileHeader{
+        .magic       = FileMagic,
+        .tile_width  = TileWidth,
+        .tile_height = TileHeight,
+        .columns     = Columns,
+        .rows        = Rows,
+        .num_tiles   = std::uint32_t(atlas.num_tiles),
+        .interval    = atlas.interval,
+        .ready       = {},
+    };
+
+    for (int i = 0; i < MaxTiles; ++i) {
+        if (atlas.ready[i])
+            header.ready[i / 64] |= 1ull << (i % 64);
+    }
+
+    fs::trim_directory(this->directory, ".trp", MaxCacheSize - sizeof(header) - atlas.data.size());
+
+    auto path = this->cache_path(key);
+    auto *fp = std::fopen(path.c_str(), "wb");
+    if (!fp)
+        return;
+
+    bool failed = std::fwrite(&header, sizeof(header), 1, fp) != 1;
+    failed |= std::fwrite(atlas.data.data(), 1, atlas.data.size(), fp) != atlas.data.size();
+    failed |= std::fclose(fp) != 0;
+
+    if (failed)
+        std::remove(path.c_str());
+}
+
+void TrickplayGenerator::publish(std::stop_token token, const Atlas &atlas) {
+    auto snapshot = std::make_shared<const Atlas>(atlas);
+
+    // The job might have been cancelled while the atlas was copied
+    auto lk = std::scoped_lock(this->mutex);
+    if (!token.stop_requested())
+        this->atlas = std::move(snapshot);
+}
+
+void TrickplayGenerator::thread_fn(std::stop_token token, Job &job) {
+    SW_SCOPEGUARD([&job] { job.done = true; });
+
+    // Stay out of the way of playback, for both CPU time and I/O
+    svcSetThreadPriority(CUR_THREAD_HANDLE, 0x3f);
+    auto priority = fs::IoScheduler::ScopedPriority(fs::IoScheduler::Priority::Background);
+
+    struct stat st;
+    if (::stat(job.path.c_str(), &st))
+        return;
+
+    auto key = utils::stable_hash(job.path + '\0' + std::to_string(st.st_size) + ':' + std::to_string(st.st_mtime));
+
+    Atlas atlas;
+    bool loaded = this->load(key, atlas);
+    if (loaded) {
+        this->publish(token, atlas);
+        if (int(atlas.ready.count()) == atlas.num_tiles)
+            return;
+    }
+
+    FrameGrabber grabber;
+    if (auto rc = grabber.open(job.path, token); rc < 0) {
+        char buf[AV_ERROR_MAX_STRING_SIZE];
+        std::printf("Failed to open %s for seek previews: %s\n", job.path.c_str(),
+            av_make_error_string(buf, sizeof(buf), rc));
+        return;
+    }
+
+    if (grabber.is_still_picture())
+        return;
+
+    if (!loaded) {
+        auto duration = double(grabber.duration()) / AV_TIME_BASE;
+        if (duration <= 0)
+            return;
+
+        atlas.interval  = std::max(MinInterval, duration / MaxTiles);
+        atlas.num_tiles = std::clamp(int(std::ceil(duration / atlas.interval)), 1, MaxTiles);
+        atlas.data.resize(AtlasDataSize);
+    }
+
+    auto *frame = av_frame_alloc();
+    SW_SCOPEGUARD([&frame] { av_frame_free(&frame); });
+    if (!frame)
+        return;
+
+    constexpr int tile_blocks_x = TileWidth / 4, atlas_blocks_x = AtlasWidth / 4;
+
+    auto rgba   = std::vector<std::uint8_t>(TileWidth * TileHeight * 4);
+    auto blocks = std::vector<std::uint8_t>((TileWidth / 4) * (TileHeight / 4) * 8);
+
+    int num_decoded = 0, num_failures = 0;
+
+    // Coarse to fine, so that the previews cover the whole file early on
+    for (int stride = 16; stride && !token.stop_requested() && num_failures < MaxFailures; stride /= 2) {
+        for (int i = 0; i < atlas.num_tiles && !token.stop_requested() && num_failures < MaxFailures; i += stride) {
+            if (atlas.ready[i])
+                continue;
+
+            auto rc = grabber.grab(std::int64_t(i * atlas.interval * AV_TIME_BASE), frame);
+            if (rc >= 0)
+                rc = FrameGrabber::letterbox(frame, rgba, TileWidth, TileHeight);
+            av_frame_unref(frame);
+
+            if (rc < 0) {
+                ++num_failures;
+                continue;
+            }
+
+            num_failures = 0;
+
+            ThumbnailGenerator::compress_bc1(rgba, TileWidth, TileHeight, blocks);
+
+            auto col = i % Columns, row = i / Columns;
+            for (int y = 0; y < TileHeight / 4; ++y) {
+                std::memcpy(atlas.data.data() + ((row * TileHeight / 4 + y) * atlas_blocks_x + col * tile_blocks_x) * 8,
+                    blocks.data() + y * tile_blocks_x * 8, tile_blocks_x * 8);
+            }
+
+            atlas.ready.set(i);
+
+            if (++num_decoded % PublishInterval == 0)
+                this->publish(token, atlas);
+        }
+    }
+
+    if (!num_decoded)
+        return;
+
+    this->publish(token, atlas);
+
+    // Also keep the progress of interrupted jobs, which resume from there on the next playback
+    this->save(key, atlas);
+}
+
+} // namespace sw
@@ -0,0 +1,124 @@
+// Copyright (c) 2024 averne <averne381@gmail.com>
+//
+// This file is part of SwitchWave.
+//
+// SwitchWave is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// SwitchWave is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with SwitchWave.  If not, see <http://www.gnu.org/licenses/>.
+
+#pragma once
+
+#include <atomic>
+#include <bitset>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <stop_token>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
+
+namespace sw {
+
+// Seek previews of the file being played
+// A background job decodes keyframes at regular intervals with its own demuxer, and packs them
+// in a BC1-compressed atlas which is published as tiles complete, then saved to local storage
+class TrickplayGenerator {
+    public:
+        constexpr static int TileWidth   = 128;
+        constexpr static int TileHeight  = 72;
+        constexpr static int Columns     = 10;
+        constexpr static int Rows        = 10;
+        constexpr static int MaxTiles    = Columns * Rows;
+        constexpr static int AtlasWidth  = TileWidth  * Columns;
+        constexpr static int AtlasHeight = TileHeight * Rows;
+        constexpr static std::size_t AtlasDataSize = (AtlasWidth / 4) * (AtlasHeight / 4) * 8;
+
+        constexpr static std::uint32_t FileMagic = 0x50525457; // "WTRP"
+
+        // Size limit of the saved atlases, the oldest ones are removed past it
+        constexpr static std::uint64_t MaxCacheSize = 0x4000000; // 64MiB
+
+        // Minimum spacing of the tiles, in seconds
+        constexpr static double MinInterval = 10.0;
+
+        // Number of decoded tiles between two publications of the atlas
+        constexpr static int PublishInterval = 8;
+
+        struct Atlas {
+            double interval = 0; // Seconds between tiles
+            int num_tiles   = 0;
+            std::bitset<MaxTiles> ready;
+            std::vector<std::uint8_t> data;
+
+            // Index of the ready tile closest to timestamp (in seconds), or -1
+            int find_tile(double timestamp) const;
+        };
+
+    public:
+        TrickplayGenerator() = default;
+        ~TrickplayGenerator() {
+            this->close();
+        }
+
+        int open(std::string_view directory);
+        void close();
+
+        // Cancels the current job, and starts generating previews for the file
+        void start(std::string_view path);
+        void stop();
+
+        // Latest published atlas, nullptr before the first tiles are ready
+        std::shared_ptr<const Atlas> get() {
+            auto lk = std::scoped_lock(this->mutex);
+            return this->atlas;
+        }
+
+    private:
+        struct Job {
+            std::string path;
+            std::atomic_bool done = false;
+            std::jthread thread;
+        };
+
+        struct FileHeader {
+            std::uint32_t magic;
+            std::uint16_t tile_width, tile_height;
+            std::uint16_t columns, rows;
+            std::uint32_t num_tiles;
+            double interval;
+            std::uint64_t ready[(MaxTiles + 63) / 64];
+        };
+
+    private:
+        std::string cache_path(std::uint64_t key) const;
+
+        bool load(std::uint64_t key, Atlas &atlas);
+        void save(std::uint64_t key, const Atlas &atlas);
+        void publish(std::stop_token token, const Atlas &atlas);
+
+        void thread_fn(std::stop_token token, Job &job);
+
+    private:
+        std::string directory;
+
+        std::mutex mutex;
+        std::shared_ptr<const Atlas> atlas;
+
+        std::unique_ptr<Job> job;
+
+        // Cancelled jobs stuck in a network call, joined once they return
+        std::vector<std::unique_ptr<Job>> cancelled_jobs;
+};
+
+} // namespace sw
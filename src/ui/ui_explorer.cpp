@@ -1,3 +1,6 @@
+#include <cstring>
+#include <algorithm>
+#include <iterator>
 #include <dirent.h>
 
 #define IMGUI_DEFINE_MATH_OPERATORS
@@ -7,6 +10,9 @@
 #include <imgui_deko3d.h>
 
 #include "utils.hpp"
+#include "media_probe.hpp"
+#include "fs/fs_recent.hpp"
+#include "fs/fs_scheduler.hpp"
 
 #include "ui/ui_explorer.hpp"
 
@@ -25,6 +31,12 @@ std::string_view utf8_skip_from_end(std::string_view sv, int skip) {
     return sv.substr(uintptr_t(data - sv.data()));
 }
 
+bool node_compare(const fs::Node &lhs, const fs::Node &rhs) {
+    if (lhs.type != rhs.type)
+        return lhs.type < rhs.type;
+    return strcasecmp(lhs.name.c_str(), rhs.name.c_str()) < 0;
+}
+
 } // namespace
 
 Explorer::Explorer(Renderer &renderer, Context &context): Widget(renderer), context(context) {
@@ -45,12 +57,129 @@ Explorer::Explorer(Renderer &renderer, Context &context): Widget(renderer), cont
 }
 
 Explorer::~Explorer() {
+    this->cancel_scan();
+
     this->renderer.unregister_texture(this->file_texture);
     this->renderer.unregister_texture(this->folder_texture);
     this->renderer.unregister_texture(this->recent_texture);
     this->renderer.unregister_texture(this->sd_texture);
     this->renderer.unregister_texture(this->usb_texture);
     this->renderer.unregister_texture(this->network_texture);
+
+    for (auto &slot: this->thumbnail_slots) {
+        if (slot.texture.handle != static_cast<DkResHandle>(-1))
+            this->renderer.unregister_texture(slot.texture);
+    }
+}
+
+void Explorer::scan_thread_fn(std::stop_token token, ScanJob &job) {
+    SW_SCOPEGUARD([&job] { job.done = true; });
+
+    auto priority = fs::IoScheduler::ScopedPriority(fs::IoScheduler::Priority::Interactive);
+
+    auto *dir = opendir(job.path.c_str());
+    if (!dir) {
+        job.error = errno;
+        std::printf("Failed to open directory %s: %s (%d)\n", job.path.c_str(), std::strerror(job.error), job.error);
+        return;
+    }
+    SW_SCOPEGUARD([dir] { closedir(dir); });
+
+    auto *reent    = __syscall_getreent();
+    auto *devoptab = devoptab_list[dir->dirData->device];
+
+    // Hack to support the recent filesystem: NAME_MAX is sufficient in theory,
+    // but this fs returns full paths
+    // PATH_MAX on devkitA64 is just 1024 but linux allows 4096
+    // On top of that, reserve some space for the mountpoint
+    std::string fname;
+    fname.reserve(4096+1+0x20);
+
+    struct stat st;
+    while (!token.stop_requested()) {
+        std::memset(fname.data(), '\0', fname.capacity());
+
+        reent->deviceData = devoptab->deviceData;
+        if (devoptab->dirnext_r(reent, dir->dirData, fname.data(), &st))
+            break;
+
+        auto path = job.path / fname.c_str();
+
+        // Strip "recent:/" from path
+        if (job.is_recent)
+            path = path.internal().substr(1);
+
+        // In the recent filesystem multiple files might have the same name
+        auto name = std::string(path.filename()) + "##" + path.base();
+
+        auto lk = std::scoped_lock(job.mutex);
+        if (S_ISDIR(st.st_mode))
+            job.pending.emplace_back(fs::Node{fs::Node::Type::Directory, std::move(name)});
+        else
+            job.pending.emplace_back(fs::Node{fs::Node::Type::File, std::move(name), std::size_t(st.st_size), st.st_mtime});
+    }
+}
+
+void Explorer::start_scan() {
+    this->cancel_scan();
+
+    this->entries.clear();
+    this->cur_focused_entry = -1;
+
+    this->want_focus_reset = !this->is_initial_scan;
+    this->is_initial_scan  = false;
+
+    this->scan = std::make_unique<ScanJob>();
+    this->scan->path      = this->path;
+    this->scan->is_recent = this->context.cur_fs->type == fs::Filesystem::Type::Recent;
+    this->scan->thread    = std::jthread(&Explorer::scan_thread_fn, std::ref(*this->scan));
+
+    // The listing only shows recorded attributes, refresh them on the side
+    if (this->scan->is_recent)
+        static_cast<fs::RecentFs &>(*this->context.cur_fs).revalidate(this->context.get_filesystems());
+}
+
+void Explorer::cancel_scan() {
+    if (!this->scan)
+        return;
+
+    // Don't wait for the current network call, the job stops before reading another entry
+    // Parked in the context, so that leaving the menu doesn't wait for it either
+    this->scan->thread.request_stop();
+    this->context.parked_scans.park(std::move(this->scan));
+}
+
+void Explorer::collect_scan() {
+    this->context.parked_scans.reap();
+
+    if (!this->scan)
+        return;
+
+    // Read before draining, so that entries pushed right before completion aren't missed
+    bool done = this->scan->done;
+
+    std::vector<fs::Node> batch;
+    {
+        auto lk = std::scoped_lock(this->scan->mutex);
+        batch.swap(this->scan->pending);
+    }
+
+    if (!batch.empty()) {
+        auto mid = this->entries.insert(this->entries.end(),
+            std::make_move_iterator(batch.begin()), std::make_move_iterator(batch.end()));
+
+        // The recent filesystem lists in chronological order, otherwise merge the sorted batch
+        if (!this->scan->is_recent) {
+            std::sort(mid, this->entries.end(), node_compare);
+            std::inplace_merge(this->entries.begin(), mid, this->entries.end(), node_compare);
+        }
+    }
+
+    if (done) {
+        if (this->scan->error)
+            this->context.set_error(this->scan->error);
+        this->scan.reset();
+    }
 }
 
 bool Explorer::update_state(PadState &pad, HidTouchScreenState &touch) {
@@ -58,64 +187,70 @@ bool Explorer::update_state(PadState &pad, HidTouchScreenState &touch) {
         this->need_directory_scan = false;
         this->context.cur_path = this->path.base();
 
-        auto *dir = opendir(this->path.c_str());
-        if (dir) {
-            SW_SCOPEGUARD([dir] { closedir(dir); });
-            this->entries.clear();
-
-            auto *reent    = __syscall_getreent();
-            auto *devoptab = devoptab_list[dir->dirData->device];
+        this->start_scan();
+    }
 
-            // Hack to support the recent filesystem: NAME_MAX is sufficient in theory,
-            // but this fs returns full paths
-            // PATH_MAX on devkitA64 is just 1024 but linux allows 4096
-            // On top of that, reserve some space for the mountpoint
-            std::string fname;
-            fname.reserve(4096+1+0x20);
+    this->collect_scan();
 
-            struct stat st;
-            while (true) {
-                std::memset(fname.data(), '\0', fname.capacity());
+    // Uploads stall the GPU queue, spread them over several frames
+    for (std::size_t i = 0; i < std::min(this->pending_uploads.size(), MaxUploadsPerFrame); ++i) {
+        auto &thumbnail = this->pending_uploads[i];
 
-                reent->deviceData = devoptab->deviceData;
-                if (devoptab->dirnext_r(reent, dir->dirData, fname.data(), &st))
-                    break;
+        // Slots drawn in the last frames may still be sampled by the GPU
+        auto it = std::min_element(this->thumbnail_slots.begin(), this->thumbnail_slots.end(), [](auto &a, auto &b) {
+            return a.last_used_frame < b.last_used_frame;
+        });
+        if (it->source && it->last_used_frame + Renderer::NumSwapchainImages >= this->frame_counter)
+            break;
 
-                auto path = this->path / fname.c_str();
+        if (it->texture.handle == static_cast<DkResHandle>(-1)) {
+            it->texture = this->renderer.create_texture(ThumbnailGenerator::Width, ThumbnailGenerator::Height,
+                DkImageFormat_RGB_BC1, DkImageFlags_Usage2DEngine);
+            if (it->texture.handle == static_cast<DkResHandle>(-1))
+                break;
+        }
 
-                // Strip "recent:/" from path
-                if (this->context.cur_fs->type == fs::Filesystem::Type::Recent)
-                    path = path.internal().substr(1);
+        it->source.reset();
+        if (this->renderer.upload_texture(it->texture, thumbnail->data.data(), thumbnail->data.size(),
+                ThumbnailGenerator::Width, ThumbnailGenerator::Height))
+            break;
 
-                // In the recent filesystem multiple files might have the same name
-                auto name = std::string(path.filename()) + "##" + path.base();
+        it->source          = thumbnail;
+        it->last_used_frame = this->frame_counter;
+    }
 
-                if (S_ISDIR(st.st_mode))
-                    this->entries.emplace_back(fs::Node{fs::Node::Type::Directory, std::move(name)});
-                else
-                    this->entries.emplace_back(fs::Node{fs::Node::Type::File, std::move(name), std::size_t(st.st_size)});
-            }
+    // Entries still visible will be requested again during the next frame
+    this->pending_uploads.clear();
 
-            if (this->context.cur_fs->type != fs::Filesystem::Type::Recent) {
-                std::sort(this->entries.begin(), this->entries.end(), [](const fs::Node &lhs, const fs::Node &rhs) {
-                    if (lhs.type != rhs.type)
-                        return lhs.type < rhs.type;
-                    return strcasecmp(lhs.name.c_str(), rhs.name.c_str()) < 0;
-                });
-            }
+    return true;
+}
 
-            this->want_focus_reset = !this->is_initial_scan;
-            this->is_initial_scan  = false;
-        } else {
-            std::printf("Failed to open directory %s: %s (%d)\n", this->path.c_str(), std::strerror(errno), errno);
-            this->context.set_error(errno);
-        }
+const Renderer::Texture *Explorer::get_thumbnail(const fs::Node &entry) {
+    auto path = Explorer::path_from_entry_name(entry.name);
+    if (entry.type != fs::Node::Type::File || !is_media_file(path))
+        return nullptr;
+
+    auto thumbnail = this->context.thumbnails.get(path, entry.size, entry.mtime);
+    if (!thumbnail || thumbnail->data.empty())
+        return nullptr;
+
+    auto it = std::find_if(this->thumbnail_slots.begin(), this->thumbnail_slots.end(), [&thumbnail](auto &slot) {
+        return slot.source == thumbnail;
+    });
+    if (it != this->thumbnail_slots.end()) {
+        it->last_used_frame = this->frame_counter;
+        return &it->texture;
     }
 
-    return true;
+    if (std::find(this->pending_uploads.begin(), this->pending_uploads.end(), thumbnail) == this->pending_uploads.end())
+        this->pending_uploads.push_back(std::move(thumbnail));
+
+    return nullptr;
 }
 
 void Explorer::render() {
+    ++this->frame_counter;
+
     {
         ImGui::PushItemWidth(this->screen_rel_width(0.15));
         SW_SCOPEGUARD([] { ImGui::PopItemWidth(); });
@@ -123,7 +258,7 @@ void Explorer::render() {
         if (ImGui::BeginCombo("##fscombo", this->context.cur_fs->name.data())) {
             SW_SCOPEGUARD([] { ImGui::EndCombo(); });
 
-            for (auto &fs: this->context.filesystems) {
+            for (auto &fs: this->context.get_filesystems()) {
                 Renderer::Texture *tex;
                 switch (fs->type) {
                     using enum fs::Filesystem::Type;
@@ -194,9 +329,16 @@ void Explorer::render() {
         while (clipper.Step()) {
             for (auto i = clipper.DisplayStart; i < clipper.DisplayEnd; ++i) {
                 auto &entry = this->entries[i];
-                ImGui::Image(ImGui::deko3d::makeTextureID((entry.type == fs::Node::Type::File) ?
-                        this->file_texture.handle : this->folder_texture.handle, true),
-                    ImVec2(ImGui::GetFontSize(), ImGui::GetFontSize()), ImVec2(0, 0), ImVec2(1, 1), tint_col);
+                if (auto *thumbnail = this->get_thumbnail(entry); thumbnail) {
+                    // Crop the center square of the picture
+                    constexpr auto crop = (1.0f - float(ThumbnailGenerator::Height) / ThumbnailGenerator::Width) / 2;
+                    ImGui::Image(ImGui::deko3d::makeTextureID(thumbnail->handle),
+                        ImVec2(ImGui::GetFontSize(), ImGui::GetFontSize()), ImVec2(crop, 0), ImVec2(1 - crop, 1));
+                } else {
+                    ImGui::Image(ImGui::deko3d::makeTextureID((entry.type == fs::Node::Type::File) ?
+                            this->file_texture.handle : this->folder_texture.handle, true),
+                        ImVec2(ImGui::GetFontSize(), ImGui::GetFontSize()), ImVec2(0, 0), ImVec2(1, 1), tint_col);
+                }
                 ImGui::SameLine();
 
                 want_explore_forward |= ImGui::Selectable(entry.name.c_str());
@@ -235,7 +377,16 @@ void Explorer::render() {
     }
 
     ImGui::SetCursorPos(ImGui::GetCursorPos() + ImVec2(this->screen_rel_width(0.2), ImGui::GetStyle().ItemSpacing.y));
-    ImGui::Text("Navigate with \ue0ea");
+    if (this->scan) {
+        constexpr auto spinner = std::string_view("|/-\\");
+        ImGui::Text("%c Loading (%zu entries)", spinner[std::size_t(ImGui::GetTime() * 8) % spinner.size()],
+            this->entries.size());
+        ImGui::SameLine();
+        if (ImGui::SmallButton("Cancel"))
+            this->cancel_scan();
+    } else {
+        ImGui::Text("Navigate with \ue0ea");
+    }
 }
 
 } // namespace sw::ui
@@ -1,8 +1,16 @@
 #pragma once
 
+#include <array>
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
 #include <switch.h>
 
 #include "render.hpp"
+#include "thumbnail.hpp"
 #include "ui/ui_common.hpp"
 
 namespace sw::ui {
@@ -24,6 +32,40 @@ class Explorer: public Widget {
             return name.substr(0, name.find("##"));
         }
 
+        // Returns the texture holding the thumbnail of a media file, or nullptr if it isn't ready yet
+        // Thumbnails are uploaded during update_state, so this should be called every frame the entry is visible
+        const Renderer::Texture *get_thumbnail(const fs::Node &entry);
+
+    private:
+        // Directory listing running in the background, entries are handed over to the UI thread as they arrive
+        struct ScanJob {
+            fs::Path path;
+            bool is_recent;
+
+            std::mutex mutex;
+            std::vector<fs::Node> pending;
+            int error = 0;
+
+            std::atomic_bool done = false;
+            std::jthread thread;
+        };
+
+        // Texture of a recently displayed thumbnail
+        struct ThumbnailSlot {
+            Renderer::Texture texture;
+            std::shared_ptr<const ThumbnailGenerator::Thumbnail> source;
+            std::uint64_t last_used_frame = 0;
+        };
+
+        constexpr static std::size_t NumThumbnailSlots  = 16;
+        constexpr static std::size_t MaxUploadsPerFrame = 2;
+
+        static void scan_thread_fn(std::stop_token token, ScanJob &job);
+
+        void start_scan();
+        void cancel_scan();
+        void collect_scan();
+
     public:
         Context &context;
 
@@ -41,6 +83,13 @@ class Explorer: public Widget {
         bool is_initial_scan     = true;
         bool need_directory_scan = true;
         bool want_focus_reset    = false;
+
+    private:
+        std::unique_ptr<ScanJob> scan;
+
+        std::array<ThumbnailSlot, NumThumbnailSlots> thumbnail_slots;
+        std::vector<std::shared_ptr<const ThumbnailGenerator::Thumbnail>> pending_uploads;
+        std::uint64_t frame_counter = 0;
 };
 
 } // namespace sw::ui
@@ -26,10 +26,7 @@
 #include <imgui_deko3d.h>
 
 extern "C" {
-#include <libavcodec/codec_desc.h>
 #include <libavformat/avformat.h>
-#include <libavutil/pixdesc.h>
-#include <libavutil/samplefmt.h>
 #include <libavcodec/version.h>
 #include <libavformat/version.h>
 #include <libavutil/version.h>
@@ -42,7 +39,7 @@ extern "C" {
 
 #include "utils.hpp"
 #include "fs/fs_recent.hpp"
-#include "fs/fs_http.hpp"
+#include "fs/fs_scheduler.hpp"
 
 #include "ui/ui_main_menu.hpp"
 
@@ -63,7 +60,8 @@ std::string_view app_version_str = "v" APP_VERSION,
 
 MainMenuGui::MainMenuGui(Renderer &renderer, Context &context):
         Widget(renderer), context(context),
-        explorer(renderer, context), editor(renderer, context), settings(renderer, context), infohelp(renderer) {
+        explorer(renderer, context), library(renderer, context), editor(renderer, context), settings(renderer, context),
+        infohelp(renderer) {
     // Enable nav highlight when booting
     auto &imctx   = *ImGui::GetCurrentContext();
     auto &imstyle = ImGui::GetStyle();
@@ -84,6 +82,7 @@ bool MainMenuGui::update_state(PadState &pad, HidTouchScreenState &touch) {
         return false;
 
     this->explorer.update_state(pad, touch);
+    this->library .update_state(pad, touch);
     this->editor  .update_state(pad, touch);
     this->settings.update_state(pad, touch);
     this->infohelp.update_state(pad, touch);
@@ -123,6 +122,11 @@ void MainMenuGui::render() {
             this->cur_tab = Tab::Explorer;
         }
 
+        if (ImGui::BeginTabItem("Library",  nullptr, ImGuiTabItemFlags_NoReorder)) {
+            SW_SCOPEGUARD([] { ImGui::EndTabItem(); });
+            this->cur_tab = Tab::Library;
+        }
+
         if (ImGui::BeginTabItem("Editor",     nullptr, ImGuiTabItemFlags_NoReorder)) {
             SW_SCOPEGUARD([] { ImGui::EndTabItem(); });
             this->cur_tab = Tab::ConfigEdit;
@@ -141,7 +145,7 @@ void MainMenuGui::render() {
         if (ImGui::TabItemButton("Exit", ImGuiTabItemFlags_NoReorder))
             this->context.want_quit = true;
 
-        this->explorer.is_displayed = this->editor.is_displayed =
+        this->explorer.is_displayed = this->library.is_displayed = this->editor.is_displayed =
             this->settings.is_displayed = this->infohelp.is_displayed = false;
 
         switch (this->cur_tab) {
@@ -150,6 +154,10 @@ void MainMenuGui::render() {
                 this->explorer.is_displayed = true;
                 this->explorer.render();
                 break;
+            case Tab::Library:
+                this->library.is_displayed  = true;
+                this->library.render();
+                break;
             case Tab::ConfigEdit:
                 this->editor.is_displayed   = true;
                 this->editor.render();
@@ -224,102 +232,36 @@ void MainMenuGui::render() {
 }
 
 void MediaExplorer::metadata_thread_fn(std::stop_token token) {
+    // Probing must not delay playback or browsing on the same share
+    auto priority = fs::IoScheduler::ScopedPriority(fs::IoScheduler::Priority::Background);
+
     while (!token.stop_requested()) {
+        std::string entry_path;
+        std::uint64_t entry_size;
+        std::int64_t  entry_mtime;
         {
             auto lk = std::unique_lock(this->metadata_query_mutex);
             if (this->metadata_query_condvar.wait_for(lk, 100ms) == std::cv_status::timeout)
                 continue;
-        }
-
-        auto *entry = this->metadata_query_node;
-        MediaMetadata media_info = {};
-
-        if (entry) {
-            auto entry_path = Explorer::path_from_entry_name(entry->name);
-
-            // For HTTP filesystems, pass the URL directly to avformat (ffmpeg supports HTTP natively)
-            std::string path;
-            AVDictionary *format_opts = nullptr;
-            SW_SCOPEGUARD([&format_opts] { av_dict_free(&format_opts); });
-            if (auto *fs_ptr = this->context.get_filesystem(fs::Path::mountpoint(entry_path));
-                    fs_ptr && fs_ptr->type == fs::Filesystem::Type::Network) {
-                auto *net_fs = static_cast<const fs::NetworkFilesystem *>(fs_ptr);
-                if (net_fs->protocol == fs::NetworkFilesystem::Protocol::Http ||
-                        net_fs->protocol == fs::NetworkFilesystem::Protocol::Https) {
-                    path = static_cast<const fs::HttpFs *>(net_fs)->make_url(entry_path);
-                    av_dict_set(&format_opts, "auth_type", "basic", 0);
-                    av_dict_set(&format_opts, "user_agent", "SwitchWave/1.0", 0);
-                }
-            }
 
-            // Add explicit protocol prefix, otherwise ffmpeg confuses the mountpoint for a protocol
-            if (path.empty())
-                path = std::string("file:") + entry_path.data();
-
-            auto *avformat_ctx = avformat_alloc_context();
-            SW_SCOPEGUARD([&avformat_ctx] { avformat_close_input(&avformat_ctx); });
-            if (!avformat_ctx)
-                goto end;
-
-            if (auto rc = avformat_open_input(&avformat_ctx, path.c_str(), nullptr, &format_opts); rc) {
-                char buf[AV_ERROR_MAX_STRING_SIZE];
-                std::printf("Failed to open input %s: %s\n", path.c_str(), av_make_error_string(buf, sizeof(buf), rc));
-                this->context.set_error(rc, Context::ErrorType::LibAv);
-                goto end;
-            }
+            entry_path  = this->metadata_query_path;
+            entry_size  = this->metadata_query_size;
+            entry_mtime = this->metadata_query_mtime;
+        }
 
-            media_info.container_name = avformat_ctx->iformat->long_name;
+        MediaInfo media_info = {};
 
-            if (auto rc = avformat_find_stream_info(avformat_ctx, nullptr); rc) {
-                char buf[AV_ERROR_MAX_STRING_SIZE];
-                std::printf("Failed to match format for %s: %s\n", path.c_str(), av_make_error_string(buf, sizeof(buf), rc));
+        if (!entry_path.empty()) {
+            if (auto rc = this->context.media_cache.probe(entry_path, entry_size, entry_mtime, media_info, token); rc)
                 this->context.set_error(rc, Context::ErrorType::LibAv);
-                goto end;
-            }
 
-            media_info.duration    = (avformat_ctx->duration > 0) ? avformat_ctx->duration / AV_TIME_BASE : 0;
-            media_info.num_streams = avformat_ctx->nb_streams;
-
-            for (std::size_t i = 0; i < avformat_ctx->nb_streams; ++i) {
-                auto *s    = avformat_ctx->streams[i];
-                auto *desc = avcodec_descriptor_get(s->codecpar->codec_id);
-
-                switch (s->codecpar->codec_type) {
-                    case AVMEDIA_TYPE_VIDEO:
-                        if (!media_info.video_codec_name) {
-                            media_info.video_codec_name    = desc->long_name;
-                            media_info.video_profile_name  = desc->profiles ? desc->profiles[0].name : nullptr;
-                            media_info.video_width         = s->codecpar->width;
-                            media_info.video_height        = s->codecpar->height;
-                            media_info.video_framerate     = av_q2d(s->r_frame_rate);
-                            media_info.video_pix_format    = av_get_pix_fmt_name(AVPixelFormat(s->codecpar->format));
-                        }
-                        ++media_info.num_vstreams;
-                        break;
-                    case AVMEDIA_TYPE_AUDIO:
-                        if (!media_info.audio_codec_name) {
-                            media_info.audio_codec_name    = desc->long_name;
-                            media_info.audio_profile_name  = desc->profiles ? desc->profiles[0].name : nullptr;
-                            media_info.num_audio_channels  = s->codecpar->ch_layout.nb_channels;
-                            media_info.audio_sample_rate   = s->codecpar->sample_rate;
-                            media_info.audio_sample_format = av_get_sample_fmt_name(AVSampleFormat(s->codecpar->format));
-                        }
-                        ++media_info.num_astreams;
-                        break;
-                    case AVMEDIA_TYPE_SUBTITLE:
-                        ++media_info.num_sstreams;
-                        break;
-                    default:
-                        break;
-                }
-            }
-
-end:
-            if (this->metadata_query_node == entry && this->metadata_query_target)
+            auto lk = std::scoped_lock(this->metadata_query_mutex);
+            if (this->metadata_query_path == entry_path && this->metadata_query_target)
                 *this->metadata_query_target = media_info;
         }
 
-        this->metadata_query_node   = nullptr;
+        auto lk = std::scoped_lock(this->metadata_query_mutex);
+        this->metadata_query_path.clear();
         this->metadata_query_target = nullptr;
     }
 }
@@ -338,7 +280,8 @@ MediaExplorer::~MediaExplorer() {
 bool MediaExplorer::update_state(PadState &pad, HidTouchScreenState &touch) {
     bool scanning = this->explorer.need_directory_scan;
     if (scanning) {
-        this->metadata_query_node   = nullptr;
+        auto lk = std::scoped_lock(this->metadata_query_mutex);
+        this->metadata_query_path.clear();
         this->metadata_query_target = nullptr;
     }
 
@@ -347,7 +290,6 @@ bool MediaExplorer::update_state(PadState &pad, HidTouchScreenState &touch) {
     if (scanning) {
         this->context.cur_path = this->explorer.path.base();
         this->media_metadata.clear();
-        this->media_metadata.resize(this->explorer.entries.size());
     }
 
     return true;
@@ -379,6 +321,12 @@ void MediaExplorer::render() {
 
     ImGui::NewLine();
 
+    if (auto *thumbnail = this->explorer.get_thumbnail(entry); thumbnail) {
+        auto width = ImGui::GetContentRegionAvail().x;
+        ImGui::Image(ImGui::deko3d::makeTextureID(thumbnail->handle),
+            ImVec2(width, width * ThumbnailGenerator::Height / ThumbnailGenerator::Width));
+    }
+
     auto fname = Explorer::filename_from_entry_name(entry.name);
     ImGui::TextWrapped("Name: %.*s", int(fname.length()), fname.data());
 
@@ -388,18 +336,34 @@ void MediaExplorer::render() {
     auto [size, suffix] = utils::to_human_size(entry.size);
     ImGui::Text("Size: %.2f%s", size, suffix.data());
 
+    auto &metadata   = this->media_metadata[entry.name];
+    auto  entry_path = Explorer::path_from_entry_name(entry.name);
+
+    if (fs::RecentFs::Entry recent; this->context.cur_fs->type == fs::Filesystem::Type::Recent &&
+            static_cast<fs::RecentFs &>(*this->context.cur_fs).lookup(entry_path, recent)) {
+        if (recent.duration > 0)
+            ImGui::Text("Position: %02u:%02u:%02u / %02u:%02u:%02u",
+                FORMAT_TIME(std::uint32_t(recent.position)), FORMAT_TIME(std::uint32_t(recent.duration)));
+        if (recent.stale)
+            ImGui::TextWrapped("This file was modified or deleted since it was played");
+    }
+
     ImGui::NewLine();
 
-    auto &metadata = this->media_metadata[ent_idx];
+    // Results of earlier probes are shown right away
+    if (MediaInfo info; !metadata && this->context.media_cache.lookup(entry_path, entry.size, entry.mtime, info))
+        metadata = std::make_unique<MediaInfo>(info);
+
     if (!metadata) {
         bool ret = ImGui::Button("Press \ue0e6/\ue0e7 to show metadata", ImVec2(-1, 0));
         if (ret || ImGui::IsKeyPressed(ImGuiKey_GamepadL2) || ImGui::IsKeyPressed(ImGuiKey_GamepadR2)) {
-            metadata = std::make_unique<MediaMetadata>();
-
-            this->metadata_query_node   = &entry;
-            this->metadata_query_target = metadata.get();
+            metadata = std::make_unique<MediaInfo>();
 
             auto lk = std::unique_lock(this->metadata_query_mutex);
+            this->metadata_query_path   = entry_path;
+            this->metadata_query_size   = entry.size;
+            this->metadata_query_mtime  = entry.mtime;
+            this->metadata_query_target = metadata.get();
             this->metadata_query_condvar.notify_one();
         }
         return;
@@ -427,19 +391,196 @@ void MediaExplorer::render() {
     if (i.video_profile_name) bullet_wrapped("Profile: %s", i.video_profile_name);
     bullet_wrapped("Dimensions: %dx%d", i.video_width, i.video_height);
     bullet_wrapped("Framerate: %.3fHz", i.video_framerate);
-    bullet_wrapped("Pixel format: %s", i.video_pix_format);
+    if (i.video_pix_format) bullet_wrapped("Pixel format: %s", i.video_pix_format);
 
     ImGui::SeparatorText("Audio");
     bullet_wrapped("%d stream%s", i.num_astreams, i.num_astreams != 1 ? "s" : "");
     bullet_wrapped("Codec: %s (%d channels)", i.audio_codec_name, i.num_audio_channels);
     if (i.audio_profile_name) bullet_wrapped("Profile: %s", i.audio_profile_name);
     bullet_wrapped("Samplerate: %dHz", i.audio_sample_rate);
-    bullet_wrapped("Sample format: %s", i.audio_sample_format);
+    if (i.audio_sample_format) bullet_wrapped("Sample format: %s", i.audio_sample_format);
 
     ImGui::SeparatorText("Subtitles");
     bullet_wrapped("%d stream%s", i.num_sstreams, i.num_sstreams != 1 ? "s" : "");
 }
 
+LibraryView::LibraryView(Renderer &renderer, Context &context): Widget(renderer), context(context) {
+    LibraryView::s_this = this;
+}
+
+LibraryView::~LibraryView() {
+    swkbdInlineSetChangedStringCallback(ImGui::nx::getSwkbd(), nullptr);
+    swkbdInlineSetMovedCursorCallback  (ImGui::nx::getSwkbd(), nullptr);
+    swkbdInlineSetDecidedEnterCallback (ImGui::nx::getSwkbd(), nullptr);
+    swkbdInlineSetDecidedCancelCallback(ImGui::nx::getSwkbd(), nullptr);
+    swkbdInlineSetInputText(ImGui::nx::getSwkbd(), "");
+    swkbdInlineSetCursorPos(ImGui::nx::getSwkbd(), 0);
+}
+
+void LibraryView::install_swkbd_callbacks(SwkbdInline *swkbd) {
+    swkbdInlineSetChangedStringCallback(ImGui::nx::getSwkbd(), +[](const char *str, SwkbdChangedStringArg *arg) {
+        if (arg->stringLen <= s_this->query.capacity())
+            s_this->query = str;
+
+        s_this->cursor_pos         = arg->cursorPos;
+        s_this->want_cursor_update = true;
+        s_this->want_query         = true;
+    });
+
+    swkbdInlineSetMovedCursorCallback(ImGui::nx::getSwkbd(), +[](const char *str, SwkbdMovedCursorArg *arg) {
+        if (arg->cursorPos == s_this->cursor_pos)
+            return;
+
+        s_this->cursor_pos         = arg->cursorPos;
+        s_this->want_cursor_update = true;
+    });
+
+    swkbdInlineSetDecidedEnterCallback(ImGui::nx::getSwkbd(), +[](const char *str, SwkbdDecidedEnterArg *arg) {
+        s_this->cursor_pos         = 0;
+        s_this->want_cursor_update = true;
+
+        // Exit input box
+        ImGui::GetCurrentContext()->ActiveId = 0;
+    });
+
+    swkbdInlineSetDecidedCancelCallback(ImGui::nx::getSwkbd(), +[]() {
+        // Exit input box
+        ImGui::GetCurrentContext()->ActiveId = 0;
+    });
+}
+
+void LibraryView::reset_swkbd_state(SwkbdInline *swkbd) {
+    swkbdInlineMakeAppearArg(&this->appear_args, SwkbdType_Normal);
+    swkbdInlineAppearArgSetStringLenMax(&this->appear_args, this->query.capacity());
+    this->appear_args.dicFlag          = 0;
+    this->appear_args.returnButtonFlag = 0;
+
+    swkbdInlineSetKeytopBgAlpha(swkbd, 1.0f);
+    swkbdInlineSetFooterBgAlpha(swkbd, 1.0f);
+
+    swkbdInlineSetInputText(swkbd, this->query.c_str());
+}
+
+bool LibraryView::update_state(PadState &pad, HidTouchScreenState &touch) {
+    if (!this->is_displayed && this->has_swkbd_visible) {
+        ImGui::nx::hideSwkbd();
+        this->has_swkbd_visible = false;
+    }
+
+    // Search again when an update completes
+    if (auto index = this->context.library.snapshot(); index != this->index) {
+        this->index      = std::move(index);
+        this->want_query = true;
+    }
+
+    if (this->want_query) {
+        this->results    = this->index ? this->index->search(this->query, LibraryView::MaxResults) :
+            std::vector<const Library::Record *>();
+        this->want_query = false;
+    }
+
+    return true;
+}
+
+void LibraryView::render() {
+    auto &library = this->context.library;
+
+    ImGui::PushItemWidth(this->screen_rel_width(0.6));
+    ImGui::InputTextWithHint("##librarysearch", "Search", this->query.data(), this->query.capacity(),
+        ImGuiInputTextFlags_ReadOnly | ImGuiInputTextFlags_CallbackAlways,
+        +[](ImGuiInputTextCallbackData *data) -> int {
+            auto *self = static_cast<LibraryView *>(data->UserData);
+
+            if (self->want_cursor_update) {
+                data->CursorPos          = self->cursor_pos;
+                self->want_cursor_update = false;
+            }
+
+            if (data->CursorPos != self->cursor_pos)
+                swkbdInlineSetCursorPos(ImGui::nx::getSwkbd(), data->CursorPos);
+
+            self->cursor_pos = data->CursorPos;
+            data->ClearSelection();
+
+            return 0;
+    }, this);
+    ImGui::PopItemWidth();
+
+    auto is_input_active = ImGui::IsItemActive();
+    if (is_input_active && !this->has_swkbd_visible) {
+        this->install_swkbd_callbacks(ImGui::nx::getSwkbd());
+        this->reset_swkbd_state(ImGui::nx::getSwkbd());
+
+        ImGui::nx::showSwkbd(&this->appear_args);
+        this->has_swkbd_visible = true;
+    } else if (!is_input_active && this->has_swkbd_visible) {
+        ImGui::nx::hideSwkbd();
+        this->has_swkbd_visible = false;
+    }
+
+    ImGui::SameLine();
+    if (library.is_updating()) {
+        auto &progress = library.progress();
+
+        constexpr auto spinner = std::string_view("|/-\\");
+        ImGui::Text("%c Indexing (%u directories, %u files, %u probed)",
+            spinner[std::size_t(ImGui::GetTime() * 8) % spinner.size()],
+            progress.num_dirs.load(), progress.num_files.load(), progress.num_probed.load());
+        ImGui::SameLine();
+        if (ImGui::SmallButton("Cancel"))
+            library.cancel_update();
+    } else if (ImGui::Button("Update")) {
+        library.update(this->context.get_filesystems(), this->context.media_cache);
+    }
+
+    auto reserved_height = ImGui::GetStyle().ItemSpacing.y + ImGui::GetTextLineHeightWithSpacing();
+
+    if (ImGui::BeginListBox("##libraryentries", ImVec2(-1, -reserved_height))) {
+        SW_SCOPEGUARD([] { ImGui::EndListBox(); });
+
+        ImGuiListClipper clipper;
+        clipper.Begin(this->results.size());
+
+        while (clipper.Step()) {
+            for (auto i = clipper.DisplayStart; i < clipper.DisplayEnd; ++i) {
+                auto &record = *this->results[i];
+                auto path    = this->index->path(record);
+
+                // Entries of shares that aren't mounted are still listed, but can't be played
+                bool is_available = !!this->context.get_filesystem(fs::Path::mountpoint(path));
+
+                ImGui::PushID(i);
+                SW_SCOPEGUARD([] { ImGui::PopID(); });
+
+                // Paths are NUL-terminated in the string pool of the index
+                auto fname = fs::Path::filename(path);
+                if (ImGui::Selectable(fname.data(), false, is_available ? 0 : ImGuiSelectableFlags_Disabled))
+                    this->context.cur_file = path;
+
+                ImGui::SameLine(this->screen_rel_width(0.6));
+                if (record.flags & Library::Record::Probed) {
+                    if (record.width && record.height)
+                        ImGui::TextDisabled("%ux%u  %u:%02u:%02u", record.width, record.height,
+                            FORMAT_TIME(record.duration));
+                    else
+                        ImGui::TextDisabled("%u:%02u:%02u", FORMAT_TIME(record.duration));
+                } else {
+                    auto [size, suffix] = utils::to_human_size(record.size);
+                    ImGui::TextDisabled("%.2f%s", size, suffix.data());
+                }
+            }
+        }
+    }
+
+    ImGui::SetCursorPos(ImGui::GetCursorPos() + ImVec2(this->screen_rel_width(0.2), ImGui::GetStyle().ItemSpacing.y));
+    if (!this->index || this->index->records().empty())
+        ImGui::Text("The library is empty, press Update to index mounted filesystems");
+    else if (this->results.size() >= LibraryView::MaxResults)
+        ImGui::Text("Showing the first %zu matches of %zu files", this->results.size(), this->index->records().size());
+    else
+        ImGui::Text("%zu matches in %zu files", this->results.size(), this->index->records().size());
+}
+
 ConfigEditor::ConfigEditor(Renderer &renderer, Context &context): Widget(renderer), context(context) {
     ConfigEditor::s_this = this;
 
@@ -845,6 +986,11 @@ void SettingsEditor::render() {
             ImVec4 tint_col = (ImGui::nx::getCurrentTheme() == ColorSetId_Dark) ?
                 ImVec4(1, 1, 1, 1) : ImVec4(0, 0, 0, 1);
 
+            // The share is being mounted in the background, its info must stay alive and unchanged until that finishes
+            bool is_connecting = info->connecting;
+            ImGui::BeginDisabled(is_connecting);
+            SW_SCOPEGUARD([] { ImGui::EndDisabled(); });
+
             ImGui::TableNextColumn();
             bool ret = ImGui::ImageButton(make_id(i, "##deletebtn"),
                 ImGui::deko3d::makeTextureID(this->delete_texture.handle, true),
@@ -878,8 +1024,10 @@ void SettingsEditor::render() {
                 }
             }
 
+            auto net_fs = this->context.get_network_fs(*info);
+
             ImGui::TableNextColumn();
-            if (input_with_swkbd(i, "##nameinput", info->fs_name) && info->fs)
+            if (input_with_swkbd(i, "##nameinput", info->fs_name) && net_fs)
                 this->context.unregister_network_fs(*info);
 
             ImGui::TableNextColumn();
@@ -898,8 +1046,10 @@ void SettingsEditor::render() {
             input_with_swkbd(i, "##passwordinput", info->password, ImGuiInputTextFlags_Password);
 
             ImGui::TableNextColumn();
-            bool is_connected = info->fs && info->fs->connected();
-            if (ImGui::Button(make_id(i, !is_connected ? "Connect" : "Disconnect"))) {
+            bool is_connected = net_fs && net_fs->connected();
+            if (is_connecting)
+                ImGui::Button(make_id(i, "Connecting"));
+            else if (ImGui::Button(make_id(i, !is_connected ? "Connect" : "Disconnect"))) {
                 int ret;
                 if (!is_connected)
                     ret = this->context.register_network_fs  (*info);
@@ -953,9 +1103,9 @@ void SettingsEditor::render() {
     }
 
     if (ImGui::Button("Clear history")) {
-        for (auto &fs: this->context.filesystems) {
+        for (auto &fs: this->context.get_filesystems()) {
             if (fs->type == fs::Filesystem::Type::Recent)
-                reinterpret_cast<fs::RecentFs *>(fs.get())->clear();
+                static_cast<fs::RecentFs *>(fs.get())->clear();
         }
     }
 
@@ -1000,10 +1150,13 @@ void SettingsEditor::render() {
 
             ImGui::TableNextColumn();
             if (ImGui::Button(make_id(i, "Unmount"))) {
-                std::erase_if(this->context.filesystems, [&dev](const auto &fs) {
-                    return dev.mount_name == fs->mount_name;
-                });
-                this->context.cur_fs = this->context.filesystems.front();
+                {
+                    auto lk = std::scoped_lock(this->context.filesystems_mutex);
+                    std::erase_if(this->context.filesystems, [&dev](const auto &fs) {
+                        return dev.mount_name == fs->mount_name;
+                    });
+                    this->context.cur_fs = this->context.filesystems.front();
+                }
 
                 context.ums.unmount_device(dev);
             }
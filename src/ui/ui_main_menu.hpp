@@ -21,12 +21,14 @@
 #include <string>
 #include <string_view>
 #include <thread>
+#include <unordered_map>
 #include <vector>
 
 #include <switch.h>
 #include <imgui.h>
 
 #include "context.hpp"
+#include "media_probe.hpp"
 #include "fs/fs_common.hpp"
 #include "ui/ui_common.hpp"
 #include "ui/ui_explorer.hpp"
@@ -48,21 +50,6 @@ class MediaExplorer final: public Widget {
     public:
         bool is_displayed = false;
 
-    private:
-        struct MediaMetadata {
-            const char *container_name = nullptr;
-            std::uint32_t num_streams, num_vstreams, num_astreams, num_sstreams;
-            std::int64_t duration;
-            const char *video_codec_name, *video_profile_name;
-            int video_width, video_height;
-            double video_framerate;
-            const char *video_pix_format;
-            const char *audio_codec_name, *audio_profile_name;
-            int num_audio_channels;
-            int audio_sample_rate;
-            const char *audio_sample_format;
-        };
-
     private:
         Context &context;
         Explorer explorer;
@@ -70,10 +57,13 @@ class MediaExplorer final: public Widget {
         std::jthread metadata_thread;
         std::mutex metadata_query_mutex;
         std::condition_variable metadata_query_condvar;
-        fs::Node      *metadata_query_node   = nullptr;
-        MediaMetadata *metadata_query_target = nullptr;
+        std::string    metadata_query_path;
+        std::uint64_t  metadata_query_size  = 0;
+        std::int64_t   metadata_query_mtime = 0;
+        MediaInfo     *metadata_query_target = nullptr;
 
-        std::vector<std::unique_ptr<MediaMetadata>> media_metadata;
+        // Keyed by entry name, since entries move around while the directory scan progresses
+        std::unordered_map<std::string, std::unique_ptr<MediaInfo>> media_metadata;
 };
 
 class ConfigEditor final: public Widget {
@@ -166,6 +156,42 @@ class InfoHelp final: public Widget {
         bool is_displayed = false;
 };
 
+class LibraryView final: public Widget {
+    public:
+        constexpr static std::size_t MaxResults = 500;
+
+    public:
+        LibraryView(Renderer &renderer, Context &context);
+        virtual ~LibraryView();
+
+        virtual bool update_state(PadState &pad, HidTouchScreenState &touch) override;
+
+        virtual void render() override;
+
+    private:
+        void install_swkbd_callbacks(SwkbdInline *swkbd);
+        void reset_swkbd_state(SwkbdInline *swkbd);
+
+    public:
+        bool is_displayed = false;
+
+    private:
+        Context &context;
+
+        SwkbdAppearArg appear_args;
+        utils::StaticString64 query;
+
+        std::shared_ptr<const Library::Index> index;
+        std::vector<const Library::Record *> results;
+        bool want_query = true;
+
+        int cursor_pos          = 0;
+        bool want_cursor_update = false;
+        bool has_swkbd_visible  = false;
+
+        static inline LibraryView *s_this;
+};
+
 class MainMenuGui final: public Widget {
     public:
         MainMenuGui(Renderer &renderer, Context &context);
@@ -178,6 +204,7 @@ class MainMenuGui final: public Widget {
     private:
         enum class Tab {
             Explorer,
+            Library,
             ConfigEdit,
             Settings,
             InfoHelp,
@@ -189,6 +216,7 @@ class MainMenuGui final: public Widget {
         Tab cur_tab = Tab::Explorer;
 
         MediaExplorer   explorer;
+        LibraryView     library;
         ConfigEditor    editor;
         SettingsEditor  settings;
         InfoHelp        infohelp;
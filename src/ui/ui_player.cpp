@@ -16,6 +16,7 @@
 // along with SwitchWave.  If not, see <http://www.gnu.org/licenses/>.
 
 #include <algorithm>
+#include <cmath>
 #include <format>
 #include <tuple>
 #include <utility>
@@ -170,10 +171,41 @@ PlayerGui::PlayerGui(Renderer &renderer, Context &context, LibmpvController &lmp
     imstyle.Alpha = 0.8f;
 }
 
+void PlayerGui::update_prefetch() {
+    auto &playlist = this->menu.playlist_info;
+    auto cur = std::find_if(playlist.begin(), playlist.end(), [](auto &entry) { return entry.playing; });
+    if (cur == playlist.end())
+        return;
+
+    // Playback of the prefetched entry started, mpv holds its own handle now
+    if (this->context.prefetcher.target() == cur->filename) {
+        this->context.prefetcher.cancel();
+        return;
+    }
+
+    auto remaining = this->seek_bar.duration - this->seek_bar.time_pos;
+    if (!this->context.playlist_prefetch_size || this->seek_bar.duration <= 0 ||
+            remaining > PlayerGui::PlaylistPrefetchLead || cur + 1 == playlist.end())
+        return;
+
+    // Local storage is fast enough as is
+    auto *next_fs = this->context.get_filesystem(fs::Path::mountpoint((cur + 1)->filename));
+    if (!next_fs || next_fs->type != fs::Filesystem::Type::Network)
+        return;
+
+    // Stay well within the memory cache, so that playback blocks aren't evicted
+    auto budget = std::min(this->context.playlist_prefetch_size << 20,
+        fs::BlockCache::MaxBlocks * fs::BlockCache::BlockSize / 4);
+    this->context.prefetcher.prefetch((cur + 1)->filename, budget);
+}
+
 PlayerGui::~PlayerGui() {
     appletSetMediaPlaybackState(false);
 
     this->screenshot_button_thread.request_stop();
+
+    // The prefetcher outlives the player, so that a job stuck in a network call doesn't block leaving it
+    this->context.prefetcher.cancel();
 }
 
 bool PlayerGui::update_state(PadState &pad, HidTouchScreenState &touch) {
@@ -183,6 +215,8 @@ bool PlayerGui::update_state(PadState &pad, HidTouchScreenState &touch) {
     if (down & HidNpadButton_Plus && !ImGui::nx::isSwkbdVisible())
         return false;
 
+    this->seek_bar.preview_time = -1.0;
+
     // Can only run when the swkbd isn't shown so don't bother using ImGui API
     if (!(this->menu.is_visible || this->console.is_visible)) {
         if (!this->seek_bar.is_visible && (down & (HidNpadButton_A | HidNpadButton_X)))
@@ -240,6 +274,7 @@ bool PlayerGui::update_state(PadState &pad, HidTouchScreenState &touch) {
         this->set_show_string(1s, "%02u:%02u:%02u (%+.1fs)",
             FORMAT_TIME(std::uint32_t(this->seek_bar.duration * percent_pos / 100.0)), this->seek_bar.time_pos - this->js_time_start);
         this->lmpv.set_property_async("percent-pos", percent_pos);
+        this->seek_bar.preview_time = std::max(this->seek_bar.duration * percent_pos / 100.0, 0.0);
 
         if (this->seek_bar.is_visible && !this->seek_bar.ignore_input)
             this->seek_bar.begin_visible();
@@ -354,6 +389,7 @@ bool PlayerGui::update_state(PadState &pad, HidTouchScreenState &touch) {
                     this->set_show_string(1s, "%02u:%02u:%02u (%+.1fs)",
                         FORMAT_TIME(std::uint32_t(this->touch_setting_start.time_pos + time_pos)), time_pos);
                     this->lmpv.set_property_async("time-pos", this->touch_setting_start.time_pos + time_pos);
+                    this->seek_bar.preview_time = std::max(this->touch_setting_start.time_pos + time_pos, 0.0);
 
                     if (this->seek_bar.is_visible && !this->seek_bar.ignore_input)
                         this->seek_bar.begin_visible();
@@ -395,6 +431,8 @@ bool PlayerGui::update_state(PadState &pad, HidTouchScreenState &touch) {
 
     this->seek_bar.ignore_input = this->menu.is_visible || this->console.is_visible;
 
+    this->update_prefetch();
+
     return true;
 }
 
@@ -446,6 +484,12 @@ SeekBar::SeekBar(Renderer &renderer, Context &context, LibmpvController &lmpv):
     this->lmpv.observe_property("chapter",     &this->chapter);
     this->lmpv.observe_property("media-title", &this->media_title);
 
+    this->lmpv.observe_property("path", MPV_FORMAT_STRING, nullptr, +[](void *user, mpv_event_property *prop) {
+        auto *self = static_cast<SeekBar *>(user);
+        self->path = *static_cast<char **>(prop->data);
+        self->context.trickplay.start(self->path);
+    }, this);
+
     this->lmpv.observe_property("chapter-list", MPV_FORMAT_NODE, nullptr, +[](void *user, mpv_event_property *prop) {
         auto *self     = static_cast<SeekBar  *>(user);
         auto *node     = static_cast<mpv_node *>(prop->data);
@@ -496,11 +540,17 @@ SeekBar::~SeekBar() {
     this->lmpv.unobserve_property("chapter-list");
     this->lmpv.unobserve_property("demuxer-cache-state");
     this->lmpv.unobserve_property("media-title");
+    this->lmpv.unobserve_property("path");
+
+    this->context.trickplay.stop();
 
     this->renderer.unregister_texture(this->play_texture);
     this->renderer.unregister_texture(this->pause_texture);
     this->renderer.unregister_texture(this->next_texture);
     this->renderer.unregister_texture(this->previous_texture);
+
+    if (this->trickplay_texture.handle != static_cast<DkResHandle>(-1))
+        this->renderer.unregister_texture(this->trickplay_texture);
 }
 
 bool SeekBar::update_state(PadState &pad, HidTouchScreenState &touch) {
@@ -526,12 +576,61 @@ bool SeekBar::update_state(PadState &pad, HidTouchScreenState &touch) {
             this->is_visible = false, this->fadeio_alpha = 0.0f;
     }
 
+    // Uploads stall the GPU queue, only refresh the previews while they might be shown
+    auto atlas = this->context.trickplay.get();
+    if (!atlas) {
+        this->trickplay_atlas.reset();
+    } else if (atlas != this->trickplay_atlas && (this->is_visible || this->preview_time >= 0)) {
+        if (this->trickplay_texture.handle == static_cast<DkResHandle>(-1))
+            this->trickplay_texture = this->renderer.create_texture(TrickplayGenerator::AtlasWidth,
+                TrickplayGenerator::AtlasHeight, DkImageFormat_RGB_BC1, DkImageFlags_Usage2DEngine);
+
+        if (this->trickplay_texture.handle != static_cast<DkResHandle>(-1) &&
+                !this->renderer.upload_texture(this->trickplay_texture, atlas->data.data(), atlas->data.size(),
+                    TrickplayGenerator::AtlasWidth, TrickplayGenerator::AtlasHeight))
+            this->trickplay_atlas = std::move(atlas);
+    }
+
     return false;
 }
 
+void SeekBar::render_preview() {
+    if (this->preview_time < 0 || !this->trickplay_atlas || this->duration <= 0)
+        return;
+
+    auto tile = this->trickplay_atlas->find_tile(this->preview_time);
+    if (tile < 0)
+        return;
+
+    using Gen = TrickplayGenerator;
+
+    auto width  = this->screen_rel_width(SeekBar::PreviewWidth),
+         height = width * Gen::TileHeight / Gen::TileWidth;
+
+    auto bar_min_x = this->bar_min_x, bar_max_x = this->bar_max_x;
+    if (bar_max_x <= bar_min_x)
+        bar_min_x = 0.0f, bar_max_x = this->renderer.image_width;
+
+    auto center = std::lerp(bar_min_x, bar_max_x, float(std::clamp(this->preview_time / this->duration, 0.0, 1.0)));
+    auto min    = ImVec2(std::clamp(center - width / 2.0f, 0.0f, this->renderer.image_width - width),
+        this->renderer.image_height - this->screen_rel_height(SeekBar::BarHeight + SeekBar::SeekBarPadding) - height);
+    auto max    = min + ImVec2(width, height);
+
+    // Inset by half a texel, so that filtering doesn't bleed into neighbouring tiles
+    auto inset = ImVec2(0.5f / Gen::AtlasWidth, 0.5f / Gen::AtlasHeight);
+    auto uv0   = ImVec2(float(tile % Gen::Columns) / Gen::Columns, float(tile / Gen::Columns) / Gen::Rows);
+    auto uv1   = uv0 + ImVec2(1.0f / Gen::Columns, 1.0f / Gen::Rows);
+
+    auto *list = ImGui::GetForegroundDrawList();
+    list->AddImage(ImGui::deko3d::makeTextureID(this->trickplay_texture.handle), min, max, uv0 + inset, uv1 - inset);
+    list->AddRect(min, max, ImGui::GetColorU32(ImGuiCol_Button), 0, 0, SeekBar::SeekBarContourPx);
+}
+
 void SeekBar::render() {
-    if (!this->is_visible)
+    if (!this->is_visible) {
+        this->render_preview();
         return;
+    }
 
     auto &io    =  ImGui::GetIO();
     auto &style =  ImGui::GetStyle();
@@ -606,6 +705,8 @@ void SeekBar::render() {
     auto bb          = ImRect(scr_cursor, scr_cursor + ImVec2(this->screen_rel_width(SeekBar::SeekBarWidth), avail.y - SeekBar::SeekBarContourPx + 1));
     auto interior_bb = ImRect(bb.Min + seekbar_padding, bb.Max - seekbar_padding);
 
+    this->bar_min_x = interior_bb.Min.x, this->bar_max_x = interior_bb.Max.x;
+
     ImGui::ItemSize(bb);
     ImGui::ItemAdd(bb, ImGui::GetID("##seekbar"), nullptr, ImGuiItemFlags_Disabled);
 
@@ -620,7 +721,8 @@ void SeekBar::render() {
 
     if (io.MouseDown[0] && interior_bb.Contains(io.MousePos) && interior_bb.Contains(io.MouseClickedPos[0])) {
         this->begin_visible();
-        this->lmpv.set_property_async("time-pos", double(seekbar_pos_to_ts(io.MousePos.x)));
+        this->preview_time = seekbar_pos_to_ts(io.MousePos.x);
+        this->lmpv.set_property_async("time-pos", this->preview_time);
     }
 
     auto *list = ImGui::GetWindowDrawList();
@@ -651,6 +753,8 @@ void SeekBar::render() {
     // Total duration
     ImGui::SameLine(); ImGui::SetCursorPosY(text_ypos);
     ImGui::Text("%02u:%02u:%02u", FORMAT_TIME(std::uint32_t(this->duration)));
+
+    this->render_preview();
 }
 
 PlayerMenu::PlayerMenu(Renderer &renderer, Context &context, LibmpvController &lmpv):
@@ -731,9 +835,10 @@ PlayerMenu::PlayerMenu(Renderer &renderer, Context &context, LibmpvController &l
                  *title    = LibmpvController::node_map_find<char *>(entry, "title");
 
             auto track_info = PlaylistEntryInfo{
-                .name    =   title ?: fs::Path::filename(filename).data(),
-                .id      =   LibmpvController::node_map_find<std::int64_t> (entry, "id"),
-                .playing = !!LibmpvController::node_map_find<std::uint32_t>(entry, "current")
+                .name     =   title ?: fs::Path::filename(filename).data(),
+                .filename =   filename,
+                .id       =   LibmpvController::node_map_find<std::int64_t> (entry, "id"),
+                .playing  = !!LibmpvController::node_map_find<std::uint32_t>(entry, "current")
             };
 
             self->playlist_info.emplace_back(std::move(track_info));
@@ -948,7 +1053,21 @@ bool PlayerMenu::update_state(PadState &pad, HidTouchScreenState &touch) {
         this->is_visible ^= 1;
 
     if (now - this->last_stats_update > PlayerMenu::StatsRefreshInterval) {
+        auto elapsed = std::chrono::duration<double>(now - this->last_stats_update).count();
         this->last_stats_update = now;
+
+        if (auto *file_fs = this->context.get_filesystem(fs::Path::mountpoint(this->context.cur_file)); file_fs) {
+            auto read    = fs::IoStats::get(file_fs->stats.bytes_read);
+            auto fetched = fs::IoStats::get(file_fs->stats.bytes_fetched);
+
+            // Counters restart from a lower value when switching filesystem
+            this->io_read_speed  = read    >= this->io_last_read_bytes    ?
+                (read    - this->io_last_read_bytes)    / elapsed : 0;
+            this->io_fetch_speed = fetched >= this->io_last_fetched_bytes ?
+                (fetched - this->io_last_fetched_bytes) / elapsed : 0;
+
+            this->io_last_read_bytes = read, this->io_last_fetched_bytes = fetched;
+        }
         this->lmpv.get_property_async("vo-passes", MPV_FORMAT_NODE, nullptr, +[](void *user, mpv_event_property *prop) {
             auto *self   = static_cast<PlayerMenu *>(user);
             auto *node   = static_cast<mpv_node *>(prop->data);
@@ -1285,6 +1404,30 @@ void PlayerMenu::render() {
                 double(this->demuxer_forward_bytes)/0x100000);
             bullet_wrapped("Speed: %.2fMiB/s", this->demuxer_cache_speed/0x100000);
 
+            if (auto *file_fs = this->context.get_filesystem(fs::Path::mountpoint(this->context.cur_file)); file_fs) {
+                auto &stats = file_fs->stats;
+
+                ImGui::SeparatorText("Filesystem");
+                bullet_wrapped("Throughput: %.2fMiB/s read, %.2fMiB/s fetched",
+                    this->io_read_speed / 0x100000, this->io_fetch_speed / 0x100000);
+                bullet_wrapped("Total: %.2fMiB read, %.2fMiB fetched, %lu seeks",
+                    double(fs::IoStats::get(stats.bytes_read)) / 0x100000,
+                    double(fs::IoStats::get(stats.bytes_fetched)) / 0x100000, fs::IoStats::get(stats.seeks));
+                bullet_wrapped("Block cache: %lu hits, %lu misses (%lu from disk)", fs::IoStats::get(stats.cache_hits),
+                    fs::IoStats::get(stats.cache_misses), fs::IoStats::get(stats.disk_cache_hits));
+                bullet_wrapped("Errors: %lu", fs::IoStats::get(stats.errors));
+
+                for (std::size_t i = 0; i < static_cast<std::size_t>(fs::IoStats::Op::Max); ++i) {
+                    auto op    = static_cast<fs::IoStats::Op>(i);
+                    auto &hist = stats.latency(op);
+                    bullet_wrapped("%s: %lu ops, p50 %.2fms, p99 %.2fms, max %.2fms", fs::IoStats::op_name(op).data(),
+                        hist.count(), hist.percentile(0.5) / 1.0e3, hist.percentile(0.99) / 1.0e3, hist.max() / 1.0e3);
+                }
+
+                if (ImGui::Button("Dump to SD card"))
+                    this->context.dump_io_stats();
+            }
+
             ImGui::SeparatorText("Interface");
             bullet_wrapped("FPS: %.2fHz, frame time %.2fms", imio.Framerate, imio.DeltaTime * 1000.0f);
             bullet_wrapped("Vertices: %d", imio.MetricsRenderVertices);
@@ -85,6 +85,7 @@ class SeekBar final: public Widget {
         constexpr static float   SeekBarPadding       = 0.01;
         constexpr static float   SeekBarLinesWidthPx  = 2;
         constexpr static int     SeekBarPopButtons    = HidNpadButton_Left | HidNpadButton_Right;
+        constexpr static float   PreviewWidth         = 0.2;
 
     public:
         SeekBar(Renderer &renderer, Context &context, LibmpvController &lmpv);
@@ -120,10 +121,17 @@ class SeekBar final: public Widget {
         double       percent_pos = 0;
         std::int64_t chapter     = 0;
         char        *media_title = nullptr;
+        std::string  path;        // Playlist entry being played
 
         std::vector<ChapterInfo>   chapters;
         std::vector<SeekableRange> seekable_ranges;
 
+        // Position shown in the seek preview, set every frame while scrubbing, negative to hide it
+        double preview_time = -1.0;
+
+    private:
+        void render_preview();
+
     private:
         LibmpvController &lmpv;
         Context          &context;
@@ -134,6 +142,12 @@ class SeekBar final: public Widget {
         float fadeio_alpha = 0.0f;
 
         Renderer::Texture play_texture, pause_texture, previous_texture, next_texture;
+
+        Renderer::Texture trickplay_texture;
+        std::shared_ptr<const TrickplayGenerator::Atlas> trickplay_atlas; // Currently uploaded to the texture
+
+        // Horizontal extent of the seek bar on screen
+        float bar_min_x = 0.0f, bar_max_x = 0.0f;
 };
 
 struct MpvOptionCheckbox {
@@ -327,7 +341,7 @@ class PlayerMenu final: public Widget {
         };
 
         struct PlaylistEntryInfo {
-            std::string name;
+            std::string name, filename;
             std::int64_t id;
             bool playing;
         };
@@ -356,6 +370,8 @@ class PlayerMenu final: public Widget {
         std::int64_t dropped_vo_frames = 0, dropped_dec_frames = 0;
         double demuxer_cache_begin = 0, demuxer_cache_end = 0, demuxer_cache_speed = 0;
         std::int64_t demuxer_cached_bytes = 0, demuxer_forward_bytes = 0;
+        std::uint64_t io_last_read_bytes = 0, io_last_fetched_bytes = 0;
+        double io_read_speed = 0, io_fetch_speed = 0;
         int video_unscaled, keepaspect;
 
     private:
@@ -706,6 +722,7 @@ class PlayerGui final: public Widget {
         constexpr static float TouchGestureYMultipler        = 1.5f;   // > 1 so we can go from 0 to 100% in one swipe
         constexpr static auto  MovieCaptureTimeout           = std::chrono::nanoseconds(500ms).count();
         constexpr static auto  BrightnessVolumeChangeTimeout = 0.3s;
+        constexpr static double PlaylistPrefetchLead         = 30.0; // Seconds before the end of the current entry
 
     public:
         PlayerGui(Renderer &renderer, Context &context, LibmpvController &lmpv);
@@ -726,6 +743,18 @@ class PlayerGui final: public Widget {
             return this->seek_bar.pause;
         }
 
+        inline double time_pos() const {
+            return this->seek_bar.time_pos;
+        }
+
+        inline double duration() const {
+            return this->seek_bar.duration;
+        }
+
+        inline const std::string &path() const {
+            return this->seek_bar.path;
+        }
+
         template <typename T, typename ...Args>
         inline void set_show_string(T timeout, Args &&...args) {
             this->has_show_string = true;
@@ -737,6 +766,9 @@ class PlayerGui final: public Widget {
     private:
         void screenshot_button_thread_fn(std::stop_token token);
 
+        // Warms the caches for the next playlist entry when nearing the end of the current one
+        void update_prefetch();
+
     private:
         LibmpvController &lmpv;
         Context          &context;
@@ -17,6 +17,7 @@
 
 #pragma once
 
+#include <cstdint>
 #include <cstdlib>
 #include <cstdio>
 #include <cstring>
@@ -84,6 +85,14 @@ struct ScopeGuard {
         F f;
 };
 
+// FNV-1a, for keys persisted to storage which need a hash that is stable across builds
+constexpr std::uint64_t stable_hash(std::string_view str) {
+    std::uint64_t hash = 0xcbf29ce484222325ull;
+    for (auto c: str)
+        hash = (hash ^ std::uint8_t(c)) * 0x100000001b3ull;
+    return hash;
+}
+
 static inline std::pair<double, std::string_view> to_human_size(std::size_t bytes) {
     static std::array suffixes = {
         "B"sv, "kiB"sv, "MiB"sv, "GiB"sv, "TiB"sv, "PiB"sv,